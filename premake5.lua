@@ -1,14 +1,20 @@
 workspace "MatrixRain"
     architecture "x86_64"
-    configurations { "Debug", "Release", "Win64ScreenSaver" }
+    configurations { "Debug", "Release", "Profile", "Win64ScreenSaver" }
     startproject "MatrixRain"
     location(_ACTION)
 
     filter "configurations:Debug"
-        defines { "DEBUG" }
+        defines { "DEBUG", "MR_PROFILE" }
         symbols "On"
         optimize "Off"
 
+    -- Release with the instrumentation for --trace
+    filter "configurations:Profile"
+        defines { "MR_PROFILE" }
+        symbols "On"
+        optimize "Full"
+
     filter "configurations:Release"
         symbols "Off"
         optimize "Full"
@@ -0,0 +1,158 @@
+#include "allocation.h"
+
+#include <cstdlib>
+#include <new>
+
+#if defined(MR_WINDOWS)
+#include <malloc.h>
+#endif
+
+namespace mr
+{
+
+  // Trivial, so there's no lazy initialization in the way of operator new
+  static thread_local allocation_count s_thread_allocations;
+
+  allocation_count get_thread_allocations()
+  {
+    return s_thread_allocations;
+  }
+
+  static void *allocate(const std::size_t size)
+  {
+    s_thread_allocations.count++;
+    s_thread_allocations.bytes += size;
+    return std::malloc(size > 0 ? size : 1);
+  }
+
+  static void *allocate_aligned(const std::size_t size, const std::align_val_t alignment)
+  {
+    const auto a = static_cast<std::size_t>(alignment);
+
+    s_thread_allocations.count++;
+    s_thread_allocations.bytes += size;
+
+#if defined(MR_WINDOWS)
+    return _aligned_malloc(size > 0 ? size : 1, a);
+#else
+    // The size must be a multiple of the alignment
+    return std::aligned_alloc(a, size > 0 ? (size + a - 1) / a * a : a);
+#endif
+  }
+
+  static void free_aligned(void *ptr)
+  {
+#if defined(MR_WINDOWS)
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+  }
+
+}
+
+// Every other form of new and delete goes through these
+
+void *operator new(const std::size_t size)
+{
+  if (auto ptr = mr::allocate(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new[](const std::size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(const std::size_t size, const std::nothrow_t &) noexcept
+{
+  return mr::allocate(size);
+}
+
+void *operator new[](const std::size_t size, const std::nothrow_t &) noexcept
+{
+  return mr::allocate(size);
+}
+
+void *operator new(const std::size_t size, const std::align_val_t alignment)
+{
+  if (auto ptr = mr::allocate_aligned(size, alignment))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new[](const std::size_t size, const std::align_val_t alignment)
+{
+  return operator new(size, alignment);
+}
+
+void *operator new(const std::size_t size, const std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return mr::allocate_aligned(size, alignment);
+}
+
+void *operator new[](const std::size_t size, const std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return mr::allocate_aligned(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+  mr::free_aligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+  mr::free_aligned(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+  mr::free_aligned(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+  mr::free_aligned(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  mr::free_aligned(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  mr::free_aligned(ptr);
+}
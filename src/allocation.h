@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+namespace mr
+{
+
+  // Heap allocations made through the global operator new, which is replaced in allocation.cpp to count them. Each
+  // thread has its own count, so measuring a piece of code costs nothing more than two reads
+  struct allocation_count
+  {
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+
+    allocation_count operator-(const allocation_count &other) const { return {count - other.count, bytes - other.bytes}; }
+    allocation_count &operator+=(const allocation_count &other)
+    {
+      count += other.count;
+      bytes += other.bytes;
+      return *this;
+    }
+  };
+
+  // Everything the calling thread allocated since it started
+  allocation_count get_thread_allocations();
+
+  // Adds what the calling thread allocates during the lifetime of the scope to the given count
+  class allocation_scope
+  {
+  private:
+    allocation_count &m_total;
+    allocation_count m_start;
+
+  public:
+    explicit allocation_scope(allocation_count &total) : m_total(total), m_start(get_thread_allocations()) {}
+    ~allocation_scope() { m_total += get_thread_allocations() - m_start; }
+
+    allocation_scope(const allocation_scope &) = delete;
+    allocation_scope &operator=(const allocation_scope &) = delete;
+  };
+
+}
@@ -1,6 +1,7 @@
 #include "application.h"
 
 #include <thread>
+#include <atomic>
 #include <memory>
 #include <numeric>
 #include <algorithm>
@@ -11,13 +12,21 @@
 #include <iostream>
 #include <vector>
 #include <concepts>
+#include <iterator>
+#include <bit>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <optional>
+#include <limits>
+#include <cstdlib>
+#include <filesystem>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
 #ifdef DEBUG
 #include <imgui.h>
-#include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
 #endif
 
@@ -25,6 +34,11 @@
 #include "common.h"
 #include "font.h"
 #include "embed.h"
+#include "replay.h"
+#include "allocation.h"
+#include "trace.h"
+#include "metrics.h"
+#include "gpu_memory.h"
 
 namespace mr
 {
@@ -45,6 +59,30 @@ namespace mr
     float speed = 0.0f;
     size_t layer_index = 0;
     std::int32_t length = 0;
+
+    // Random numbers for each respawn come from a stream keyed by (id, generation)
+    std::uint32_t id = 0;
+    std::uint32_t generation = 0;
+  };
+
+  // Where strings can go in the columns of a layer. Strings in the same column never overlap if
+  // the new one doesn't catch up with the last one before it leaves the screen, so only the last
+  // string of each column is needed. Columns whose last string already left are flagged as idle
+  struct column_occupancy
+  {
+    static constexpr std::uint32_t s_none = ~0u;
+
+    struct column
+    {
+      std::uint32_t string = s_none; // Last string that entered this column
+      double wake_time = 0.0;
+      float speed = 0.0f;
+      std::int32_t length = 0;
+    };
+
+    std::int32_t row_count = 0;
+    std::vector<column> columns;
+    std::vector<std::uint64_t> idle; // One bit per column
   };
 
   struct terminal_state
@@ -54,66 +92,435 @@ namespace mr
     float timer = 0.5f;
   };
 
+  // The terminal text, laid out on the render thread. Cells are appended to a vertex buffer as the characters are typed,
+  // and the layout only starts over for a new message, or when the view changes
+  struct terminal_layout
+  {
+    std::size_t message = std::numeric_limits<std::size_t>::max();
+    std::size_t length = 0; // Characters laid out, including line breaks
+    std::size_t cell_count = 0;
+    std::int32_t view_width = 0, view_height = 0;
+    vec2f origin, pen;
+    vec2f min, max; // Bounding box of the text, in view units
+  };
+
   using clock_t = std::chrono::high_resolution_clock;
 
+  // Time spent in each stage of the code scene, accumulated between reports (stress mode only)
+  struct stress_stats
+  {
+    std::size_t frames = 0;
+    std::size_t active = 0;
+    std::size_t cells = 0;
+    std::size_t overlaps = 0;
+    std::size_t allocations = 0;
+    clock_t::duration simulation{}, layers{}, post{};
+    clock_t::time_point mark, last_report;
+  };
+
+  // Where the allocations of a frame are made, checked by --alloc-check
+  enum class alloc_scope
+  {
+    simulation,
+    events,
+    render,
+    present,
+    count
+  };
+
+  // Passes measured on the GPU
+  enum class gpu_pass
+  {
+    layers,
+    blur,
+    bloom,
+    tonemap,
+    count
+  };
+
+  // Settings changed by the dynamic resolution controller
+  struct quality_level
+  {
+    float render_scale;
+    std::size_t bloom_levels;   // 0 is all of them
+    std::size_t skipped_layers; // Background layers that are not drawn, starting from the farthest
+  };
+
+  // Quality tiers, picked once per machine by the startup calibration. The dynamic resolution works on top of them
+  struct quality_tier
+  {
+    float render_scale;
+    std::size_t skipped_layers;
+    std::int32_t blur_scale;     // The background layers are blurred at 1/blur_scale of the resolution
+    std::size_t blur_iterations; // 0 doesn't blur them at all
+    bool bloom;                  // Without bloom, the layers are tonemapped straight to the screen
+    std::size_t bloom_levels;    // 0 is all of them
+  };
+
+  // Times measured by the calibration probe, in ms, summed over the measured frames
+  struct calibration_state
+  {
+    bool active = false;
+    clock_t::time_point start;
+    std::size_t frames = 0;
+    double layer = 0.0, blur = 0.0, bloom = 0.0;
+    std::array<GLuint, 3> queries{};
+    std::vector<character_cell> cells; // A screen full of front layer cells
+  };
+
+  // Frame rate and latency, printed periodically with --frame-stats
+  struct frame_stats
+  {
+    std::size_t frames = 0;
+    std::size_t latency_samples = 0;
+    clock_t::duration latency{}, max_latency{};
+    clock_t::time_point last_report;
+  };
+
+  // Parts of a frame on the render thread, for the hitch log. The simulation of the frame ran in parallel, on its thread
+  enum class frame_phase
+  {
+    events,  // Window events, fences and GPU times
+    wait,    // For the simulation to hand over the frame
+    upload,  // Instances and text layout
+    layers,  // The layers, or the terminal text
+    post,    // Blur, bloom and tonemapping
+    overlay, // Performance overlay and debug GUI
+    present, // Frame rate limiter and swap
+    count
+  };
+
+  // Where the time of a frame went. Every mark adds the time since the previous one to a phase
+  struct frame_timing
+  {
+    clock_t::time_point start, mark;
+    std::array<clock_t::duration, static_cast<std::size_t>(frame_phase::count)> phases{};
+    clock_t::duration simulation{};
+    std::size_t frame = 0;
+    scenes scene = scenes::terminal;
+    bool counted = false; // Only frames rendered while running count, not idle ones
+  };
+
+  // A frame over the hitch budget, waiting for the GPU times of its passes
+  struct frame_hitch
+  {
+    bool pending = false;
+    clock_t::duration time{};
+    frame_timing timing;
+  };
+
+  // Settings that can be changed through the control socket, in the order of s_control_settings
+  enum class control_settings
+  {
+    exposure,
+    bloom_threshold,
+    bloom_knee,
+    blur,
+    bloom_levels,
+    quality,
+    tier
+  };
+
+  // Fence inserted after a swap. The frame latency is from the moment the simulation started working on the frame,
+  // to the moment the GPU went past the fence
+  struct frame_fence
+  {
+    GLsync sync = nullptr;
+    clock_t::time_point start;
+  };
+
+  // Window callbacks are forwarded from the event thread to the render thread with these
+  struct window_event
+  {
+    enum class types
+    {
+      resize,
+      framebuffer_resize,
+      key,
+      cursor,
+      mouse_button, // Debug GUI only
+      scroll,       // Same
+      iconify,
+      focus
+    };
+
+    types type = types::resize;
+    std::int32_t width = 0, height = 0;
+    std::int32_t key = 0; // Key or mouse button
+    float x = 0.0f, y = 0.0f; // Cursor position or scroll offset
+    bool value = false; // Iconified, focused, key or button pressed
+  };
+
+  // Everything the GL thread needs to render a frame, produced by the simulation thread
+  struct simulation_frame
+  {
+    scenes scene = scenes::terminal;
+    terminal_state terminal;
+    float view_height = 0.0f;
+    std::vector<glyph_swap> glyph_swaps; // Picked here, the palette lives on the GPU so the GL thread applies them
+    std::size_t active_strings = 0;
+    std::uint64_t avoided_overlaps = 0; // Since the start, see occupy_column
+    clock_t::duration simulation_time{};
+    allocation_count simulation_allocations;
+    clock_t::time_point start_time;
+    bool last = false; // End of the replay
+    std::vector<std::vector<character_cell>> grids; // One for each layer
+  };
+
   // Function declarations
+  static std::vector<std::int32_t> get_rain_candidates();
   static auto get_window_size();
   static auto get_view_size();
   static auto get_mouse_pos();
 
-  static const glyph &get_random_glyph(const std::int32_t x, const std::int32_t y);
+  static std::int32_t get_random_glyph(const std::int32_t x, const std::int32_t y);
+  static void size_simulation();
   static void init_falling_string(falling_string &s, const float view_height);
-  static void update_falling_string(falling_string &s, const float dt, const float view_width, const float view_height);
-
+  static void reset_column_occupancy(const float view_height);
+  static double get_column_free_time(const column_occupancy &occupancy, const std::int32_t x, const float speed);
+  static void occupy_column(falling_string &s, const std::uint32_t index, double &wake_time);
+  static void release_column(const falling_string &s, const std::uint32_t index);
+  static void park_falling_string(const std::uint32_t index, const float view_height);
+  static void wake_falling_string(const std::uint32_t index, const double wake_time);
+  static bool step_falling_string(falling_string &s, const float dt);
+  static void emit_falling_string(const falling_string &s, const float alpha, std::vector<std::vector<character_cell>> &grids);
+
+  static void stress_mark(clock_t::duration *stage);
+  static std::size_t count_overlapping_cells(const simulation_frame &frame);
+  static void report_stress_stats(const simulation_frame &frame);
+  static allocation_count &get_frame_allocations(const alloc_scope scope);
+  static void check_frame_allocations(const scenes scene);
+
+  static void retire_frame_fences();
+  static void insert_frame_fence(const clock_t::time_point start);
+  static void limit_frame_rate(const float fps);
+  static idle_mode get_idle_mode();
+  static void report_frame_stats();
+  static double get_fragments_per_pixel();
+  static bool allows_dynamic_quality();
+  static void apply_control_commands();
+  static void mark_frame_phase(const frame_phase phase);
+  static void finish_frame_timing(const std::size_t iteration);
+  static void log_frame_hitch(const std::size_t iteration, const bool has_gpu_times);
+  static void report_frame_histogram(const duration_histogram &histogram, const std::size_t hitches, const std::string_view label);
+  static void report_gpu_memory();
+
+  static void begin_gpu_pass(const gpu_pass pass);
+  static void end_gpu_pass();
+  static std::size_t get_bloom_levels(const std::size_t a, const std::size_t b);
+  static void set_quality_level(const std::size_t level);
+  static void update_quality();
+  static void set_quality_tier(const std::size_t index);
+  static double estimate_frame_time(const quality_tier &tier);
+  static std::string get_calibration_cache_file();
+  static std::string get_renderer_name();
+  static std::optional<std::size_t> load_cached_tier();
+  static void save_cached_tier(const std::size_t tier);
+  static void select_quality_tier();
+  static void run_calibration_probe(const float view_height);
+  static void finish_calibration();
+
+  static void check_glsl_rng();
   static void render_debug_gui();
-  static void render_characters(const std::vector<character_cell> &cells, const font &font, const float view_width, const float view_height);
-  static void render_terminal(const float dt);
-  static void render_code(const float dt);
-  static void render_hdr_to_screen(const GLuint tx_base, const GLuint tx_bloom);
-
-  static void resize();
+  static void show_hud(const bool visible);
+  static void update_hud_text(const simulation_frame &frame, const float cpu_time);
+  static void render_hud(const simulation_frame &frame, const float cpu_time);
+  static void render_characters(const std::vector<character_cell> &cells, const font &font, const GLuint program, const float view_width, const float view_height);
+  static void render_characters_to_screen(const std::vector<character_cell> &cells, const font &font, const GLuint program, const float view_width, const float view_height);
+  static void update_terminal(const float dt);
+  static bool load_terminal_messages(const std::string_view text);
+  static void update_terminal_layout(const terminal_state &state, const std::int32_t view_width, const std::int32_t view_height);
+  static void render_terminal_text(const GLuint program, const float view_width, const float view_height);
+  static void use_characters_program(const font &font, const GLuint program, const float view_width, const float view_height);
+  static void update_code(const float dt, simulation_frame &frame);
+  static void render_terminal(const simulation_frame &frame);
+  static void render_code(const simulation_frame &frame);
+  static void render_overdraw(const simulation_frame &frame);
+  static void render_hdr_to_screen(const GLuint tx_base, const GLuint tx_bloom, const render_extent &extent, const pixel_rect &region);
+  static pixel_rect get_terminal_rect(const vec2f &min, const vec2f &max, const float view_width, const float view_height);
+
+  static void reset_simulation(const float width, const float height);
+  static void reschedule_columns();
+  static void resize_simulation(const float width, const float height);
+  static bool next_replay_frame(replay_event &frame);
+  static void simulate(simulation_frame &frame, replay_event &timing);
+  static void run_simulation();
+  static void stop_simulation();
+  static void allocate_render_targets();
+  static void update_render_size();
+  static void resize(const bool allow_grow);
+  static void set_cell_attributes();
   static void initialize();
+  static void process_window_events();
+  static void release_resources();
+  static void render();
+  static void run_renderer();
   static void terminate(const int32_t exit_code);
   static void on_window_resize(GLFWwindow *, std::int32_t, std::int32_t);
+  static void on_framebuffer_resize(GLFWwindow *, std::int32_t, std::int32_t);
   static void on_key(GLFWwindow *, std::int32_t, std::int32_t, std::int32_t, std::int32_t);
+  static void on_window_iconify(GLFWwindow *, std::int32_t);
+  static void on_window_focus(GLFWwindow *, std::int32_t);
 
   // Fixed animation settings
   static constexpr float s_glyph_swaps_per_second = 10.0f; // Number of glyphs swapped per second (roughly)
-  static constexpr std::int32_t s_blur_scale = 1;
-  static constexpr std::int32_t s_col_count = 80;
-  static constexpr std::int32_t s_falling_strings_count = 1500;
+  static constexpr std::size_t s_max_glyph_swaps = 16;      // In a frame, more are only skipped when fast-forwarding
   static constexpr std::int32_t s_falling_string_min_length = 15;
   static constexpr std::int32_t s_falling_string_max_length = 40;
   static constexpr std::int32_t s_falling_string_min_speed = 10;
   static constexpr std::int32_t s_falling_string_max_speed = 30;
 
-  static constexpr std::array<float, 4> s_depth_layers = {
-      0.15f,
-      0.30f,
-      0.50f,
-      1.00f,
+  // Instances are uploaded in batches of this size, so the vertex buffer doesn't grow with the number of strings
+  static constexpr std::size_t s_max_batch_cells = 1 << 16;
+
+  static constexpr auto s_stress_report_interval = std::chrono::seconds(2);
+
+  static constexpr std::array s_frame_phase_names = {"events"sv, "wait"sv, "upload"sv, "layers"sv, "post"sv, "overlay"sv, "present"sv};
+  static constexpr std::array s_gpu_pass_names = {"layers"sv, "blur"sv, "bloom"sv, "tonemap"sv};
+
+  // With --alloc-check, frames must not allocate once this many went by without a scene change, a resize or a change of
+  // quality, which are expected to allocate (the grids and the render targets grow)
+  static constexpr std::size_t s_alloc_warmup_frames = 120;
+  static constexpr std::array s_alloc_scope_names = {"simulation"sv, "events"sv, "render"sv, "present"sv};
+
+  // Overdraw view, toggled with s_overdraw_key. The heat map goes from black to red at s_overdraw_max_count fragments
+  static constexpr std::int32_t s_overdraw_key = GLFW_KEY_F4;
+  static constexpr float s_overdraw_max_count = 8.0f;
+
+  // Performance overlay, toggled with s_hud_key. The text is refreshed every s_hud_text_interval, so it can be read,
+  // the sparkline every frame. The frame rate and the p99 are over the last s_hud_samples frames
+  static constexpr std::int32_t s_hud_key = GLFW_KEY_F3;
+  static constexpr std::size_t s_hud_samples = 240;
+  static constexpr std::size_t s_hud_sparkline_samples = 120;
+  static constexpr std::size_t s_hud_max_cells = 1024;
+  static constexpr auto s_hud_text_interval = std::chrono::milliseconds(250);
+  static constexpr float s_hud_font_size = 14.0f; // Pixels
+  static constexpr float s_hud_sparkline_height = 48.0f;
+  static constexpr vec4f s_hud_text_color = {0.9f, 0.9f, 0.9f, 1.0f};
+  static constexpr vec4f s_hud_good_color = {0.3f, 1.0f, 0.3f, 1.0f};
+  static constexpr vec4f s_hud_bad_color = {1.0f, 0.3f, 0.2f, 1.0f};
+
+  // Frame pacing. The frame rate limiter sleeps until this long before the next frame is due, and spins the rest,
+  // since sleeps are not that precise. Waiting for a fence is done in slices of s_fence_timeout
+  static constexpr std::size_t s_max_frames_in_flight = 3;
+  static constexpr auto s_frame_limiter_spin = std::chrono::milliseconds(2);
+  static constexpr GLuint64 s_fence_timeout = 100'000'000; // ns
+
+  // While suspended, the render thread only looks at the window events this often. When the rain comes back from
+  // a pause, it catches up with at most s_max_catch_up seconds, taking s_catch_up_steps extra steps per frame
+  static constexpr auto s_suspend_poll_interval = std::chrono::milliseconds(100);
+  static constexpr float s_max_catch_up = 10.0f;
+  static constexpr std::int32_t s_catch_up_steps = 4;
+
+  // Quality levels for the dynamic resolution, from best to worst. The controller moves one level at a time
+  static constexpr std::array s_quality_levels = {
+      quality_level{1.0f, 0, 0},
+      quality_level{0.85f, 0, 0},
+      quality_level{0.7f, 0, 0},
+      quality_level{0.7f, 6, 1},
+      quality_level{0.6f, 6, 1},
+      quality_level{0.5f, 5, 2},
+      quality_level{0.4f, 4, 3},
   };
 
-  static constexpr std::array<float, s_depth_layers.size()> s_depth_layers_fade = ([] {
-    std::array<float, s_depth_layers.size()> result;
-    for (size_t i = 0; i < result.size(); ++i)
-      result[i] = s_depth_layers[i] * s_depth_layers[i];
-    return result;
-  })();
+  // The GPU time is averaged over this many frames. Quality goes down when the average is over the frame budget, and
+  // up when it's under s_quality_headroom of it. The gap between the two keeps the quality from going back and forth
+  static constexpr std::size_t s_quality_window = 30;
+  static constexpr double s_quality_headroom = 0.6;
+
+  // Quality tiers, from best to worst. Blurring at half resolution is the cheapest step, then the bloom and the
+  // background layers go, and at the bottom there's no bloom at all (the most expensive pass on weak GPUs)
+  static constexpr std::array s_quality_tiers = {
+      quality_tier{1.0f, 0, 1, 1, true, 0},
+      quality_tier{1.0f, 0, 2, 1, true, 0},
+      quality_tier{0.75f, 1, 2, 1, true, 6},
+      quality_tier{0.75f, 1, 2, 1, false, 0},
+      quality_tier{0.5f, 2, 2, 0, false, 0},
+  };
 
+  // Ranges of the settings of the control socket. A bloom level limit of 0 is no limit, and quality level -1 is the
+  // dynamic one
+  static constexpr std::array s_control_settings = {
+      control_setting{"exposure", 0.1f, 10.0f},
+      control_setting{"bloom-threshold", 0.1f, 5.0f},
+      control_setting{"bloom-knee", 0.0f, 0.5f},
+      control_setting{"blur", 0.0f, 1.0f},
+      control_setting{"bloom-levels", 0.0f, 16.0f, true},
+      control_setting{"quality", -1.0f, static_cast<float>(s_quality_levels.size() - 1), true},
+      control_setting{"tier", 0.0f, static_cast<float>(s_quality_tiers.size() - 1), true},
+  };
+
+  // The calibration probe runs for this long during the intro, after skipping the first frames (shader compilation
+  // and the like). It picks the best tier whose estimated GPU time is within s_calibration_budget of the frame budget
+  static constexpr auto s_calibration_time = std::chrono::milliseconds(500);
+  static constexpr std::size_t s_calibration_warmup_frames = 3;
+  static constexpr double s_calibration_budget = 0.75;
+  static constexpr float s_calibration_fps = 60.0f; // Frame rate used when there's no target
+
+  // Strings waiting to enter the screen are parked here. With this tick the wheel covers 32 seconds, more
+  // than most strings wait, and the ones that wait longer are just skipped until their turn comes
+  static constexpr std::size_t s_respawn_wheel_buckets = 512;
+  static constexpr double s_respawn_wheel_tick = 1.0 / 16.0;
+
+  // When there are no idle columns, this many random columns are tried for a new string. If
+  // none of them is free in time, the string waits for the one that gets free first
+  static constexpr std::int32_t s_column_probes = 16;
+
+  // Default intro, each message replaces the previous one (see load_terminal_messages)
   static constexpr std::array s_terminal_lines = {
-      "Wake up, Neo..."sv,
-      "The Matrix has you..."sv,
-      "Follow the white rabbit."sv,
-      "Knock, knock, Neo."sv};
+      U"Wake up, Neo..."sv,
+      U"The Matrix has you..."sv,
+      U"Follow the white rabbit."sv,
+      U"Knock, knock, Neo."sv};
+
+  static constexpr float s_terminal_font_size = 1.0f;
+  static constexpr float s_terminal_line_height = 1.25f;
+
+  // The terminal glow is limited to this many bloom levels, so that its radius (and the area redrawn around the text) is
+  // not the whole screen. The levels past these barely show around a single line
+  static constexpr std::size_t s_terminal_bloom_levels = 6;
 
   static constexpr auto s_exit_on_input_delay = std::chrono::milliseconds(1500);
 
+  // When the window gets bigger than the render targets, they only grow after its size didn't change for this long, so
+  // dragging the window border doesn't reallocate them on every event. In the meantime the frame is stretched
+  static constexpr auto s_resize_debounce = std::chrono::milliseconds(250);
+
+  // The simulation always advances by this amount, so it gives the same results no matter the frame rate. After a
+  // long frame it doesn't try to catch up more than s_max_frame_time, it's better to just slow down for a moment
+  static constexpr float s_simulation_step = 1.0f / 60.0f;
+  static constexpr float s_max_frame_time = 0.25f;
+
   static GLFWwindow *s_window = nullptr;
 
+  // The main thread only pumps the window events, the GL context belongs to the render thread. Window events
+  // are forwarded through s_window_events, so a window system stall (moving or resizing the window on X11) doesn't stop the rendering
+  static std::thread s_render_thread;
+  static spsc_queue<window_event, 1024> s_window_events;
+  static std::atomic<bool> s_render_stop = false;
+  static std::int32_t s_exit_code = 0; // Set by the render thread, read after it's joined
+  static std::string s_render_error;   // Same
+
+  // Thrown by terminate_with_error on the render thread, to get back to run_renderer. The event thread owns GLFW, so
+  // it's the one that reports the error and exits, once the render thread is done
+  struct render_error
+  {
+  };
+  static std::int32_t s_window_width = 0, s_window_height = 0; // Render thread only
+  static std::int32_t s_framebuffer_width = 0, s_framebuffer_height = 0; // Same, in pixels (bigger on HiDPI screens)
+  static std::int32_t s_max_render_width = 0, s_max_render_height = 0; // Biggest monitor, set before the render thread starts
+  static bool s_window_iconified = false, s_window_focused = true;     // Render thread only
+
   // Programs
   static GLuint s_prg_hdr = 0;
+  static GLuint s_prg_hdr_no_bloom = 0;
   static GLuint s_prg_strings = 0;
+  static GLuint s_prg_strings_palette = 0;
+  static GLuint s_prg_strings_tonemap = 0;
+  static GLuint s_prg_strings_palette_tonemap = 0;
+  static GLuint s_prg_strings_overdraw = 0;
+  static GLuint s_prg_strings_palette_overdraw = 0;
+  static GLuint s_prg_overdraw = 0;
   static GLuint s_prg_pass_trough = 0;
 
   static GLuint s_va = 0; // Vertex Array
@@ -125,6 +532,15 @@ namespace mr
   // Final render texture
   static GLuint s_tx_final_render = 0;
 
+  // Size of s_tx_final_render, the blur textures and the bloom chain (the blur ones are scaled down by s_blur_scale)
+  static render_extent s_render_extent;
+  static float s_render_scale = 1.0f; // Fraction of the window size actually rendered, then stretched
+  static bool s_grow_pending = false;
+  static clock_t::time_point s_last_resize;
+  static std::int32_t s_blur_scale = 1; // From the quality tier
+  static std::size_t s_bloom_levels = 0; // From the quality level and tier, 0 is all of them
+  static std::size_t s_bloom_level_limit = 0; // Set through the control socket, 0 is no limit
+
   // Blur textures
   static GLuint s_tx_blur0 = 0;
   static GLuint s_tx_blur1 = 0;
@@ -149,37 +565,316 @@ namespace mr
   static launch_config s_config;
   static clock_t::time_point s_start_time;
 
+  // Rain layout, from the launch config (see size_simulation)
+  static std::int32_t s_col_count = 80;
+  static float s_view_height = 0.0f; // Height of the simulated view, in front layer cells
+  static std::vector<float> s_depth_layers;
+  static std::vector<float> s_depth_layers_fade;
+  static std::vector<std::size_t> s_layer_strings; // Strings in each layer
+
+  // Frame pacing (render thread only)
+  static std::array<frame_fence, s_max_frames_in_flight> s_frame_fences;
+  static std::size_t s_frame_fence_head = 0, s_frame_fence_count = 0;
+  static clock_t::time_point s_next_frame_time;
+  static bool s_frozen = false; // Paused or suspended
+  static clock_t::time_point s_freeze_time;
+
+  // Dynamic resolution (render thread only)
+  static std::unique_ptr<gpu_timer> s_gpu_timer;
+  static bool s_dynamic_quality = false;
+  static std::size_t s_quality_level = 0;
+  static std::size_t s_skipped_layers = 0;
+  static std::size_t s_quality_samples = 0;
+  static std::size_t s_quality_skip_frames = 0;
+  static double s_quality_gpu_time = 0.0;
+  static std::size_t s_tier_index = 0;
+  static quality_tier s_tier = s_quality_tiers[0];
+  static calibration_state s_calibration;
+
+  // Allocations of the current frame, and frames since the last change (render thread only)
+  static std::array<allocation_count, static_cast<std::size_t>(alloc_scope::count)> s_frame_allocations;
+  static std::size_t s_alloc_quiet_frames = 0;
+  static scenes s_alloc_scene = scenes::terminal;
+
+  // Performance overlay (render thread only). The cells are the text, then the sparkline
+  static bool s_hud_visible = false;
+  static bool s_overdraw = false;
+  static clock_t::time_point s_debug_gui_last_frame;
+  static std::array<float, s_hud_samples> s_hud_frame_times{}; // ms, a ring
+  static std::size_t s_hud_frame_count = 0;
+  static clock_t::time_point s_hud_last_frame, s_hud_last_text;
+  static std::vector<character_cell> s_hud_cells;
+  static std::size_t s_hud_text_cells = 0;
+  static GLuint s_va_hud = 0, s_vb_hud = 0;
+
   // Data
+  static stress_stats s_stress_stats;
+  static frame_stats s_frame_stats;
+  static std::unique_ptr<metrics_exporter> s_metrics;
+
+  // Frame times over the whole run and since the last periodic report, and the frames over the hitch budget by the
+  // slot their GPU times come back in
+  static frame_timing s_frame_timing;
+  static duration_histogram s_frame_histogram, s_frame_histogram_interval;
+  static clock_t::time_point s_frame_histogram_report;
+  static std::size_t s_hitch_count = 0, s_hitch_count_interval = 0;
+  static std::array<frame_hitch, gpu_timer::s_frame_lag> s_frame_hitches;
+
+  // GPU memory by owner, as of the last report
+  static gpu_memory::usage s_gpu_memory_reported;
+  static std::vector<std::u32string> s_terminal_messages(s_terminal_lines.begin(), s_terminal_lines.end());
+
+  // Terminal dirty rectangle (render thread only). The area around the text is cleared once, when s_terminal_clean
+  // is false, then only the text and its glow are redrawn, and only when the text changes
+  static bool s_terminal_clean = false;
+  static pixel_rect s_terminal_rect;
+  static std::size_t s_terminal_drawn_line = 0, s_terminal_drawn_char = 0;
+  static GLuint s_tx_terminal_bloom = 0;
+  static terminal_layout s_terminal_layout;
+  static GLuint s_va_terminal = 0, s_vb_terminal = 0;
+
+  // Simulation thread. Everything the simulation uses is only touched by that thread once it's started,
+  // the GL thread only gets the frames through s_frames, and posts the window size in s_pending_size
+  static std::thread s_simulation_thread;
+  static std::atomic<bool> s_simulation_stop = false;
+  static std::atomic<std::uint64_t> s_pending_size = 0; // Width in the high 32 bits, height in the low ones
+  static std::atomic<float> s_catch_up_time = 0.0f;      // Seconds to fast-forward, posted by the GL thread
+  static triple_buffer<simulation_frame> s_frames;
   static scenes s_scene = scenes::terminal;
   static terminal_state s_terminal_state;
-  static std::vector<character_cell> s_terminal_cells;
-  static std::array<std::vector<character_cell>, s_depth_layers.size()> s_grids;
-  static std::array<falling_string, s_falling_strings_count> s_falling_strings;
+  static rng::stream s_simulation_rng;
+  static std::size_t s_palette_size = 0, s_palette_candidates = 0; // Of the rain font, for the glyph swaps
+
+  // Ids of the streams that don't belong to a string (those are numbered from 0)
+  static constexpr std::uint32_t s_simulation_stream_id = ~0u;
+  static constexpr std::uint32_t s_main_stream_id = ~1u;
+  static constexpr std::uint32_t s_render_stream_id = ~2u;
+  static constexpr std::uint32_t s_palette_stream_id = ~3u;
+  static std::vector<falling_string> s_falling_strings;
+  static std::vector<std::uint32_t> s_active_strings; // Indices of the strings that are on screen
+  static std::vector<column_occupancy> s_column_occupancy; // One for each layer
+  static std::uint64_t s_avoided_overlaps = 0; // Strings that occupy_column moved to another column or delayed
+  static timing_wheel s_respawn_wheel(s_respawn_wheel_buckets, s_respawn_wheel_tick);
+  static double s_simulation_time = 0.0;
   static std::unique_ptr<font> s_font, s_terminal_font;
   static std::unique_ptr<blur_filter> s_blur_filter;
+  static std::unique_ptr<replay_writer> s_replay_writer;
+  static std::unique_ptr<replay_reader> s_replay_reader;
   static std::unique_ptr<bloom> s_fx_bloom;
 
-  static void init_falling_string(falling_string &s, const float view_height)
+  template <typename T>
+  static T lerp_random(const float r, const T min, const T max)
+  {
+    return min + static_cast<T>((max - min) * r);
+  }
+
+  // Number of columns of a depth layer, the farther the layer the more columns
+  static std::int32_t get_layer_columns(const std::size_t layer_index)
+  {
+    return static_cast<std::int32_t>(s_col_count / s_depth_layers[layer_index]);
+  }
+
+  // Sizes the string pool and the per layer grids from the launch config. Each layer gets its
+  // own share of the pool (density * columns of the layer), and strings never change layer
+  static void size_simulation()
   {
-    const float t = rng::next();
+    s_col_count = s_config.columns;
+    s_depth_layers = s_config.depth_layers;
+
+    // Layers are rendered back to front
+    std::ranges::sort(s_depth_layers);
+
+    s_depth_layers_fade.resize(s_depth_layers.size());
+    for (size_t i = 0; i < s_depth_layers.size(); ++i)
+      s_depth_layers_fade[i] = s_depth_layers[i] * s_depth_layers[i];
+
+    std::int32_t total_columns = 0;
+    for (std::size_t i = 0; i < s_depth_layers.size(); ++i)
+      total_columns += get_layer_columns(i);
 
-    s.layer_index = static_cast<std::size_t>(t * t * s_depth_layers.size());
-    s.speed = rng::next(s_falling_string_min_speed, s_falling_string_max_speed);
-    s.length = rng::next(s_falling_string_min_length, s_falling_string_max_length);
+    // In stress mode the density is whatever gives the requested number of strings
+    const double density = s_config.stress_strings > 0 ? static_cast<double>(s_config.stress_strings) / total_columns : s_config.density;
 
-    // Number of columns depends on the depth
-    const int32_t col_count = s_col_count / s_depth_layers[s.layer_index];
-    s.x = rng::next(0, col_count);
+    s_falling_strings.clear();
+    s_layer_strings.assign(s_depth_layers.size(), 0);
+
+    // Rounding the running total, so the layers add up exactly to the requested amount
+    std::int32_t columns = 0;
+    for (std::size_t i = 0; i < s_depth_layers.size(); ++i)
+    {
+      columns += get_layer_columns(i);
+      const auto count = static_cast<std::size_t>(std::llround(density * columns)) - s_falling_strings.size();
+
+      s_layer_strings[i] = count;
+      for (std::size_t j = 0; j < count; ++j)
+      {
+        s_falling_strings.push_back({
+            .layer_index = i,
+            .id = static_cast<std::uint32_t>(s_falling_strings.size()),
+        });
+      }
+    }
+  }
+
+  static void init_falling_string(falling_string &s, const float view_height)
+  {
+    // Everything depends only on the string id and generation, so strings can be respawned in any
+    // order (or on any thread), and still get the same values
+    std::array<float, 4> r;
+    rng::stream(s_config.seed, s.id, s.generation++).next(r.data(), r.size());
+
+    s.speed = lerp_random(r[0], s_falling_string_min_speed, s_falling_string_max_speed);
+    s.length = lerp_random(r[1], s_falling_string_min_length, s_falling_string_max_length);
+    s.x = lerp_random(r[2], 0, get_layer_columns(s.layer_index));
 
     // The initial y position is actually randomized to be off screen.
-    s.y = -(s.length + rng::next(0, static_cast<std::int32_t>(view_height / s_depth_layers[s.layer_index])));
+    s.y = -(s.length + lerp_random(r[3], 0, static_cast<std::int32_t>(view_height / s_depth_layers[s.layer_index])));
+  }
+
+  static void reset_column_occupancy(const float view_height)
+  {
+    s_column_occupancy.resize(s_depth_layers.size());
+
+    for (std::size_t i = 0; i < s_depth_layers.size(); ++i)
+    {
+      auto &occupancy = s_column_occupancy[i];
+      const auto col_count = get_layer_columns(i);
+
+      occupancy.row_count = static_cast<std::int32_t>(std::ceil(view_height / s_depth_layers[i]));
+      occupancy.columns.assign(col_count, {});
+      occupancy.idle.assign((col_count + 63) / 64, ~std::uint64_t(0));
+
+      // Clear the bits past the last column
+      if (col_count % 64)
+        occupancy.idle.back() = (std::uint64_t(1) << (col_count % 64)) - 1;
+    }
+  }
+
+  // Earliest time a string with the given speed and length can enter column x, without ever touching the last string there
+  static double get_column_free_time(const column_occupancy &occupancy, const std::int32_t x, const float speed)
+  {
+    const auto &c = occupancy.columns[x];
+    if (c.string == column_occupancy::s_none)
+      return 0.0;
+
+    // One empty cell between the strings. Both positions are linear in time, so it's enough to check
+    // that the last string's tail is on screen when the new one enters, and that the new head is
+    // still above the bottom row when the last string's tail leaves
+    constexpr float gap = 1.0f;
+    const double tail_in = c.wake_time + (c.length + gap) / c.speed;
+    const double tail_out = c.wake_time + (occupancy.row_count + c.length) / c.speed;
+
+    return std::max(tail_in, tail_out - (occupancy.row_count - gap) / speed);
+  }
+
+  // Picks the column of a string, and possibly delays it (wake_time) so that it never overlaps with other strings
+  static void occupy_column(falling_string &s, const std::uint32_t index, double &wake_time)
+  {
+    auto &occupancy = s_column_occupancy[s.layer_index];
+    const auto col_count = static_cast<std::int32_t>(occupancy.columns.size());
+    const auto start_wake_time = wake_time;
+
+    // The column picked at random is used as a starting point
+    std::int32_t x = s.x;
+
+    // Look for an idle column first, starting from the random one
+    const auto word_count = static_cast<std::int32_t>(occupancy.idle.size());
+    const auto first_word = x / 64;
+
+    bool found = false;
+    for (std::int32_t i = 0; i <= word_count && !found; ++i)
+    {
+      const auto word = (first_word + i) % word_count;
+      auto bits = occupancy.idle[word];
+
+      // In the first word, only the bits from x onwards (the rest is checked in the last iteration)
+      if (i == 0)
+        bits &= ~std::uint64_t(0) << (x % 64);
+      else if (i == word_count)
+        bits &= (std::uint64_t(1) << (x % 64)) - 1;
+
+      if (bits)
+      {
+        x = word * 64 + std::countr_zero(bits);
+        found = true;
+      }
+    }
+
+    // Otherwise try some random columns, and keep the one that gets free first
+    if (!found)
+    {
+      double best_time = get_column_free_time(occupancy, x, s.speed);
+
+      for (std::int32_t i = 1; i < s_column_probes && best_time > wake_time; ++i)
+      {
+        const std::int32_t probe = rng::hash(rng::hash(s_config.seed, index), s.generation * s_column_probes + i) % col_count;
+        const double time = get_column_free_time(occupancy, probe, s.speed);
+        if (time < best_time)
+        {
+          x = probe;
+          best_time = time;
+        }
+      }
+
+      wake_time = std::max(wake_time, best_time);
+    }
+
+    // The string would have overlapped another one in the column it was given
+    if (x != s.x || wake_time > start_wake_time)
+      s_avoided_overlaps++;
+
+    s.x = x;
+    occupancy.columns[x] = {.string = index, .wake_time = wake_time, .speed = s.speed, .length = s.length};
+    occupancy.idle[x / 64] &= ~(std::uint64_t(1) << (x % 64));
+  }
+
+  // Called when a string leaves the screen: if it was the last one in its column, the column is idle now
+  static void release_column(const falling_string &s, const std::uint32_t index)
+  {
+    auto &occupancy = s_column_occupancy[s.layer_index];
+    if (occupancy.columns[s.x].string != index)
+      return;
+
+    occupancy.columns[s.x].string = column_occupancy::s_none;
+    occupancy.idle[s.x / 64] |= std::uint64_t(1) << (s.x % 64);
+  }
+
+  // Respawns a string and parks it in the timing wheel until its head reaches the first row. Until
+  // then the string is not simulated at all
+  static void park_falling_string(const std::uint32_t index, const float view_height)
+  {
+    auto &s = s_falling_strings[index];
+    init_falling_string(s, view_height);
+
+    double wake_time = s_simulation_time + (-0.5f - s.y) / s.speed;
+
+    if (!s_config.uniform_columns)
+      occupy_column(s, index, wake_time);
+
+    s_respawn_wheel.schedule(index, wake_time);
+  }
+
+  // The wheel wakes strings up a bit late, so they're moved where they would be if they were simulated all the time
+  static void wake_falling_string(const std::uint32_t index, const double wake_time)
+  {
+    auto &s = s_falling_strings[index];
+    s.y = -0.5f + s.speed * static_cast<float>(s_simulation_time - wake_time);
+    s_active_strings.push_back(index);
   }
 
+  static std::vector<std::int32_t> get_rain_candidates()
+  {
+    std::vector<std::int32_t> candidates;
+    for (const auto &[first, last] : s_config.rain_code_points)
+      for (auto cp = first; cp <= last; ++cp)
+        candidates.push_back(cp);
+    return candidates;
+  }
+
+  // Last size received by the render thread
   static auto get_window_size()
   {
-    std::int32_t x, y;
-    glfwGetWindowSize(s_window, &x, &y);
-    return std::tuple{float(x), float(y)};
+    return std::tuple{float(s_window_width), float(s_window_height)};
   }
 
   static auto get_view_size()
@@ -195,235 +890,1356 @@ namespace mr
     return std::tuple{std::int32_t(x), std::int32_t(y)};
   }
 
-  static const glyph &get_random_glyph(const std::int32_t x, const std::int32_t y)
+  // Returns an index in the font palette, the actual glyph is resolved on the GPU
+  static std::int32_t get_random_glyph(const std::int32_t x, const std::int32_t y)
   {
     // This numbers are completely made up. Worst hash function ever
     constexpr std::size_t s0 = 2836, s1 = 23873;
-    const auto &glyphs = s_font->get_glyphs();
-    const auto idx = static_cast<std::size_t>(x * s0 + y * s1) % glyphs.size();
-    return glyphs[idx];
+    return static_cast<std::size_t>(x * s0 + y * s1) % s_font->get_palette_size();
+  }
+
+  // Moves a string down, returns false when it's out of the screen
+  static bool step_falling_string(falling_string &s, const float dt)
+  {
+    s.y += dt * s.speed;
+
+    const std::int32_t min_y = static_cast<std::int32_t>(std::round(s.y)) - s.length + 1;
+    return min_y < s_column_occupancy[s.layer_index].row_count;
   }
 
-  static void update_falling_string(falling_string &s, const float dt, const float view_width, const float view_height)
+  // Emits the visible cells of a string. The string is drawn between the last two steps
+  // (alpha is how far in between), so the motion is smooth even if the frame rate is not a multiple of the step rate
+  static void emit_falling_string(const falling_string &s, const float alpha, std::vector<std::vector<character_cell>> &grids)
   {
-    const float depth = s_depth_layers[s.layer_index];
-    const float cell_size = view_width / s_col_count * depth;
-    const std::int32_t max_y = std::round(s.y);
+    const float cell_size = s_depth_layers[s.layer_index];
+    const std::int32_t max_y = std::round(s.y - (1.0f - alpha) * s.speed * s_simulation_step);
     const std::int32_t min_y = max_y - s.length + 1;
 
+    // Only the visible rows are emitted
+    const std::int32_t row_count = s_column_occupancy[s.layer_index].row_count;
+    const std::int32_t first_y = std::max(min_y, 0);
+    const std::int32_t last_y = std::min(max_y, row_count);
+
     // Update all the characters besides the head (y < max_y)
-    for (std::int32_t y = min_y; y < max_y; ++y)
+    for (std::int32_t y = first_y; y < last_y; ++y)
     {
       const float t = float(y - min_y) / (max_y - min_y);
 
-      character_cell cell;
-      cell.set(get_random_glyph(s.x, y),
-               {s_string_color * t, t * s_depth_layers_fade[s.layer_index]},
-               vec2f{float(s.x), float(y)} * cell_size,
-               cell_size);
-
-      s_grids[s.layer_index].push_back(cell);
+      grids[s.layer_index].push_back({
+          .position = vec2f{float(s.x), float(y)} * cell_size,
+          .size = cell_size,
+          .glyph = get_random_glyph(s.x, y),
+          .color = {s_string_color * t, t * s_depth_layers_fade[s.layer_index]},
+      });
     }
 
     // Set the head color (y == max_y)
     // For the head I use alpha = 1.0f for every layer
-    character_cell head;
-    head.set(get_random_glyph(s.x, max_y),
-             {s_string_head_color, 1.0f},
-             vec2f{float(s.x), float(max_y)} * cell_size,
-             cell_size);
+    if (max_y >= 0 && max_y < row_count)
+    {
+      grids[s.layer_index].push_back({
+          .position = vec2f{float(s.x), float(max_y)} * cell_size,
+          .size = cell_size,
+          .glyph = get_random_glyph(s.x, max_y),
+          .color = {s_string_head_color, 1.0f},
+      });
+    }
+  }
 
-    s_grids[s.layer_index].push_back(head);
+  // Waits for the GPU to finish, and adds the time since the previous mark to the given stage. Waiting
+  // is what makes the numbers meaningful, since otherwise most of the work would be accounted to the swap
+  static void stress_mark(clock_t::duration *stage)
+  {
+    if (s_config.stress_strings == 0)
+      return;
 
-    // Move this string down
-    s.y += dt * s.speed;
+    glFinish();
 
-    // If the string is out of screen, reset it
-    if (min_y * cell_size >= view_height)
-      init_falling_string(s, view_height);
+    const auto now = clock_t::now();
+    if (stage)
+      *stage += now - s_stress_stats.mark;
+    s_stress_stats.mark = now;
   }
 
-  static void render_debug_gui()
+  // Number of cells drawn on top of another cell of the same layer in the current frame
+  static std::size_t count_overlapping_cells(const simulation_frame &frame)
   {
-#ifdef DEBUG
-    // Debug GUI
-    ImGui_ImplOpenGL3_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
-    ImGui::NewFrame();
+    std::size_t result = 0;
+    static std::vector<bool> covered; // Keeps its memory, stress runs are checked for allocations too
 
-    ImGui::Begin("Debug");
-    ImGui::DragFloat("Exposure", &s_exposure, 0.01f, 0.1f, 10.0f);
-    ImGui::DragFloat("Bloom Threshold", &s_bloom_threshold, 0.01f, 0.1f, 5.0f);
-    ImGui::DragFloat("Bloom Knee", &s_bloom_knee, 0.0f, 0.0f, 0.5f);
-    ImGui::DragFloat("Blur Str Multiplier", &s_blur_str_multiplier, 0.0f, 0.0f, 1.0f);
-    ImGui::ColorEdit3("String Color", s_string_color.components.data(), ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float);
-    ImGui::ColorEdit3("String Head Color", s_string_head_color.components.data(), ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float);
+    for (std::size_t i = 0; i < frame.grids.size(); ++i)
+    {
+      const auto col_count = static_cast<std::size_t>(get_layer_columns(i));
+      const auto row_count = static_cast<std::size_t>(std::ceil(frame.view_height / s_depth_layers[i]));
 
-    ImGui::End();
+      covered.assign(col_count * row_count, false);
 
-    ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+      for (const auto &cell : frame.grids[i])
+      {
+        const auto x = static_cast<std::size_t>(std::lround(cell.position[0] / cell.size));
+        const auto y = static_cast<std::size_t>(std::lround(cell.position[1] / cell.size));
+        const auto covered_index = y * col_count + x;
 
-#endif
+        if (covered[covered_index])
+          result++;
+        covered[covered_index] = true;
+      }
+    }
+
+    return result;
   }
 
-  static void render_hdr_to_screen(const GLuint tx_base, const GLuint tx_bloom)
+  static void report_stress_stats(const simulation_frame &frame)
   {
-    auto [w, h] = get_window_size();
-    // Draw to screen
-    enable_scope scope({GL_BLEND, GL_FRAMEBUFFER_SRGB});
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    glDisable(GL_BLEND);
-    glEnable(GL_FRAMEBUFFER_SRGB);
+    if (s_config.stress_strings == 0)
+      return;
+
+    auto &stats = s_stress_stats;
+    stats.frames++;
+    stats.active += frame.active_strings;
+    stats.simulation += frame.simulation_time;
+    stats.overlaps += count_overlapping_cells(frame);
+    for (const auto &g : frame.grids)
+      stats.cells += g.size();
+
+    const auto now = clock_t::now();
+    if (now - stats.last_report < s_stress_report_interval)
+      return;
+
+    using ms = std::chrono::duration<double, std::milli>;
+    const auto per_frame = [&](const clock_t::duration d) { return ms(d).count() / stats.frames; };
+
+    std::cout << s_falling_strings.size() << '\t' << stats.active / stats.frames << '\t' << stats.cells / stats.frames << '\t' << stats.overlaps / stats.frames << '\t'
+              << frame.avoided_overlaps << '\t'
+              << per_frame(stats.simulation) << '\t' << per_frame(stats.layers) << '\t' << per_frame(stats.post) << '\t'
+              << per_frame(now - stats.last_report) << '\t' << static_cast<double>(stats.allocations) / stats.frames << '\n';
+
+    stats = {.mark = stats.mark, .last_report = now};
+  }
 
-    glViewport(0, 0, w, h);
+  static allocation_count &get_frame_allocations(const alloc_scope scope)
+  {
+    return s_frame_allocations[static_cast<std::size_t>(scope)];
+  }
 
-    glClearColor(0, 0, 0, 1);
-    glClear(GL_COLOR_BUFFER_BIT);
+  // Called at the end of every frame. With --alloc-check, once the rain settled down, any allocation is an error
+  static void check_frame_allocations(const scenes scene)
+  {
+    allocation_count total;
+    for (const auto &a : s_frame_allocations)
+      total += a;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tx_base);
+    s_stress_stats.allocations += total.count;
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, tx_bloom);
+    if (scene != s_alloc_scene)
+    {
+      s_alloc_scene = scene;
+      s_alloc_quiet_frames = 0;
+    }
 
-    glUseProgram(s_prg_hdr);
-    glUniform1i(glGetUniformLocation(s_prg_hdr, "uTexture"), 0);
-    glUniform1i(glGetUniformLocation(s_prg_hdr, "uBloom"), 1);
-    glUniform1f(glGetUniformLocation(s_prg_hdr, "uExposure"), s_exposure);
+    if (s_config.alloc_check && total.count > 0 && s_alloc_quiet_frames >= s_alloc_warmup_frames)
+    {
+      std::ostringstream descr;
+      descr << "Heap allocations after the warm-up:";
+      for (std::size_t i = 0; i < s_frame_allocations.size(); ++i)
+        if (s_frame_allocations[i].count > 0)
+          descr << ' ' << s_alloc_scope_names[i] << ' ' << s_frame_allocations[i].count << " (" << s_frame_allocations[i].bytes << " bytes)";
+
+      // Stops like the end of a replay, since the simulation thread must be joined before exiting
+      std::cerr << descr.str() << '\n';
+      s_exit_code = -1;
+      s_render_stop = true;
+    }
 
-    glBindVertexArray(s_va_quad);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    s_alloc_quiet_frames++;
+    s_frame_allocations = {};
   }
 
-  static void render_terminal(const float dt)
+  // Retires the fences the GPU went past, recording the latency of their frames. While there are still as many
+  // frames in flight as allowed, waits for the oldest one, so the CPU never gets too far ahead of the GPU. Fences
+  // are only checked once per frame, so the latency can be up to a frame longer than the real one
+  static void retire_frame_fences()
   {
+    while (s_frame_fence_count > 0)
+    {
+      auto &fence = s_frame_fences[s_frame_fence_head];
+      const bool must_wait = s_frame_fence_count >= static_cast<std::size_t>(s_config.frames_in_flight);
+      const auto result = glClientWaitSync(fence.sync, GL_SYNC_FLUSH_COMMANDS_BIT, must_wait ? s_fence_timeout : 0);
 
-    static constexpr float s_font_size = 1.0f;
-
-    auto [w, h] = get_window_size();
-    auto [vw, vh] = get_view_size();
-
-    auto &state = s_terminal_state;
+      if (result == GL_TIMEOUT_EXPIRED)
+      {
+        if (must_wait)
+          continue;
+        break;
+      }
 
-    // Update timer and state
-    state.timer = std::max(0.0f, state.timer - dt);
+      if (result != GL_WAIT_FAILED)
+      {
+        const auto latency = clock_t::now() - fence.start;
+        s_frame_stats.latency += latency;
+        s_frame_stats.max_latency = std::max(s_frame_stats.max_latency, latency);
+        s_frame_stats.latency_samples++;
+      }
 
-    // Fill the string
-    s_terminal_cells.clear();
+      glDeleteSync(fence.sync);
+      fence.sync = nullptr;
+      s_frame_fence_head = (s_frame_fence_head + 1) % s_frame_fences.size();
+      s_frame_fence_count--;
+    }
+  }
 
-    const std::string_view current_line{s_terminal_lines[state.cur_line].data(), state.cur_char + 1};
-    float str_width = 0.0f;
-    for (const auto ch : current_line)
-      str_width += s_terminal_font->find_glyph(ch).norm_advance * s_font_size;
+  static void insert_frame_fence(const clock_t::time_point start)
+  {
+    auto &fence = s_frame_fences[(s_frame_fence_head + s_frame_fence_count) % s_frame_fences.size()];
+    fence = {.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), .start = start};
+    s_frame_fence_count++;
+  }
 
-    //vec2f pos = vec2f{vw - str_width, vh - s_font_size} / 2.0f;
+  // Sleeps until the next frame is due. A late frame doesn't make the next ones come sooner to catch up,
+  // the schedule just starts over from there, which is what keeps the frame times regular
+  static void limit_frame_rate(const float fps)
+  {
+    if (fps <= 0.0f)
+      return;
 
-    vec2f pos = { static_cast<float>(vw) / s_col_count, static_cast<float>(vw) / s_col_count };
+    const auto period = std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(1.0 / fps));
+    const auto now = clock_t::now();
 
-    for (auto ch : current_line)
+    s_next_frame_time += period;
+    if (s_next_frame_time <= now)
     {
-      const auto &g = s_terminal_font->find_glyph(ch);
-      character_cell cell;
-      cell.set(g, {s_terminal_color, 1.0f}, pos, s_font_size);
-      s_terminal_cells.push_back(std::move(cell));
-      pos[0] += g.norm_advance * s_font_size;
+      s_next_frame_time = now;
+      return;
     }
 
-    // Render
+    if (s_next_frame_time - now > s_frame_limiter_spin)
+      std::this_thread::sleep_for(s_next_frame_time - now - s_frame_limiter_spin);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_final_render, 0);
+    while (clock_t::now() < s_next_frame_time)
+      std::this_thread::yield();
+  }
 
-    glViewport(0, 0, w, h);
+  // The idle mode applies while the window is iconified, or not focused if asked. GLFW can't tell when the window is
+  // covered by other windows, or when the display is off, so in those cases the window still counts as visible
+  static idle_mode get_idle_mode()
+  {
+    const bool idle = s_window_iconified || (s_config.idle_unfocused && !s_window_focused);
+    return idle ? s_config.idle : idle_mode::run;
+  }
 
-    glClearColor(0, 0, 0, 1);
-    glClear(GL_COLOR_BUFFER_BIT);
+  static void report_frame_stats()
+  {
+    if (!s_config.frame_stats)
+      return;
 
-    render_characters(s_terminal_cells, *(s_terminal_font.get()), vw, vh);
+    auto &stats = s_frame_stats;
+    stats.frames++;
 
-    auto tx_bloom = s_fx_bloom->compute(s_tx_final_render, s_bloom_threshold, s_bloom_knee);
+    const auto now = clock_t::now();
+    if (now - stats.last_report < s_stress_report_interval)
+      return;
 
-    // Draw to screen
-    render_hdr_to_screen(s_tx_final_render, tx_bloom);
+    using ms = std::chrono::duration<double, std::milli>;
+    const auto elapsed = ms(now - stats.last_report).count();
+    const auto latency = stats.latency_samples > 0 ? ms(stats.latency).count() / stats.latency_samples : 0.0;
+
+    std::cout << "fps " << stats.frames * 1000.0 / elapsed << "\tframe ms " << elapsed / stats.frames << "\tlatency ms " << latency
+              << "\tmax latency ms " << ms(stats.max_latency).count() << "\tgpu ms " << s_gpu_timer->get_total_time() << "\tfragments/px " << get_fragments_per_pixel()
+              << "\ttier " << s_tier_index << "\tquality " << s_quality_level << '\n';
+
+    stats = {.last_report = now};
+  }
+
+  static void mark_frame_phase(const frame_phase phase)
+  {
+    const auto now = clock_t::now();
+    s_frame_timing.phases[static_cast<std::size_t>(phase)] += now - s_frame_timing.mark;
+    s_frame_timing.mark = now;
+  }
 
-    if (state.timer == 0.0f)
+  // Called at the start of every iteration of the render loop, when the previous one is over. The GPU times of an
+  // iteration come back s_frame_lag iterations later, so that's how long a hitch waits to be logged
+  static void finish_frame_timing(const std::size_t iteration)
+  {
+    const auto now = clock_t::now();
+    auto &timing = s_frame_timing;
+
+    if (timing.counted)
     {
+      const auto time = now - timing.start;
+      s_frame_histogram.record(time);
+      s_frame_histogram_interval.record(time);
 
-      // Check done
-      if (state.cur_line == s_terminal_lines.size() - 1 && state.cur_char == s_terminal_lines[state.cur_line].size() - 1)
+      if (s_metrics)
       {
-        // Goto main scene
-        s_scene = scenes::code;
-        return;
+        const auto &counters = get_frame_counters();
+        metrics_sample sample{
+            .frame_time = std::chrono::duration_cast<std::chrono::nanoseconds>(time),
+            .fragments_per_pixel = static_cast<float>(get_fragments_per_pixel()),
+            .cells = static_cast<std::uint32_t>(counters.cells),
+            .upload_bytes = static_cast<std::uint32_t>(counters.upload_bytes),
+            .draw_calls = static_cast<std::uint32_t>(counters.draw_calls),
+            .tier = static_cast<std::uint32_t>(s_tier_index),
+            .quality_level = static_cast<std::uint32_t>(s_quality_level),
+            .gpu_memory = gpu_memory::get_usage().total,
+            .gpu_memory_peak = gpu_memory::get_usage().peak,
+            .avoided_overlaps = s_frames.front().avoided_overlaps,
+        };
+        for (std::size_t i = 0; i < s_gpu_pass_names.size(); ++i)
+        {
+          sample.gpu_times[i] = static_cast<float>(s_gpu_timer->get_time(i));
+          sample.gpu_fragments[i] = static_cast<float>(s_gpu_timer->get_samples(i));
+        }
+
+        s_metrics->push(sample);
       }
 
-      // Increase the current character
-      state.cur_char++;
-      if (state.cur_char == s_terminal_lines[state.cur_line].size())
-      {
-        // Start a new line at the next iteration
-        state.cur_char = 0;
-        state.cur_line++;
-        state.timer = rng::next(0.02f, 0.2f);
-      }
-      else if (state.cur_char == s_terminal_lines[state.cur_line].size() - 1)
-      {
-        // Wait a bit longer before starting a new line
-        state.timer = 1.5f;
-      }
-      else
+      if (s_config.hitch_ms > 0.0f && time > std::chrono::duration<float, std::milli>(s_config.hitch_ms))
       {
-        // Next character
-        state.timer = rng::next(0.02f, 0.2f);
+        s_frame_hitches[(iteration - 1) % s_frame_hitches.size()] = {.pending = true, .time = time, .timing = timing};
+        s_hitch_count++;
+        s_hitch_count_interval++;
       }
     }
+
+    timing = {.start = now, .mark = now};
+
+    if (s_config.frame_histogram_interval > 0.0f && now - s_frame_histogram_report > std::chrono::duration<float>(s_config.frame_histogram_interval))
+    {
+      if (s_frame_histogram_interval.get_count() > 0)
+        report_frame_histogram(s_frame_histogram_interval, s_hitch_count_interval, "interval");
+
+      s_frame_histogram_interval.clear();
+      s_hitch_count_interval = 0;
+      s_frame_histogram_report = now;
+    }
   }
 
-  static void render_characters(const std::vector<character_cell> &cells, const font &font, const float view_width, const float view_height)
+  // Logs the hitch of the iteration the GPU timer just read the times of, if that one was a hitch
+  static void log_frame_hitch(const std::size_t iteration, const bool has_gpu_times)
   {
-    // Rendering falling strings
-    glUseProgram(s_prg_strings);
+    auto &hitch = s_frame_hitches[iteration % s_frame_hitches.size()];
+    if (!hitch.pending)
+      return;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, font.get_texture());
+    hitch.pending = false;
 
-    glUniform1f(glGetUniformLocation(s_prg_strings, "uScreenWidth"), view_width);
-    glUniform1f(glGetUniformLocation(s_prg_strings, "uScreenHeight"), view_height);
-    glUniform1i(glGetUniformLocation(s_prg_strings, "uFont"), 0);
+    using ms = std::chrono::duration<double, std::milli>;
+    const auto &timing = hitch.timing;
 
-    glBindVertexArray(s_va);
-    glBindBuffer(GL_ARRAY_BUFFER, s_vb);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(character_cell) * cells.size(), cells.data(), GL_DYNAMIC_DRAW);
+    std::cout << "hitch frame " << timing.frame << (timing.scene == scenes::code ? " code" : " terminal") << ' ' << ms(hitch.time).count()
+              << " ms\tsimulation " << ms(timing.simulation).count();
+
+    for (std::size_t i = 0; i < timing.phases.size(); ++i)
+      std::cout << '\t' << s_frame_phase_names[i] << ' ' << ms(timing.phases[i]).count();
+
+    if (has_gpu_times)
+    {
+      std::cout << "\tgpu";
+      for (std::size_t i = 0; i < s_gpu_pass_names.size(); ++i)
+        std::cout << ' ' << s_gpu_pass_names[i] << ' ' << s_gpu_timer->get_time(i);
+    }
 
-    glDrawArrays(GL_TRIANGLES, 0, cells.size() * 6);
+    std::cout << '\n';
   }
 
-  static void render_code(const float dt)
+  static void report_frame_histogram(const duration_histogram &histogram, const std::size_t hitches, const std::string_view label)
   {
-    const auto [w, h] = get_window_size();
+    std::cout << "frame times (" << label << ") frames " << histogram.get_count() << "\tmean ms " << histogram.get_mean()
+              << "\tp50 " << histogram.get_percentile(50.0) << "\tp90 " << histogram.get_percentile(90.0) << "\tp99 " << histogram.get_percentile(99.0)
+              << "\tp99.9 " << histogram.get_percentile(99.9) << "\tmax " << histogram.get_max();
 
-    constexpr float view_width = s_col_count;
-    const float view_height = h / w * view_width;
+    if (s_config.hitch_ms > 0.0f)
+      std::cout << "\thitches " << hitches;
 
-    // Clear grids
-    for (auto &g : s_grids)
-      g.clear();
+    std::cout << '\n';
+  }
 
-    // Swap some glyphs
+  // Only when something was allocated or freed since the last report, with the change of each owner
+  static void report_gpu_memory()
+  {
+    const auto &usage = gpu_memory::get_usage();
+    if (!s_config.gpu_memory || usage.bytes == s_gpu_memory_reported.bytes)
+      return;
+
+    const auto mb = [](const std::int64_t bytes) { return bytes / (1024.0 * 1024.0); };
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2) << std::showpos;
+
+    const auto write = [&](const std::string_view name, const std::size_t bytes, const std::size_t reported) {
+      out << name << ' ' << std::noshowpos << mb(bytes) << " (" << std::showpos << mb(bytes) - mb(reported) << ')';
+    };
+
+    write("gpu memory MB", usage.total, s_gpu_memory_reported.total);
+
+    for (std::size_t i = 0; i < usage.bytes.size(); ++i)
+    {
+      out << '\t';
+      write(gpu_memory::get_owner_name(static_cast<gpu_memory::owners>(i)), usage.bytes[i], s_gpu_memory_reported.bytes[i]);
+    }
+
+    out << std::noshowpos << "\tpeak " << mb(usage.peak);
+
+    // Includes the default framebuffer, the driver's own padding and anything else running on the GPU
+    if (const auto driver = gpu_memory::get_driver_used(); driver >= 0)
+      out << "\tdriver " << mb(driver);
+
+    std::cout << out.str() << '\n';
+
+    s_gpu_memory_reported = usage;
+  }
+
+  // Fragments shaded by all the passes of a frame (a few frames old, like the GPU times) per pixel of the window
+  static double get_fragments_per_pixel()
+  {
+    const auto pixels = static_cast<double>(s_window_width) * s_window_height;
+    return pixels > 0.0 ? s_gpu_timer->get_total_samples() / pixels : 0.0;
+  }
+
+  // Stress tests and captures need the same work and the same images from run to run
+  static bool allows_dynamic_quality()
+  {
+    return s_config.target_fps > 0.0f && s_config.stress_strings == 0 && s_config.capture_prefix.empty();
+  }
+
+  // The terminal text is drawn again after any change, most of the settings show in its bloom
+  static void apply_control_commands()
+  {
+    if (!s_metrics)
+      return;
+
+    for (control_command c; s_metrics->pop_command(c);)
+    {
+      switch (static_cast<control_settings>(c.setting))
+      {
+      case control_settings::exposure:
+        s_exposure = c.value;
+        break;
+      case control_settings::bloom_threshold:
+        s_bloom_threshold = c.value;
+        break;
+      case control_settings::bloom_knee:
+        s_bloom_knee = c.value;
+        break;
+      case control_settings::blur:
+        s_blur_str_multiplier = c.value;
+        break;
+      case control_settings::bloom_levels:
+        s_bloom_level_limit = static_cast<std::size_t>(c.value);
+        set_quality_level(s_quality_level);
+        break;
+      case control_settings::quality:
+        // A fixed level turns the controller off
+        s_dynamic_quality = c.value < 0.0f && allows_dynamic_quality();
+        if (c.value >= 0.0f)
+          set_quality_level(static_cast<std::size_t>(c.value));
+        break;
+      case control_settings::tier:
+        set_quality_tier(static_cast<std::size_t>(c.value));
+        break;
+      }
+
+      s_terminal_clean = false;
+    }
+  }
+
+  static void begin_gpu_pass(const gpu_pass pass)
+  {
+    s_gpu_timer->begin(static_cast<std::size_t>(pass));
+  }
+
+  static void end_gpu_pass()
+  {
+    s_gpu_timer->end();
+  }
+
+  // The fewest of two bloom level counts, where 0 is all of them
+  static std::size_t get_bloom_levels(const std::size_t a, const std::size_t b)
+  {
+    return a == 0 || b == 0 ? std::max(a, b) : std::min(a, b);
+  }
+
+  static void set_quality_level(const std::size_t level)
+  {
+    const auto &q = s_quality_levels[level];
+
+    // Applied on top of the quality tier
+    s_quality_level = level;
+    s_alloc_quiet_frames = 0;
+    s_render_scale = q.render_scale * s_tier.render_scale;
+    s_skipped_layers = std::min(std::max(q.skipped_layers, s_tier.skipped_layers), s_depth_layers.size() - 1);
+
+    s_bloom_levels = get_bloom_levels(get_bloom_levels(q.bloom_levels, s_tier.bloom_levels), s_bloom_level_limit);
+    s_fx_bloom->set_max_levels(s_bloom_levels);
+
+    update_render_size();
+  }
+
+  // Dynamic resolution: picks the quality level that keeps the GPU time of a frame within the budget of the target
+  // frame rate. Called when the GPU timer has new times, which are a few frames old
+  static void update_quality()
+  {
+    if (!s_dynamic_quality)
+      return;
+
+    // The first times after a change are still from frames rendered with the old level
+    if (s_quality_skip_frames > 0)
+    {
+      s_quality_skip_frames--;
+      return;
+    }
+
+    s_quality_gpu_time += s_gpu_timer->get_total_time();
+    if (++s_quality_samples < s_quality_window)
+      return;
+
+    const double budget = 1000.0 / s_config.target_fps;
+    const double gpu_time = s_quality_gpu_time / s_quality_samples;
+
+    s_quality_samples = 0;
+    s_quality_gpu_time = 0.0;
+
+    if (gpu_time > budget && s_quality_level + 1 < s_quality_levels.size())
+      set_quality_level(s_quality_level + 1);
+    else if (gpu_time < budget * s_quality_headroom && s_quality_level > 0)
+      set_quality_level(s_quality_level - 1);
+    else
+      return;
+
+    s_quality_skip_frames = gpu_timer::s_frame_lag;
+  }
+
+  static void set_quality_tier(const std::size_t index)
+  {
+    const bool realloc = s_quality_tiers[index].blur_scale != s_blur_scale;
+
+    s_tier_index = index;
+    s_tier = s_quality_tiers[index];
+    s_blur_scale = s_tier.blur_scale;
+
+    // The blur textures have a different size
+    if (realloc)
+      allocate_render_targets();
+
+    set_quality_level(s_quality_level);
+  }
+
+  // GPU time of a rain frame with the given tier, from the calibration times, which are for a single layer, blur
+  // iteration and bloom at the full resolution
+  static double estimate_frame_time(const quality_tier &tier)
+  {
+    const auto &c = s_calibration;
+    const double frames = static_cast<double>(c.frames - s_calibration_warmup_frames);
+    const double layer = c.layer / frames, blur = c.blur / frames, bloom = c.bloom / frames;
+
+    const double area = tier.render_scale * tier.render_scale;
+    const double blur_area = area / (tier.blur_scale * tier.blur_scale);
+    const auto layers = s_depth_layers.size() - 1 - std::min(tier.skipped_layers, s_depth_layers.size() - 1);
+
+    // Without bloom the front layer is drawn straight to the screen, at the window resolution
+    const double background = layers * (layer + blur * tier.blur_iterations) * blur_area;
+    return tier.bloom ? background + (layer + bloom) * area : background + layer;
+  }
+
+  // The cache has a line for each GPU: the tier, a tab, and the renderer name
+  static std::string get_calibration_cache_file()
+  {
+#if defined(MR_WINDOWS)
+    const char *dir = std::getenv("LOCALAPPDATA");
+    return dir ? std::string(dir) + "\\ultimate-matrix-rain.cache" : std::string();
+#else
+    if (const char *dir = std::getenv("XDG_CACHE_HOME"); dir && *dir)
+      return std::string(dir) + "/ultimate-matrix-rain.cache";
+
+    const char *home = std::getenv("HOME");
+    return home ? std::string(home) + "/.cache/ultimate-matrix-rain.cache" : std::string();
+#endif
+  }
+
+  static std::string get_renderer_name()
+  {
+    const auto renderer = reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+    return renderer ? renderer : "";
+  }
+
+  static std::optional<std::size_t> load_cached_tier()
+  {
+    std::ifstream is(get_calibration_cache_file());
+    const auto renderer = get_renderer_name();
+
+    std::size_t tier;
+    std::string name;
+    while (is >> tier && is.get() == '\t' && std::getline(is, name))
+    {
+      if (name == renderer && tier < s_quality_tiers.size())
+        return tier;
+    }
+
+    return std::nullopt;
+  }
+
+  // Rewrites the cache with the tier of this GPU, keeping the other lines
+  static void save_cached_tier(const std::size_t tier)
+  {
+    const auto file_name = get_calibration_cache_file();
+    if (file_name.empty())
+      return;
+
+    const auto renderer = get_renderer_name();
+    std::vector<std::string> lines;
+
+    {
+      std::ifstream is(file_name);
+      for (std::string line; std::getline(is, line);)
+      {
+        const auto tab = line.find('\t');
+        if (tab != std::string::npos && line.substr(tab + 1) != renderer)
+          lines.push_back(line);
+      }
+    }
+
+    // ~/.cache may not exist yet, without it the probe would run again on every launch
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(file_name).parent_path(), error);
+    if (error)
+    {
+      std::cerr << "Could not create the cache directory of " << file_name << ": " << error.message() << '\n';
+      return;
+    }
+
+    std::ofstream os(file_name, std::ios::trunc);
+    for (const auto &line : lines)
+      os << line << '\n';
+    os << tier << '\t' << renderer << '\n';
+
+    if (!os)
+      std::cerr << "Could not write the calibration cache: " << file_name << '\n';
+  }
+
+  // Forced by the launch config, from the cache, or measured during the intro
+  static void select_quality_tier()
+  {
+    if (s_config.tier >= 0)
+    {
+      set_quality_tier(std::min<std::size_t>(s_config.tier, s_quality_tiers.size() - 1));
+      return;
+    }
+
+    // Stress tests and captures need the same work and the same images on every machine
+    if (s_config.stress_strings > 0 || !s_config.capture_prefix.empty())
+      return;
+
+    if (!s_config.recalibrate)
+    {
+      if (const auto tier = load_cached_tier())
+      {
+        set_quality_tier(*tier);
+        return;
+      }
+    }
+
+    s_calibration.active = true;
+  }
+
+  // Draws a screen full of front layer cells on top of a background, blurs it once, and computes the bloom of the
+  // final render, timing the three separately. The queries are read right away: it stalls, but it's the intro
+  static void run_calibration_probe(const float view_height)
+  {
+    auto &c = s_calibration;
+
+    if (c.frames == 0)
+    {
+      glGenQueries(static_cast<GLsizei>(c.queries.size()), c.queries.data());
+
+      const auto rows = static_cast<std::int32_t>(std::ceil(view_height));
+      for (std::int32_t y = 0; y < rows; ++y)
+        for (std::int32_t x = 0; x < s_col_count; ++x)
+          c.cells.push_back({.position = {static_cast<float>(x), static_cast<float>(y)}, .size = 1.0f, .glyph = get_random_glyph(x, y), .color = {s_string_color, 1.0f}});
+    }
+
+    const auto blur_extent = s_render_extent.scaled_down(s_blur_scale);
+    const auto blur_uv_scale = blur_extent.get_uv_scale();
+    const auto blur_uv_max = blur_extent.get_uv_max();
+
+    s_font->begin_frame();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_blur1, 0);
+    glViewport(0, 0, blur_extent.width, blur_extent.height);
+
+    glBeginQuery(GL_TIME_ELAPSED, c.queries[0]);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glUseProgram(s_prg_pass_trough);
+    glUniform1i(glGetUniformLocation(s_prg_pass_trough, "uTexture"), 0);
+    glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvScale"), blur_uv_scale[0], blur_uv_scale[1]);
+    glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvMax"), blur_uv_max[0], blur_uv_max[1]);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, s_tx_blur0);
+
+    glBindVertexArray(s_va_quad);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    get_frame_counters().draw_calls++;
+
+    render_characters(c.cells, *(s_font.get()), s_prg_strings_palette, s_col_count, view_height);
+
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, c.queries[1]);
+    s_blur_filter->apply(s_tx_blur1, s_blur_str_multiplier, 1);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, c.queries[2]);
+    s_fx_bloom->compute(s_tx_final_render, s_bloom_threshold, s_bloom_knee);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    std::array<GLuint64, 3> times{};
+    for (std::size_t i = 0; i < times.size(); ++i)
+      glGetQueryObjectui64v(c.queries[i], GL_QUERY_RESULT, &times[i]);
+
+    // The probe runs at the render size, the estimates are for the full window
+    const double area = static_cast<double>(s_window_width) * s_window_height / (static_cast<double>(s_render_extent.width) * s_render_extent.height);
+
+    if (c.frames == s_calibration_warmup_frames)
+      c.start = clock_t::now();
+
+    // The bloom chain was overwritten
+    s_terminal_clean = false;
+
+    if (++c.frames > s_calibration_warmup_frames)
+    {
+      c.layer += times[0] / 1e6 * area;
+      c.blur += times[1] / 1e6 * area;
+      c.bloom += times[2] / 1e6 * area;
+    }
+  }
+
+  static void finish_calibration()
+  {
+    auto &c = s_calibration;
+    c.active = false;
+
+    if (c.frames == 0)
+      return;
+
+    glDeleteQueries(static_cast<GLsizei>(c.queries.size()), c.queries.data());
+    c.cells = {};
+
+    // The intro was over before the probe could measure anything, keep the current tier
+    if (c.frames <= s_calibration_warmup_frames)
+      return;
+
+    const double budget = s_calibration_budget * 1000.0 / (s_config.target_fps > 0.0f ? s_config.target_fps : s_calibration_fps);
+
+    std::size_t tier = 0;
+    while (tier + 1 < s_quality_tiers.size() && estimate_frame_time(s_quality_tiers[tier]) > budget)
+      tier++;
+
+    if (s_config.frame_stats)
+    {
+      const double frames = static_cast<double>(c.frames - s_calibration_warmup_frames);
+      std::cout << "calibration: layer ms " << c.layer / frames << "\tblur ms " << c.blur / frames << "\tbloom ms " << c.bloom / frames
+                << "\testimated ms " << estimate_frame_time(s_quality_tiers[tier]) << "\ttier " << tier << '\n';
+    }
+
+    save_cached_tier(tier);
+    set_quality_tier(tier);
+  }
+
+  // Debug builds make sure embed::s_glsl_rng gives the same bits as rng::stream, drawing a row of numbers
+  static void check_glsl_rng()
+  {
+#ifdef DEBUG
+    constexpr GLsizei count = 256;
+    constexpr std::uint32_t seed = 0x2545f491, id = 7, generation = 3;
+
+    std::string source(embed::s_fs_rng_check);
+    source.insert(source.find('\n', source.find("#version")) + 1, embed::s_glsl_rng);
+    const auto program = load_program(embed::s_vs_fullscreen, source);
+
+    // A renderbuffer, since the texture wrappers of gpu_memory have no owner for it
+    GLuint framebuffer = 0, renderbuffer = 0;
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(1, &renderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32UI, count, 1);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+    glViewport(0, 0, count, 1);
+
+    glUseProgram(program);
+    glUniform2f(glGetUniformLocation(program, "uUvScale"), 1.0f, 1.0f);
+    glUniform1ui(glGetUniformLocation(program, "uSeed"), seed);
+    glUniform1ui(glGetUniformLocation(program, "uId"), id);
+    glUniform1ui(glGetUniformLocation(program, "uGeneration"), generation);
+
+    glBindVertexArray(s_va_quad);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+
+    std::vector<std::array<std::uint32_t, 4>> values(count);
+    glReadPixels(0, 0, count, 1, GL_RGBA_INTEGER, GL_UNSIGNED_INT, values.data());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &renderbuffer);
+    glDeleteProgram(program);
+
+    rng::stream stream(seed, id, generation);
+    for (const auto &value : values)
+    {
+      const auto bits = stream.next_u32();
+      if (value[0] != bits || value[1] != std::bit_cast<std::uint32_t>(rng::to_float(bits)))
+        terminate_with_error("embed::s_glsl_rng doesn't match rng::stream");
+    }
+#endif
+  }
+
+  static void render_debug_gui()
+  {
+#ifdef DEBUG
+    // Debug GUI. Its input comes through the window events, so it never touches GLFW from this thread
+    const auto now = clock_t::now();
+    if (s_debug_gui_last_frame == clock_t::time_point{})
+      s_debug_gui_last_frame = now;
+
+    ImGuiIO &io = ImGui::GetIO();
+    io.DisplaySize = ImVec2(float(s_window_width), float(s_window_height));
+    if (s_window_width > 0 && s_window_height > 0)
+      io.DisplayFramebufferScale = ImVec2(float(s_framebuffer_width) / s_window_width, float(s_framebuffer_height) / s_window_height);
+    io.DeltaTime = std::max(std::chrono::duration<float>(now - s_debug_gui_last_frame).count(), 1e-4f);
+    s_debug_gui_last_frame = now;
+
+    ImGui_ImplOpenGL3_NewFrame();
+    ImGui::NewFrame();
+
+    ImGui::Begin("Debug");
+    ImGui::DragFloat("Exposure", &s_exposure, 0.01f, 0.1f, 10.0f);
+    ImGui::DragFloat("Bloom Threshold", &s_bloom_threshold, 0.01f, 0.1f, 5.0f);
+    ImGui::DragFloat("Bloom Knee", &s_bloom_knee, 0.0f, 0.0f, 0.5f);
+    ImGui::DragFloat("Blur Str Multiplier", &s_blur_str_multiplier, 0.0f, 0.0f, 1.0f);
+    ImGui::ColorEdit3("String Color", s_string_color.components.data(), ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float);
+    ImGui::ColorEdit3("String Head Color", s_string_head_color.components.data(), ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float);
+
+    ImGui::End();
+
+    ImGui::Render();
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+
+#endif
+  }
+
+  static void show_hud(const bool visible)
+  {
+    s_hud_visible = visible;
+    s_hud_frame_count = 0;
+    s_hud_last_frame = {};
+    s_hud_last_text = {};
+  }
+
+  // Lays out the text of the overlay, in window pixels. Formatted in a fixed buffer, so it doesn't allocate
+  static void update_hud_text(const simulation_frame &frame, const float cpu_time)
+  {
+    using ms = std::chrono::duration<float, std::milli>;
+
+    const auto n = std::min(s_hud_frame_count, s_hud_samples);
+    auto sorted = s_hud_frame_times;
+    const auto p99 = sorted.begin() + (n * 99 + 99) / 100 - 1;
+    std::nth_element(sorted.begin(), p99, sorted.begin() + n);
+    const auto average = std::accumulate(sorted.begin(), sorted.begin() + n, 0.0f) / n;
+
+    const auto &counters = get_frame_counters();
+    const auto gpu_time = [](const gpu_pass pass) { return s_gpu_timer->get_time(static_cast<std::size_t>(pass)); };
+    const auto fragments = [](const gpu_pass pass) { return s_gpu_timer->get_samples(static_cast<std::size_t>(pass)) / 1e6; };
+
+    std::array<char, 512> text;
+    std::snprintf(text.data(), text.size(),
+                  "fps %.0f  frame %.2f ms  p99 %.2f ms\n"
+                  "cpu %.2f ms  simulation %.2f ms\n"
+                  "gpu %.2f ms  layers %.2f  blur %.2f  bloom %.2f  tonemap %.2f\n"
+                  "fragments %.2f/px  layers %.2fM  blur %.2fM  bloom %.2fM  tonemap %.2fM\n"
+                  "cells %zu  uploaded %.1f KB  draw calls %zu  overlaps avoided %llu\n"
+                  "tier %zu  quality %zu  scale %.2f  vram %.1f MB",
+                  1000.0f / average, average, *p99,
+                  cpu_time, ms(frame.simulation_time).count(),
+                  s_gpu_timer->get_total_time(), gpu_time(gpu_pass::layers), gpu_time(gpu_pass::blur), gpu_time(gpu_pass::bloom), gpu_time(gpu_pass::tonemap),
+                  get_fragments_per_pixel(), fragments(gpu_pass::layers), fragments(gpu_pass::blur), fragments(gpu_pass::bloom), fragments(gpu_pass::tonemap),
+                  counters.cells, counters.upload_bytes / 1024.0f, counters.draw_calls, static_cast<unsigned long long>(frame.avoided_overlaps),
+                  s_tier_index, s_quality_level, s_render_scale, gpu_memory::get_usage().total / (1024.0f * 1024.0f));
+
+    s_hud_cells.clear();
+
+    const vec2f origin = {s_hud_font_size, s_hud_font_size};
+    auto pen = origin;
+    for (const char *c = text.data(); *c != '\0' && s_hud_cells.size() + 2 <= s_hud_max_cells - s_hud_sparkline_samples; ++c)
+    {
+      if (*c == '\n')
+      {
+        pen = {origin[0], pen[1] + s_terminal_line_height * s_hud_font_size};
+        continue;
+      }
+
+      // With a shadow, so the text can be read over the rain
+      const auto &g = s_terminal_font->find_glyph(static_cast<unsigned char>(*c));
+      s_hud_cells.push_back({.position = pen + vec2f{1.0f, 1.0f}, .size = s_hud_font_size, .glyph = g.slot, .color = {0.0f, 0.0f, 0.0f, 1.0f}});
+      s_hud_cells.push_back({.position = pen, .size = s_hud_font_size, .glyph = g.slot, .color = s_hud_text_color});
+      pen[0] += g.norm_advance * s_hud_font_size;
+    }
+
+    s_hud_text_cells = s_hud_cells.size();
+  }
+
+  // Performance overlay, drawn over the final image with the terminal font. Nothing runs while it's hidden
+  static void render_hud(const simulation_frame &frame, const float cpu_time)
+  {
+    using ms = std::chrono::duration<float, std::milli>;
+
+    if (!s_hud_visible)
+      return;
+
+    MR_TRACE_GPU_ZONE("hud");
+
+    const auto now = clock_t::now();
+    if (s_hud_last_frame != clock_t::time_point{})
+      s_hud_frame_times[s_hud_frame_count++ % s_hud_samples] = ms(now - s_hud_last_frame).count();
+    s_hud_last_frame = now;
+
+    if (s_hud_frame_count == 0)
+      return;
+
+    s_terminal_font->begin_frame();
+
+    if (now - s_hud_last_text >= s_hud_text_interval)
+    {
+      update_hud_text(frame, cpu_time);
+      s_hud_last_text = now;
+    }
+
+    // Sparkline of the last frame times, from 0 (bottom) to twice the frame budget (top)
+    const float budget = 1000.0f / (s_config.target_fps > 0.0f ? s_config.target_fps : 60.0f);
+    const auto &dash = s_terminal_font->find_glyph('-');
+    const float bottom = s_hud_font_size * (1.0f + 6.0f * s_terminal_line_height) + s_hud_sparkline_height;
+    const float step = dash.norm_advance * s_hud_font_size * 0.5f;
+    const auto count = std::min(s_hud_frame_count, s_hud_sparkline_samples);
+
+    s_hud_cells.resize(s_hud_text_cells);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      const auto t = s_hud_frame_times[(s_hud_frame_count - count + i) % s_hud_samples];
+      const vec2f position = {s_hud_font_size + i * step, bottom - std::min(t / (2.0f * budget), 1.0f) * s_hud_sparkline_height};
+      s_hud_cells.push_back({.position = position, .size = s_hud_font_size, .glyph = dash.slot, .color = t > budget ? s_hud_bad_color : s_hud_good_color});
+    }
+
+    enable_scope scope({GL_BLEND, GL_FRAMEBUFFER_SRGB});
+    glEnable(GL_BLEND);
+    glDisable(GL_FRAMEBUFFER_SRGB);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, s_window_width, s_window_height);
+
+    glBindBuffer(GL_ARRAY_BUFFER, s_vb_hud);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(character_cell) * s_hud_cells.size(), s_hud_cells.data());
+    get_frame_counters().upload_bytes += sizeof(character_cell) * s_hud_cells.size();
+
+    use_characters_program(*(s_terminal_font.get()), s_prg_strings, s_window_width, s_window_height);
+
+    glBindVertexArray(s_va_hud);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, s_hud_cells.size());
+    get_frame_counters().draw_calls++;
+  }
+
+  // Without bloom (tx_bloom 0) the base texture is only tonemapped. Outside of the region (in window pixels) the
+  // screen is just cleared. Both textures have the given extent
+  static void render_hdr_to_screen(const GLuint tx_base, const GLuint tx_bloom, const render_extent &extent, const pixel_rect &region)
+  {
+    MR_TRACE_GPU_ZONE("tonemap");
+    const auto uv_scale = extent.get_uv_scale();
+    const auto uv_max = extent.get_uv_max();
+    auto [w, h] = get_window_size();
+    // Draw to screen
+    enable_scope scope({GL_BLEND, GL_FRAMEBUFFER_SRGB, GL_SCISSOR_TEST});
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_FRAMEBUFFER_SRGB);
+
+    glViewport(0, 0, w, h);
+
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(region.x, region.y, region.width, region.height);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tx_base);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, tx_bloom);
+
+    begin_gpu_pass(gpu_pass::tonemap);
+
+    const auto program = tx_bloom ? s_prg_hdr : s_prg_hdr_no_bloom;
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uTexture"), 0);
+    glUniform1i(glGetUniformLocation(program, "uBloom"), 1);
+    glUniform1f(glGetUniformLocation(program, "uExposure"), s_exposure);
+    glUniform2f(glGetUniformLocation(program, "uUvScale"), uv_scale[0], uv_scale[1]);
+    glUniform2f(glGetUniformLocation(program, "uUvMax"), uv_max[0], uv_max[1]);
+
+    glBindVertexArray(s_va_quad);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    get_frame_counters().draw_calls++;
+
+    end_gpu_pass();
+  }
+
+  static void update_terminal(const float dt)
+  {
+    auto &state = s_terminal_state;
+
+    // Update timer and state
+    state.timer = std::max(0.0f, state.timer - dt);
+
+    if (state.timer > 0.0f)
+      return;
+
+    // Check done
+    if (state.cur_line == s_terminal_messages.size() - 1 && state.cur_char == s_terminal_messages[state.cur_line].size() - 1)
+    {
+      // Goto main scene
+      s_scene = scenes::code;
+      return;
+    }
+
+    // Increase the current character
+    state.cur_char++;
+    if (state.cur_char == s_terminal_messages[state.cur_line].size())
+    {
+      // Start a new line at the next iteration
+      state.cur_char = 0;
+      state.cur_line++;
+      state.timer = s_simulation_rng.next(0.02f, 0.2f);
+    }
+    else if (state.cur_char == s_terminal_messages[state.cur_line].size() - 1)
+    {
+      // Wait a bit longer before starting a new line
+      state.timer = 1.5f;
+    }
+    else
+    {
+      // Next character
+      state.timer = s_simulation_rng.next(0.02f, 0.2f);
+    }
+  }
+
+  // Messages in UTF-8, separated by empty lines. The lines of a message are typed one after the other, and it stays
+  // on screen until it's done
+  static bool load_terminal_messages(const std::string_view text)
+  {
+    s_terminal_messages.clear();
+
+    std::istringstream is{std::string(text)};
+    std::u32string message;
+    for (std::string line; std::getline(is, line);)
+    {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+      if (!line.empty())
+      {
+        const auto decoded = decode_utf8(line);
+        message += message.empty() ? decoded : U'\n' + decoded;
+        continue;
+      }
+
+      if (!message.empty())
+        s_terminal_messages.push_back(std::move(message));
+      message.clear();
+    }
+
+    if (!message.empty())
+      s_terminal_messages.push_back(std::move(message));
+
+    return !s_terminal_messages.empty();
+  }
+
+  // Appends the characters typed since the last frame to the layout
+  static void update_terminal_layout(const terminal_state &state, const std::int32_t view_width, const std::int32_t view_height)
+  {
+    auto &layout = s_terminal_layout;
+    const auto &message = s_terminal_messages[state.cur_line];
+    const auto length = std::min(state.cur_char + 1, message.size());
+
+    if (layout.message != state.cur_line || layout.view_width != view_width || layout.view_height != view_height || length < layout.length)
+    {
+      const float margin = static_cast<float>(view_width) / s_col_count;
+      const vec2f origin = {margin, margin};
+      layout = {.message = state.cur_line, .view_width = view_width, .view_height = view_height, .origin = origin, .pen = origin, .min = origin, .max = origin};
+    }
+
+    if (layout.length == length)
+      return;
+
+    // The cells already uploaded keep their glyphs, the new ones must not evict them from the atlas
+    for (std::size_t i = 0; i < layout.length; ++i)
+      if (message[i] != U'\n')
+        s_terminal_font->find_glyph(static_cast<std::int32_t>(message[i]));
+
+    glBindBuffer(GL_ARRAY_BUFFER, s_vb_terminal);
+
+    for (; layout.length < length; ++layout.length)
+    {
+      const auto ch = static_cast<std::int32_t>(message[layout.length]);
+
+      if (ch == U'\n')
+      {
+        layout.pen = {layout.origin[0], layout.pen[1] + s_terminal_line_height * s_terminal_font_size};
+        continue;
+      }
+
+      const auto &g = s_terminal_font->find_glyph(ch);
+      const character_cell cell{.position = layout.pen, .size = s_terminal_font_size, .glyph = g.slot, .color = {s_terminal_color, 1.0f}};
+      glBufferSubData(GL_ARRAY_BUFFER, sizeof(character_cell) * layout.cell_count++, sizeof(character_cell), &cell);
+      get_frame_counters().upload_bytes += sizeof(character_cell);
+
+      layout.pen[0] += g.norm_advance * s_terminal_font_size;
+      layout.max = {std::max(layout.max[0], layout.pen[0]), std::max(layout.max[1], layout.pen[1] + s_terminal_font_size)};
+    }
+  }
+
+  static void render_terminal_text(const GLuint program, const float view_width, const float view_height)
+  {
+    use_characters_program(*(s_terminal_font.get()), program, view_width, view_height);
+
+    glBindVertexArray(s_va_terminal);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, s_terminal_layout.cell_count);
+    get_frame_counters().draw_calls++;
+    get_frame_counters().cells += s_terminal_layout.cell_count;
+  }
+
+  static void render_terminal(const simulation_frame &frame)
+  {
+    MR_TRACE_ZONE("terminal");
+    auto [vw, vh] = get_view_size();
+
+    const auto &state = frame.terminal;
+
+    s_terminal_font->begin_frame();
+
+    mark_frame_phase(frame_phase::layers);
+    update_terminal_layout(state, vw, vh);
+    mark_frame_phase(frame_phase::upload);
+
+    // Render
+
+    if (!s_tier.bloom)
+    {
+      enable_scope scope({GL_FRAMEBUFFER_SRGB});
+
+      begin_gpu_pass(gpu_pass::layers);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      glEnable(GL_FRAMEBUFFER_SRGB);
+      glViewport(0, 0, s_window_width, s_window_height);
+
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      glUseProgram(s_prg_strings_tonemap);
+      glUniform1f(glGetUniformLocation(s_prg_strings_tonemap, "uExposure"), s_exposure);
+      render_terminal_text(s_prg_strings_tonemap, vw, vh);
+
+      end_gpu_pass();
+      mark_frame_phase(frame_phase::layers);
+      return;
+    }
+
+    s_fx_bloom->set_max_levels(get_bloom_levels(s_bloom_levels, s_terminal_bloom_levels));
+
+    // Glyphs can stick out of their cell a bit
+    const auto margin = vec2f{0.5f, 0.5f} * s_terminal_font_size;
+    const auto text_rect = get_terminal_rect(s_terminal_layout.min - margin, s_terminal_layout.max + margin, vw, vh);
+
+    if (!s_terminal_clean || state.cur_line != s_terminal_drawn_line || state.cur_char != s_terminal_drawn_char)
+    {
+      // Both the new text and the old one, which may be longer (a new line)
+      const auto dirty = s_terminal_clean ? text_rect.merged(s_terminal_rect) : pixel_rect{0, 0, s_render_extent.width, s_render_extent.height};
+
+      enable_scope scope({GL_SCISSOR_TEST});
+      glEnable(GL_SCISSOR_TEST);
+      glScissor(dirty.x, dirty.y, dirty.width, dirty.height);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_final_render, 0);
+
+      glViewport(0, 0, s_render_extent.width, s_render_extent.height);
+
+      begin_gpu_pass(gpu_pass::layers);
+
+      {
+        MR_TRACE_GPU_ZONE("text");
+
+        glClearColor(0, 0, 0, 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        render_terminal_text(s_prg_strings, vw, vh);
+      }
+
+      end_gpu_pass();
+      mark_frame_phase(frame_phase::layers);
+      begin_gpu_pass(gpu_pass::bloom);
+
+      s_tx_terminal_bloom = s_fx_bloom->compute(s_tx_final_render, s_bloom_threshold, s_bloom_knee, dirty);
+
+      end_gpu_pass();
+
+      s_terminal_clean = true;
+      s_terminal_rect = text_rect;
+      s_terminal_drawn_line = state.cur_line;
+      s_terminal_drawn_char = state.cur_char;
+    }
+
+    s_fx_bloom->set_max_levels(s_bloom_levels);
+
+    // Draw to screen. The whole screen is cleared anyway, its content is undefined after a swap
+    const auto window_rect = s_terminal_rect.scaled(float(s_window_width) / s_render_extent.width, float(s_window_height) / s_render_extent.height);
+    render_hdr_to_screen(s_tx_final_render, s_tx_terminal_bloom, s_render_extent, window_rect);
+    mark_frame_phase(frame_phase::post);
+  }
+
+  // Bounding box of the terminal text (in view units) grown by the glow radius, in render target pixels
+  static pixel_rect get_terminal_rect(const vec2f &min, const vec2f &max, const float view_width, const float view_height)
+  {
+    const float sx = s_render_extent.width / view_width, sy = s_render_extent.height / view_height;
+
+    // The view y-axis points down
+    const pixel_rect rect{
+        .x = static_cast<std::int32_t>(std::floor(min[0] * sx)),
+        .y = static_cast<std::int32_t>(std::floor(s_render_extent.height - max[1] * sy)),
+        .width = static_cast<std::int32_t>(std::ceil((max[0] - min[0]) * sx)),
+        .height = static_cast<std::int32_t>(std::ceil((max[1] - min[1]) * sy))};
+
+    return rect.grown(s_fx_bloom->get_radius()).clamped(s_render_extent.width, s_render_extent.height);
+  }
+
+  static void render_characters(const std::vector<character_cell> &cells, const font &font, const GLuint program, const float view_width, const float view_height)
+  {
+    use_characters_program(font, program, view_width, view_height);
+
+    glBindVertexArray(s_va);
+    glBindBuffer(GL_ARRAY_BUFFER, s_vb);
+
+    // Upload and draw in batches, orphaning the buffer each time so the driver doesn't have to wait for the previous draw
+    for (std::size_t first = 0; first < cells.size(); first += s_max_batch_cells)
+    {
+      const std::size_t count = std::min(s_max_batch_cells, cells.size() - first);
+      {
+        MR_TRACE_ZONE("upload");
+        mark_frame_phase(frame_phase::layers);
+        gpu_memory::buffer_data(gpu_memory::owners::vertex_stream, s_vb, GL_ARRAY_BUFFER, sizeof(character_cell) * s_max_batch_cells, nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(character_cell) * count, cells.data() + first);
+        mark_frame_phase(frame_phase::upload);
+      }
+
+      get_frame_counters().cells += count;
+      get_frame_counters().upload_bytes += sizeof(character_cell) * count;
+      glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count);
+      get_frame_counters().draw_calls++;
+    }
+  }
+
+  static void use_characters_program(const font &font, const GLuint program, const float view_width, const float view_height)
+  {
+    glUseProgram(program);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, font.get_texture());
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, font.get_glyph_table());
+
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, font.get_palette_texture());
+
+    glUniform1f(glGetUniformLocation(program, "uScreenWidth"), view_width);
+    glUniform1f(glGetUniformLocation(program, "uScreenHeight"), view_height);
+    glUniform1i(glGetUniformLocation(program, "uFont"), 0);
+    glUniform1i(glGetUniformLocation(program, "uGlyphs"), 1);
+    glUniform1i(glGetUniformLocation(program, "uPalette"), 2);
+    glUniform1i(glGetUniformLocation(program, "uDistanceField"), font.get_mode() == font_mode::sdf);
+  }
+
+  // Used without bloom, where there's no HDR render: the program does the tonemapping itself
+  static void render_characters_to_screen(const std::vector<character_cell> &cells, const font &font, const GLuint program, const float view_width, const float view_height)
+  {
+    enable_scope scope({GL_FRAMEBUFFER_SRGB});
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glEnable(GL_FRAMEBUFFER_SRGB);
+    glViewport(0, 0, s_window_width, s_window_height);
+
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "uExposure"), s_exposure);
+
+    render_characters(cells, font, program, view_width, view_height);
+  }
+
+  static void update_code(const float dt, simulation_frame &frame)
+  {
+    // Swap some glyphs
     // TODO: It's not 100% correct but it's ok
-    if (rng::next() < s_glyph_swaps_per_second * dt)
-      s_font->swap_glyphs(1);
+    if (s_simulation_rng.next() < s_glyph_swaps_per_second * dt && frame.glyph_swaps.size() < s_max_glyph_swaps)
+    {
+      const auto index = s_simulation_rng.next(std::size_t{0}, s_palette_size);
+      const auto other = s_palette_candidates > s_palette_size ? s_simulation_rng.next(std::size_t{0}, s_palette_candidates - s_palette_size)
+                                                               : s_simulation_rng.next(std::size_t{0}, s_palette_size);
+      frame.glyph_swaps.push_back({.index = static_cast<std::uint32_t>(index), .other = static_cast<std::uint32_t>(other)});
+    }
+
+    // Bring in the strings that reached the top of the screen
+    s_simulation_time += dt;
+    s_respawn_wheel.advance(s_simulation_time, &wake_falling_string);
+
+    // Update the falling strings on screen, and park the ones that went out
+    for (std::size_t i = 0; i < s_active_strings.size();)
+    {
+      if (step_falling_string(s_falling_strings[s_active_strings[i]], dt))
+      {
+        ++i;
+        continue;
+      }
+
+      if (!s_config.uniform_columns)
+        release_column(s_falling_strings[s_active_strings[i]], s_active_strings[i]);
+
+      park_falling_string(s_active_strings[i], s_view_height);
+      s_active_strings[i] = s_active_strings.back();
+      s_active_strings.pop_back();
+    }
+  }
 
-    // Update all the falling strings
-    for (auto &s : s_falling_strings)
-      update_falling_string(s, dt, view_width, view_height);
+  static void render_code(const simulation_frame &frame)
+  {
+    const auto blur_extent = s_render_extent.scaled_down(s_blur_scale);
+    const auto blur_uv_scale = blur_extent.get_uv_scale();
+    const auto blur_uv_max = blur_extent.get_uv_max();
+
+    const float view_width = s_col_count;
+    const float view_height = frame.view_height;
+
+    s_font->begin_frame();
 
     auto tx_src = s_tx_blur0;
     auto tx_dst = s_tx_blur1;
 
+    begin_gpu_pass(gpu_pass::layers);
+
     // Clear source from previous frame
     glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tx_src, 0);
@@ -433,82 +2249,421 @@ namespace mr
 
     // Render and blur background layers (size - 1) to a texture
 
-    for (size_t i = 0; i < s_depth_layers.size() - 1; ++i)
+    for (size_t i = s_skipped_layers; i < s_depth_layers.size() - 1; ++i)
+    {
+      const auto &current_grid = frame.grids[i];
+
+      // The zone ends before the blur, which has one of its own
+      {
+        MR_TRACE_GPU_ZONE("layer");
+
+        glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tx_dst, 0);
+
+        glViewport(0, 0, blur_extent.width, blur_extent.height);
+
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        // Render previous pass as background
+        glUseProgram(s_prg_pass_trough);
+        glUniform1i(glGetUniformLocation(s_prg_pass_trough, "uTexture"), 0);
+        glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvScale"), blur_uv_scale[0], blur_uv_scale[1]);
+        glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvMax"), blur_uv_max[0], blur_uv_max[1]);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, tx_src);
+
+        glBindVertexArray(s_va_quad);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        get_frame_counters().draw_calls++;
+
+        // Render the current layer
+        render_characters(current_grid, *(s_font.get()), s_prg_strings_palette, view_width, view_height);
+      }
+
+      // Blur the current texture, its time counts as post-processing
+      end_gpu_pass();
+      mark_frame_phase(frame_phase::layers);
+      begin_gpu_pass(gpu_pass::blur);
+      s_blur_filter->apply(tx_dst, (1.0f - s_depth_layers[i]) * s_blur_str_multiplier, s_tier.blur_iterations);
+      end_gpu_pass();
+      mark_frame_phase(frame_phase::post);
+      begin_gpu_pass(gpu_pass::layers);
+
+      std::swap(tx_dst, tx_src);
+    }
+
+    // Without bloom there's no need for the final render, the background goes straight to the screen, and the top
+    // layer is drawn over it
+    if (!s_tier.bloom)
+    {
+      end_gpu_pass();
+      render_hdr_to_screen(tx_src, 0, blur_extent, {0, 0, s_window_width, s_window_height});
+
+      begin_gpu_pass(gpu_pass::layers);
+      {
+        MR_TRACE_GPU_ZONE("top layer");
+        render_characters_to_screen(frame.grids.back(), *(s_font.get()), s_prg_strings_palette_tonemap, view_width, view_height);
+      }
+      end_gpu_pass();
+
+      mark_frame_phase(frame_phase::layers);
+      stress_mark(&s_stress_stats.layers);
+      stress_mark(&s_stress_stats.post);
+      report_stress_stats(frame);
+      return;
+    }
+
+    // Render background + top layer
     {
-      const auto &current_grid = s_grids[i];
+      MR_TRACE_GPU_ZONE("top layer");
 
       glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tx_dst, 0);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_final_render, 0);
 
-      glViewport(0, 0, w / s_blur_scale, h / s_blur_scale);
+      glViewport(0, 0, s_render_extent.width, s_render_extent.height);
 
-      glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+      glClearColor(0, 0, 0, 1);
       glClear(GL_COLOR_BUFFER_BIT);
 
-      // Render previous pass as background
       glUseProgram(s_prg_pass_trough);
       glUniform1i(glGetUniformLocation(s_prg_pass_trough, "uTexture"), 0);
+      glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvScale"), blur_uv_scale[0], blur_uv_scale[1]);
+      glUniform2f(glGetUniformLocation(s_prg_pass_trough, "uUvMax"), blur_uv_max[0], blur_uv_max[1]);
 
       glActiveTexture(GL_TEXTURE0);
       glBindTexture(GL_TEXTURE_2D, tx_src);
 
-      glBindVertexArray(s_va_quad);
-      glDrawArrays(GL_TRIANGLES, 0, 6);
+      glBindVertexArray(s_va_quad);
+      glDrawArrays(GL_TRIANGLES, 0, 6);
+      get_frame_counters().draw_calls++;
+
+      render_characters(frame.grids.back(), *(s_font.get()), s_prg_strings_palette, view_width, view_height);
+    }
+
+    end_gpu_pass();
+
+    mark_frame_phase(frame_phase::layers);
+    stress_mark(&s_stress_stats.layers);
+
+    begin_gpu_pass(gpu_pass::bloom);
+    const auto tx_bloom = s_fx_bloom->compute(s_tx_final_render, s_bloom_threshold, s_bloom_knee);
+    end_gpu_pass();
+
+    render_hdr_to_screen(s_tx_final_render, tx_bloom, s_render_extent, {0, 0, s_window_width, s_window_height});
+
+    mark_frame_phase(frame_phase::post);
+    stress_mark(&s_stress_stats.post);
+    report_stress_stats(frame);
+  }
+
+  // Debug view of the fill rate. The cells of every layer (or the terminal text) are drawn at the render resolution,
+  // adding 1 to the final render target for every fragment, and the counts are shown as a heat map. The background
+  // layers are normally drawn at the blur resolution, so their real cost is lower on the tiers that scale it down
+  static void render_overdraw(const simulation_frame &frame)
+  {
+    const auto [vw, vh] = get_view_size();
+
+    begin_gpu_pass(gpu_pass::layers);
+
+    {
+      enable_scope scope({GL_BLEND});
+
+      glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_final_render, 0);
+
+      glViewport(0, 0, s_render_extent.width, s_render_extent.height);
+
+      glClearColor(0, 0, 0, 0);
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_ONE, GL_ONE);
+
+      if (frame.scene == scenes::code)
+      {
+        s_font->begin_frame();
+        for (std::size_t i = s_skipped_layers; i < frame.grids.size(); ++i)
+          render_characters(frame.grids[i], *(s_font.get()), s_prg_strings_palette_overdraw, s_col_count, frame.view_height);
+      }
+      else
+      {
+        s_terminal_font->begin_frame();
+        update_terminal_layout(frame.terminal, vw, vh);
+        render_terminal_text(s_prg_strings_overdraw, vw, vh);
+
+        // The retained text was overwritten
+        s_terminal_clean = false;
+      }
+
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+    end_gpu_pass();
+    mark_frame_phase(frame_phase::layers);
+
+    begin_gpu_pass(gpu_pass::tonemap);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, s_window_width, s_window_height);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, s_tx_final_render);
+
+    const auto uv_scale = s_render_extent.get_uv_scale();
+    const auto uv_max = s_render_extent.get_uv_max();
+    glUseProgram(s_prg_overdraw);
+    glUniform1i(glGetUniformLocation(s_prg_overdraw, "uTexture"), 0);
+    glUniform1f(glGetUniformLocation(s_prg_overdraw, "uMaxCount"), s_overdraw_max_count);
+    glUniform2f(glGetUniformLocation(s_prg_overdraw, "uUvScale"), uv_scale[0], uv_scale[1]);
+    glUniform2f(glGetUniformLocation(s_prg_overdraw, "uUvMax"), uv_max[0], uv_max[1]);
+
+    glBindVertexArray(s_va_quad);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    get_frame_counters().draw_calls++;
+
+    end_gpu_pass();
+    mark_frame_phase(frame_phase::post);
+  }
+
+  // (Re)Initilize falling strings for the given window size
+  static void reset_simulation(const float width, const float height)
+  {
+    s_view_height = height / width * s_col_count;
+
+    s_active_strings.clear();
+    s_active_strings.reserve(s_falling_strings.size());
+    s_respawn_wheel.clear(s_simulation_time);
+    s_respawn_wheel.reserve(s_falling_strings.size());
+    reset_column_occupancy(s_view_height);
+
+    for (std::uint32_t i = 0; i < s_falling_strings.size(); ++i)
+      park_falling_string(i, s_view_height);
+  }
+
+  // The row counts changed, and the column schedule depends on them, so it's built again. The strings on screen keep
+  // their place, in the order they entered. The parked ones are respawned against them, along with the strings on
+  // screen that would now catch up with the one ahead of them
+  static void reschedule_columns()
+  {
+    static std::vector<bool> respawn; // Keeps its memory from resize to resize
+    respawn.assign(s_falling_strings.size(), true);
+
+    const auto entry_time = [](const std::uint32_t index) {
+      const auto &s = s_falling_strings[index];
+      return s_simulation_time - (s.y + 0.5f) / s.speed;
+    };
+    std::ranges::sort(s_active_strings, {}, entry_time);
+
+    for (const auto index : s_active_strings)
+    {
+      const auto &s = s_falling_strings[index];
+      auto &occupancy = s_column_occupancy[s.layer_index];
+      const auto wake_time = entry_time(index);
+
+      // Give or take a step, y adds up rounding errors
+      if (get_column_free_time(occupancy, s.x, s.speed) > wake_time + s_simulation_step)
+        continue;
+
+      respawn[index] = false;
+      occupancy.columns[s.x] = {.string = index, .wake_time = wake_time, .speed = s.speed, .length = s.length};
+      occupancy.idle[s.x / 64] &= ~(std::uint64_t(1) << (s.x % 64));
+    }
+
+    std::erase_if(s_active_strings, [](const std::uint32_t index) { return respawn[index]; });
+    s_respawn_wheel.clear(s_simulation_time);
+
+    for (std::uint32_t i = 0; i < s_falling_strings.size(); ++i)
+      if (respawn[i])
+        park_falling_string(i, s_view_height);
+  }
+
+  // Rescales the simulation to a new window size. The number of columns is fixed, and positions are in cells, so the
+  // strings on screen scale with the window by themselves: only the number of rows changes, and the strings under
+  // the new bottom row leave at the next step. Only the strings that aren't on screen yet are respawned
+  static void resize_simulation(const float width, const float height)
+  {
+    // Minimized
+    if (width <= 0.0f || height <= 0.0f)
+      return;
+
+    if (s_view_height == 0.0f)
+    {
+      reset_simulation(width, height);
+      return;
+    }
+
+    s_view_height = height / width * s_col_count;
+    reset_column_occupancy(s_view_height);
+
+    if (!s_config.uniform_columns)
+      reschedule_columns();
+  }
+
+  // Applies the recorded resizes up to the next frame, and returns the frame. False at the end of the replay
+  static bool next_replay_frame(replay_event &frame)
+  {
+    while (const auto e = s_replay_reader->next())
+    {
+      if (e->type == replay_event::types::frame)
+      {
+        frame = *e;
+        return true;
+      }
+
+      resize_simulation(e->width, e->height);
+    }
+
+    return false;
+  }
+
+  // Runs the simulation for a frame: applies the pending resize, takes the fixed steps that fit in the time since the
+  // previous frame (or the recorded ones), and emits the cells. The timing is returned, to be recorded
+  static void simulate(simulation_frame &frame, replay_event &timing)
+  {
+    static auto prev_time = clock_t::now();
+    static float accumulator = 0.0f;
+    static float catch_up = 0.0f;
+
+    const auto start_time = clock_t::now();
+    const std::chrono::duration<float> delta = start_time - prev_time;
+    prev_time = start_time;
+
+    frame.glyph_swaps.clear();
+    frame.glyph_swaps.reserve(s_max_glyph_swaps);
+    timing = {.type = replay_event::types::frame};
+
+    if (s_replay_reader)
+    {
+      if (!next_replay_frame(timing))
+      {
+        frame.last = true;
+        return;
+      }
+    }
+    else
+    {
+      // The replay has its own resizes, the window ones are only used when not playing back
+      if (const auto size = s_pending_size.exchange(0); size != 0)
+      {
+        const auto w = static_cast<std::int32_t>(size >> 32), h = static_cast<std::int32_t>(size & 0xffffffff);
+        resize_simulation(w, h);
+
+        if (s_replay_writer)
+          s_replay_writer->write({.type = replay_event::types::resize, .width = w, .height = h});
+      }
+
+      accumulator += std::min(delta.count(), s_max_frame_time);
+      timing.steps = static_cast<std::int32_t>(accumulator / s_simulation_step);
+      accumulator -= timing.steps * s_simulation_step;
+      timing.alpha = std::clamp(accumulator / s_simulation_step, 0.0f, 1.0f);
+
+      // The time missed while paused is taken a few steps at a time, so the rain visibly fast-forwards
+      catch_up += s_catch_up_time.exchange(0.0f);
+      const auto extra_steps = std::min(static_cast<std::int32_t>(catch_up / s_simulation_step), s_catch_up_steps);
+      timing.steps += extra_steps;
+      catch_up -= extra_steps * s_simulation_step;
+    }
+
+    {
+      MR_TRACE_ZONE("update strings");
 
-      // Render the current layer
-      render_characters(current_grid, *(s_font.get()), view_width, view_height);
+      for (std::int32_t i = 0; i < timing.steps; ++i)
+      {
+        switch (s_scene)
+        {
+        case scenes::terminal:
+          update_terminal(s_simulation_step);
+          break;
+        case scenes::code:
+          update_code(s_simulation_step, frame);
+          break;
+        }
+      }
+    }
 
-      // Blur the current texture
-      s_blur_filter->apply(tx_dst, (1.0f - s_depth_layers[i]) * s_blur_str_multiplier, 1);
+    frame.scene = s_scene;
+    frame.terminal = s_terminal_state;
+    frame.view_height = s_view_height;
+    frame.active_strings = s_active_strings.size();
+    frame.avoided_overlaps = s_avoided_overlaps;
 
-      std::swap(tx_dst, tx_src);
+    // The grids keep their memory from frame to frame, and have room for every string of their layer fully on screen
+    // from the start, so they don't grow while the rain builds up
+    frame.grids.resize(s_depth_layers.size());
+    for (std::size_t i = 0; i < frame.grids.size(); ++i)
+    {
+      const auto rows = i < s_column_occupancy.size() ? static_cast<std::size_t>(s_column_occupancy[i].row_count) + 1 : 0;
+      frame.grids[i].clear();
+      frame.grids[i].reserve(s_layer_strings[i] * std::min<std::size_t>(s_falling_string_max_length, rows));
     }
 
-    // Render background + top layer
+    if (s_scene == scenes::code)
     {
+      MR_TRACE_ZONE("emit cells");
+      for (const auto i : s_active_strings)
+        emit_falling_string(s_falling_strings[i], timing.alpha, frame.grids);
+    }
 
-      glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s_tx_final_render, 0);
+    frame.start_time = start_time;
+    frame.simulation_time = clock_t::now() - start_time;
+  }
 
-      glViewport(0, 0, w, h);
+  // Simulation thread: produces frame N + 1 while the GL thread renders frame N
+  static void run_simulation()
+  {
+#ifdef MR_PROFILE
+    trace::set_thread_name("simulation");
+#endif
 
-      glClearColor(0, 0, 0, 1);
-      glClear(GL_COLOR_BUFFER_BIT);
+    while (true)
+    {
+      auto &frame = s_frames.back();
 
-      glUseProgram(s_prg_pass_trough);
-      glUniform1i(glGetUniformLocation(s_prg_pass_trough, "uTexture"), 0);
+      replay_event timing;
+      allocation_count allocations;
+      {
+        MR_TRACE_ZONE("simulate");
+        allocation_scope scope(allocations);
+        simulate(frame, timing);
+      }
+      frame.simulation_allocations = allocations;
 
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, tx_src);
+      if (s_replay_writer && !frame.last)
+        s_replay_writer->write(timing);
 
-      glBindVertexArray(s_va_quad);
-      glDrawArrays(GL_TRIANGLES, 0, 6);
+      s_frames.publish();
 
-      render_characters(s_grids.back(), *(s_font.get()), view_width, view_height);
+      if (frame.last || !s_frames.wait_consumed(s_simulation_stop))
+        return;
     }
-
-    const auto tx_bloom = s_fx_bloom->compute(s_tx_final_render, s_bloom_threshold, s_bloom_knee);
-
-    render_hdr_to_screen(s_tx_final_render, tx_bloom);
   }
 
-  static void resize()
+  static void stop_simulation()
   {
+    if (!s_simulation_thread.joinable())
+      return;
 
-    const auto [w, h] = get_window_size();
-    const auto [vw, vh] = get_view_size();
+    // Consuming wakes up the simulation thread, if it's waiting
+    s_simulation_stop = true;
+    s_frames.consume();
+    s_simulation_thread.join();
+  }
 
-    // (Re)Initilize falling strings
-    for (auto &s : s_falling_strings)
-      init_falling_string(s, vh);
+  // Allocates the render targets with the current capacity
+  static void allocate_render_targets()
+  {
+    const auto blur_extent = s_render_extent.scaled_down(s_blur_scale);
 
     glBindTexture(GL_TEXTURE_2D, s_tx_final_render);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+    gpu_memory::tex_image_2d(gpu_memory::owners::final_render, s_tx_final_render, GL_TEXTURE_2D, GL_RGBA16F, s_render_extent.capacity_width, s_render_extent.capacity_height,
+                             GL_RGBA, GL_HALF_FLOAT, nullptr);
 
     for (const auto tx : {s_tx_blur0, s_tx_blur1})
     {
       glBindTexture(GL_TEXTURE_2D, tx);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w / s_blur_scale, h / s_blur_scale, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+      gpu_memory::tex_image_2d(gpu_memory::owners::blur, tx, GL_TEXTURE_2D, GL_RGBA16F, blur_extent.capacity_width, blur_extent.capacity_height, GL_RGBA, GL_HALF_FLOAT, nullptr);
 
       glBindFramebuffer(GL_FRAMEBUFFER, s_fb_render_target);
       glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tx, 0);
@@ -516,13 +2671,56 @@ namespace mr
       glClearColor(0, 0, 0, 1);
       glClear(GL_COLOR_BUFFER_BIT);
     }
+  }
+
+  // Only allocates if the window doesn't fit in the render targets anymore, and growing is allowed
+  static void resize(const bool allow_grow)
+  {
+    const auto w = s_window_width, h = s_window_height;
+
+    // Picked up by the simulation at the beginning of the next frame
+    s_pending_size = (static_cast<std::uint64_t>(w) << 32) | static_cast<std::uint32_t>(h);
+
+    if (allow_grow && s_render_extent.reserve(w, h, s_max_render_width, s_max_render_height))
+      allocate_render_targets();
+
+    s_grow_pending = !s_render_extent.contains(w, h);
+    update_render_size();
+  }
+
+  // Only a fraction of the window is rendered (see the quality levels), the frame is stretched to the window at the end
+  static void update_render_size()
+  {
+    s_render_extent.set_size(std::max(1, static_cast<std::int32_t>(s_window_width * s_render_scale)), std::max(1, static_cast<std::int32_t>(s_window_height * s_render_scale)));
+
+    s_fx_bloom->resize(s_render_extent);
+    s_blur_filter->resize(s_render_extent.scaled_down(s_blur_scale));
+
+    // Everything moved, the terminal is drawn from scratch
+    s_terminal_clean = false;
+  }
+
+  // Each cell is an instance, the quad vertices are generated in the vertex shader
+  static void set_cell_attributes()
+  {
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(character_cell), (const void *)0);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(character_cell), (const void *)8);
+    glVertexAttribIPointer(2, 1, GL_INT, sizeof(character_cell), (const void *)12);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(character_cell), (const void *)16);
 
-    s_fx_bloom->resize(w, h);
-    s_blur_filter->resize(w / s_blur_scale, h / s_blur_scale);
+    for (GLuint i = 0; i < 4; ++i)
+      glVertexAttribDivisor(i, 1);
   }
 
   static void initialize()
   {
+    size_simulation();
+    gpu_memory::start();
 
     // Init some OpenGL stuff
     glDisable(GL_DEPTH_TEST);
@@ -539,30 +2737,76 @@ namespace mr
     // On integrated cards, if I don't preallocate this buffer, memory is going to grow over 1 GB in the
     // first 20 seconds of the program, and then decreses slowly to 100mb. Probably if the buffer
     // is not big enough, it keeps reallocating it and then the memory is freed after a few seconds.
-    // Anyway, this should be fixed by initially allocating a buffer that is big enough to contain all the geometry.
-    // So here it is. I'm overshooting a bit, but I'm sure that this is enough.
-    constexpr std::size_t prealloc_size = 6 * sizeof(vertex) * s_falling_strings_count * (s_falling_string_max_length + 1);
-    glBufferData(GL_ARRAY_BUFFER, prealloc_size, nullptr, GL_DYNAMIC_DRAW);
+    // Anyway, this should be fixed by always using a buffer of the same size, big enough for a batch of cells.
+    gpu_memory::buffer_data(gpu_memory::owners::vertex_stream, s_vb, GL_ARRAY_BUFFER, sizeof(character_cell) * s_max_batch_cells, nullptr, GL_DYNAMIC_DRAW);
+    set_cell_attributes();
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
+    // The terminal text stays in its own buffer, big enough for the longest message
+    std::size_t terminal_cells = 0;
+    for (const auto &message : s_terminal_messages)
+      terminal_cells = std::max(terminal_cells, message.size());
+
+    glGenVertexArrays(1, &s_va_terminal);
+    glGenBuffers(1, &s_vb_terminal);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)8);
-    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(vertex), (const void *)16);
+    glBindVertexArray(s_va_terminal);
+    glBindBuffer(GL_ARRAY_BUFFER, s_vb_terminal);
+    gpu_memory::buffer_data(gpu_memory::owners::vertex_stream, s_vb_terminal, GL_ARRAY_BUFFER, sizeof(character_cell) * terminal_cells, nullptr, GL_DYNAMIC_DRAW);
+    set_cell_attributes();
+
+    // The performance overlay has its own buffer too
+    glGenVertexArrays(1, &s_va_hud);
+    glGenBuffers(1, &s_vb_hud);
+
+    glBindVertexArray(s_va_hud);
+    glBindBuffer(GL_ARRAY_BUFFER, s_vb_hud);
+    gpu_memory::buffer_data(gpu_memory::owners::vertex_stream, s_vb_hud, GL_ARRAY_BUFFER, sizeof(character_cell) * s_hud_max_cells, nullptr, GL_DYNAMIC_DRAW);
+    set_cell_attributes();
+    s_hud_cells.reserve(s_hud_max_cells);
 
     // Load programs
     s_prg_strings = load_program(embed::s_vs_strings, embed::s_fs_strings);
+    s_prg_strings_palette = load_program(embed::s_vs_strings, embed::s_fs_strings, {"PALETTE"});
+    s_prg_strings_tonemap = load_program(embed::s_vs_strings, embed::s_fs_strings, {"TONEMAP"});
+    s_prg_strings_palette_tonemap = load_program(embed::s_vs_strings, embed::s_fs_strings, {"PALETTE", "TONEMAP"});
+    s_prg_strings_overdraw = load_program(embed::s_vs_strings, embed::s_fs_strings, {"OVERDRAW"});
+    s_prg_strings_palette_overdraw = load_program(embed::s_vs_strings, embed::s_fs_strings, {"PALETTE", "OVERDRAW"});
+    s_prg_overdraw = load_program(embed::s_vs_fullscreen, embed::s_fs_overdraw);
     s_prg_pass_trough = load_program(embed::s_vs_fullscreen, embed::s_fs_pass_trough);
     s_prg_hdr = load_program(embed::s_vs_fullscreen, embed::s_fs_hdr);
+    s_prg_hdr_no_bloom = load_program(embed::s_vs_fullscreen, embed::s_fs_hdr, {"NO_BLOOM"});
 
     // Load fonts
     s_font = std::make_unique<font>();
-    s_font->load(embed::s_font.data(), embed::s_font.size());
+
+    if (s_config.rain_font_file.empty())
+      s_font->load(embed::s_font.data(), embed::s_font.size(), font_mode::sdf);
+    else
+      s_font->load(s_config.rain_font_file, font_mode::sdf);
+
+    if (!s_config.rain_code_points.empty())
+      s_font->set_palette(get_rain_candidates(), rng::stream(s_config.seed, s_palette_stream_id));
+
+    // Rasterise all the glyphs that are going to be used right away, so there's no hitch when they first appear
+    s_font->preload(s_font->get_palette());
 
     s_terminal_font = std::make_unique<font>();
-    s_terminal_font->load(embed::s_terminal_font.data(), embed::s_terminal_font.size());
+    s_terminal_font->load(embed::s_terminal_font.data(), embed::s_terminal_font.size(), font_mode::sdf);
+
+    std::vector<std::int32_t> terminal_code_points;
+    for (const auto &message : s_terminal_messages)
+      for (const auto ch : message)
+        if (ch != U'\n')
+          terminal_code_points.push_back(static_cast<std::int32_t>(ch));
+
+    // Printable ASCII, for the performance overlay
+    for (std::int32_t cp = ' '; cp <= '~'; ++cp)
+      terminal_code_points.push_back(cp);
+
+    std::ranges::sort(terminal_code_points);
+    terminal_code_points.erase(std::unique(terminal_code_points.begin(), terminal_code_points.end()), terminal_code_points.end());
+
+    s_terminal_font->preload(terminal_code_points);
 
     // Blur filter
     s_blur_filter = std::make_unique<blur_filter>();
@@ -570,9 +2814,13 @@ namespace mr
     // Bloom
     s_fx_bloom = std::make_unique<bloom>();
 
+    s_gpu_timer = std::make_unique<gpu_timer>(static_cast<std::size_t>(gpu_pass::count));
+
     // Full screen quad
     std::tie(s_va_quad, s_vb_quad) = create_full_screen_quad();
 
+    check_glsl_rng();
+
     // Render target
     glGenFramebuffers(1, &s_fb_render_target);
 
@@ -599,48 +2847,383 @@ namespace mr
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
     // Initialize and resize stuff
-    resize();
+    resize(true);
+
+#ifdef MR_PROFILE
+    if (!s_config.trace_file.empty() && !trace::open(s_config.trace_file))
+      terminate_with_error("Could not create trace file");
+#endif
 
 #ifdef DEBUG
-    // Init Debug GUI
+    // Init Debug GUI. There's no GLFW backend, the input is forwarded from the event thread (see process_window_events)
     ImGui::CreateContext();
-    ImGuiIO &io = ImGui::GetIO();
-    (void)io;
-    ImGui_ImplGlfw_InitForOpenGL(s_window, true);
     ImGui_ImplOpenGL3_Init("#version 330");
 #endif
   }
 
-  static void terminate(const int32_t exit_code)
+  // Render thread: handles the events forwarded by the event thread. Resizes are collapsed, only the last size matters
+  static void process_window_events()
+  {
+    bool resized = false;
+
+    for (window_event e; s_window_events.pop(e);)
+    {
+      switch (e.type)
+      {
+      case window_event::types::resize:
+        s_window_width = e.width;
+        s_window_height = e.height;
+        s_last_resize = clock_t::now();
+        s_alloc_quiet_frames = 0;
+        resized = true;
+        break;
+      case window_event::types::framebuffer_resize:
+        s_framebuffer_width = e.width;
+        s_framebuffer_height = e.height;
+        break;
+      case window_event::types::mouse_button:
+#ifdef DEBUG
+        if (e.key >= 0 && e.key < IM_ARRAYSIZE(ImGui::GetIO().MouseDown))
+          ImGui::GetIO().MouseDown[e.key] = e.value;
+#endif
+        break;
+      case window_event::types::scroll:
+#ifdef DEBUG
+        ImGui::GetIO().MouseWheelH += e.x;
+        ImGui::GetIO().MouseWheel += e.y;
+#endif
+        break;
+      case window_event::types::iconify:
+        s_window_iconified = e.value;
+        break;
+      case window_event::types::focus:
+        s_window_focused = e.value;
+        break;
+      case window_event::types::key:
+        if (e.value && e.key == s_hud_key)
+          show_hud(!s_hud_visible);
+        else if (e.value && e.key == s_overdraw_key)
+          s_overdraw = !s_overdraw;
+        [[fallthrough]];
+      case window_event::types::cursor:
+#ifdef DEBUG
+        if (e.type == window_event::types::cursor)
+          ImGui::GetIO().MousePos = ImVec2(e.x, e.y);
+#endif
+        // The cursor event is fired immeditately even if the mouse doesn't move, so wait a little bit before actually considering it
+        if (s_config.exit_on_input && clock_t::now() - s_start_time > s_exit_on_input_delay)
+          glfwSetWindowShouldClose(s_window, GLFW_TRUE);
+        break;
+      }
+    }
+
+    if (resized)
+      resize(false);
+    else if (s_grow_pending && clock_t::now() - s_last_resize > s_resize_debounce)
+      resize(true);
+  }
+
+  // Must be called with the context current (otherwise destructors cause segmentation fault)
+  static void release_resources()
   {
-    // Force destructors before glfwTerminate (otherwise they cause segmentation fault)
+    stop_simulation();
+
+#ifdef MR_PROFILE
+    // In case the rendering stopped before the end of the traced frames
+    trace::close();
+#endif
+
+    for (auto &fence : s_frame_fences)
+    {
+      if (fence.sync)
+        glDeleteSync(fence.sync);
+      fence.sync = nullptr;
+    }
+    s_frame_fence_count = 0;
+
     s_terminal_font = nullptr;
     s_font = nullptr;
     s_blur_filter = nullptr;
     s_fx_bloom = nullptr;
+    s_gpu_timer = nullptr;
+    s_replay_writer = nullptr;
+  }
+
+  static void render()
+  {
+    initialize();
+
+    // Negative leaves the driver default
+    if (s_config.swap_interval >= 0)
+      glfwSwapInterval(s_config.swap_interval);
+
+    s_dynamic_quality = allows_dynamic_quality();
+    select_quality_tier();
+
+    if (s_config.stress_strings > 0)
+    {
+      if (s_config.swap_interval < 0)
+        glfwSwapInterval(0);
+      s_scene = scenes::code;
+      s_stress_stats.last_report = clock_t::now();
+      std::cout << "strings\tactive\tcells\toverlaps\tavoided\tsim ms\tlayers ms\tpost ms\tframe ms\tallocs\n";
+    }
+
+    show_hud(s_config.hud);
+    s_overdraw = s_config.overdraw;
+
+    s_simulation_rng = rng::stream(s_config.seed, s_simulation_stream_id);
+    s_palette_size = s_font->get_palette_size();
+    s_palette_candidates = s_font->get_candidate_count();
+    s_simulation_thread = std::thread(&run_simulation);
+
+    std::size_t frame_index = 0, iteration_count = 0;
+    bool has_frame = false;
+    s_frame_stats.last_report = clock_t::now();
+    s_frame_histogram_report = clock_t::now();
+
+#ifdef MR_PROFILE
+    trace::set_thread_name("render");
+#endif
+
+    while (!s_render_stop && !glfwWindowShouldClose(s_window))
+    {
+#ifdef MR_PROFILE
+      if (!s_config.trace_file.empty() && trace::begin_frame(frame_index, s_config.trace_first_frame, s_config.trace_last_frame))
+        trace::close();
+#endif
+
+      MR_TRACE_ZONE("frame");
+
+      const auto iteration = iteration_count++;
+      finish_frame_timing(iteration);
+      get_frame_counters() = {};
+
+      bool has_gpu_times = false;
+      {
+        allocation_scope scope(get_frame_allocations(alloc_scope::events));
+
+        retire_frame_fences();
+        process_window_events();
+        apply_control_commands();
+
+        has_gpu_times = s_gpu_timer->begin_frame();
+        if (has_gpu_times)
+          update_quality();
+      }
+
+      log_frame_hitch(iteration, has_gpu_times);
+      report_gpu_memory();
+      mark_frame_phase(frame_phase::events);
+
+      const auto idle = get_idle_mode();
+
+      // Keep track of how long the rain is frozen, to fast-forward through it when it starts again
+      const bool frozen = idle == idle_mode::pause || idle == idle_mode::suspend;
+      if (frozen && !s_frozen)
+        s_freeze_time = clock_t::now();
+      else if (!frozen && s_frozen && s_config.catch_up)
+        s_catch_up_time = std::min(std::chrono::duration<float>(clock_t::now() - s_freeze_time).count(), s_max_catch_up);
+      s_frozen = frozen;
+
+      // Without a frame there's nothing to redraw while paused either. The simulation is left waiting for its
+      // frame to be consumed, so it stops too
+      if (idle == idle_mode::suspend || (idle == idle_mode::pause && !has_frame))
+      {
+        std::this_thread::sleep_for(s_suspend_poll_interval);
+        continue;
+      }
+
+      // Take the latest frame from the simulation, which starts working on the next one right away. When
+      // paused, the last frame is drawn again (and its latency is from now)
+      const auto render_allocations = get_thread_allocations();
+      const auto render_start = clock_t::now();
+      auto frame_start = clock_t::now();
+      if (idle != idle_mode::pause)
+      {
+        s_frames.wait_published();
+        s_frames.consume();
+        has_frame = true;
+        frame_start = s_frames.front().start_time;
+        get_frame_allocations(alloc_scope::simulation) += s_frames.front().simulation_allocations;
+
+        // The palette lives on the GPU, so the glyphs are swapped here, once per simulated frame
+        if (!s_frames.front().glyph_swaps.empty())
+          s_font->swap_glyphs(s_frames.front().glyph_swaps);
+      }
+
+      const auto &frame = s_frames.front();
+      if (frame.last)
+        break;
+
+      mark_frame_phase(frame_phase::wait);
+
+      stress_mark(nullptr);
+
+      if (s_calibration.active)
+      {
+        if (frame.scene == scenes::terminal && (s_calibration.frames <= s_calibration_warmup_frames || clock_t::now() - s_calibration.start < s_calibration_time))
+          run_calibration_probe(frame.view_height);
+        else
+          finish_calibration();
+      }
+
+      /* Render here */
+      if (s_overdraw)
+      {
+        render_overdraw(frame);
+      }
+      else
+      {
+        switch (frame.scene)
+        {
+        case scenes::terminal:
+          render_terminal(frame);
+          break;
+        case scenes::code:
+          render_code(frame);
+          break;
+        }
+      }
+
+      render_hud(frame, std::chrono::duration<float, std::milli>(clock_t::now() - render_start).count());
+      render_debug_gui();
+      mark_frame_phase(frame_phase::overlay);
+
+      // Captures are left out, they allocate for the file
+      get_frame_allocations(alloc_scope::render) += get_thread_allocations() - render_allocations;
+
+      if (!s_config.capture_prefix.empty())
+      {
+        std::ostringstream file_name;
+        file_name << s_config.capture_prefix << std::setw(6) << std::setfill('0') << frame_index << ".ppm";
+        capture_frame(file_name.str(), s_framebuffer_width, s_framebuffer_height);
+      }
+
+      frame_index++;
+
+      {
+        allocation_scope scope(get_frame_allocations(alloc_scope::present));
+
+        limit_frame_rate(idle == idle_mode::run ? s_config.max_fps : s_config.idle_fps);
+
+        /* Swap front and back buffers */
+        MR_TRACE_ZONE("present");
+        glfwSwapBuffers(s_window);
+
+        insert_frame_fence(frame_start);
+        report_frame_stats();
+      }
 
+      mark_frame_phase(frame_phase::present);
+      s_frame_timing.simulation = frame.simulation_time;
+      s_frame_timing.frame = frame_index - 1;
+      s_frame_timing.scene = frame.scene;
+      s_frame_timing.counted = idle == idle_mode::run;
+
+      check_frame_allocations(frame.scene);
+    }
+
+    // The last frames, waiting for their GPU times this time
+    finish_frame_timing(iteration_count);
+    if (s_config.hitch_ms > 0.0f)
+    {
+      glFinish();
+      for (std::size_t i = 0; i < gpu_timer::s_frame_lag; ++i)
+        log_frame_hitch(iteration_count + i, s_gpu_timer->begin_frame());
+    }
+
+    if (s_config.frame_histogram && s_frame_histogram.get_count() > 0)
+      report_frame_histogram(s_frame_histogram, s_hitch_count, "total");
+
+    if (s_config.gpu_memory)
+      std::cout << "gpu memory peak MB " << gpu_memory::get_usage().peak / (1024.0 * 1024.0) << '\n';
+  }
+
+  static void run_renderer()
+  {
+    glfwMakeContextCurrent(s_window);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+    rng::seed(s_config.seed, s_render_stream_id);
+
+    try
+    {
+      render();
+    }
+    catch (const render_error &)
+    {
+      // The message and the exit code are already set
+    }
+
+    release_resources();
+    glfwMakeContextCurrent(nullptr);
+
+    // Wake up the event thread, in case the rendering stopped by itself (end of the replay, errors)
+    glfwSetWindowShouldClose(s_window, GLFW_TRUE);
+    glfwPostEmptyEvent();
+  }
+
+  // Event thread only, with the render thread joined (or not started yet)
+  static void terminate(const int32_t exit_code)
+  {
     // Destroy window, OpenGL context and all the resources associated with it
     glfwTerminate();
     exit(exit_code);
   }
 
-  static void on_window_resize(GLFWwindow *, std::int32_t, std::int32_t) { resize(); }
+  // Event thread callbacks. If the queue is full the event is dropped, which is fine for input (the
+  // next one will do), and very unlikely for resizes, since the render thread empties the queue every frame
+  static void on_window_resize(GLFWwindow *, std::int32_t width, std::int32_t height)
+  {
+    s_window_events.push({.type = window_event::types::resize, .width = width, .height = height});
+  }
+
+  static void on_framebuffer_resize(GLFWwindow *, std::int32_t width, std::int32_t height)
+  {
+    s_window_events.push({.type = window_event::types::framebuffer_resize, .width = width, .height = height});
+  }
+
+  static void on_key(GLFWwindow *, std::int32_t key, std::int32_t, std::int32_t action, std::int32_t)
+  {
+    s_window_events.push({.type = window_event::types::key, .key = key, .value = action == GLFW_PRESS});
+  }
+
+  static void on_cursor_pos(GLFWwindow *, double x, double y)
+  {
+    s_window_events.push({.type = window_event::types::cursor, .x = static_cast<float>(x), .y = static_cast<float>(y)});
+  }
+
+#ifdef DEBUG
+  static void on_mouse_button(GLFWwindow *, std::int32_t button, std::int32_t action, std::int32_t)
+  {
+    s_window_events.push({.type = window_event::types::mouse_button, .key = button, .value = action == GLFW_PRESS});
+  }
+
+  static void on_scroll(GLFWwindow *, double x, double y)
+  {
+    s_window_events.push({.type = window_event::types::scroll, .x = static_cast<float>(x), .y = static_cast<float>(y)});
+  }
+#endif
 
-  static void on_key(GLFWwindow *, std::int32_t, std::int32_t, std::int32_t, std::int32_t)
+  static void on_window_iconify(GLFWwindow *, std::int32_t iconified)
   {
-    if (s_config.exit_on_input && clock_t::now() - s_start_time > s_exit_on_input_delay)
-      terminate(0);
+    s_window_events.push({.type = window_event::types::iconify, .value = iconified == GLFW_TRUE});
   }
 
-  static void on_cursor_pos(GLFWwindow *, double, double)
+  static void on_window_focus(GLFWwindow *, std::int32_t focused)
   {
-    // This event is fired immeditately even if the mouse doesn't move, so wait a little bit before actually considering it
-    if (s_config.exit_on_input && clock_t::now() - s_start_time > s_exit_on_input_delay)
-      terminate(0);
+    s_window_events.push({.type = window_event::types::focus, .value = focused == GLFW_TRUE});
   }
 
   void terminate_with_error(const std::string_view descr)
   {
+    if (s_render_thread.get_id() == std::this_thread::get_id())
+    {
+      s_render_error = descr;
+      s_exit_code = -1;
+      throw render_error{};
+    }
+
     std::cerr << descr << '\n';
     terminate(-1);
   }
@@ -650,11 +3233,86 @@ namespace mr
 
     s_config = config;
 
+    if (s_config.bench_glyphs)
+    {
+      auto candidates = get_rain_candidates();
+
+      // Printable ASCII if no glyphs are given
+      if (candidates.empty())
+        for (std::int32_t cp = 0x21; cp < 0x7f; ++cp)
+          candidates.push_back(cp);
+
+      // Loading uploads the glyphs, so it needs a context, of a window that's never shown
+      if (!glfwInit())
+        terminate_with_error("Could not initialize GLFW");
+
+      glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+      s_window = glfwCreateWindow(64, 64, "Ultimate Matrix Rain", nullptr, nullptr);
+      if (!s_window)
+        terminate_with_error("Could not create window");
+
+      glfwMakeContextCurrent(s_window);
+      gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+
+      if (s_config.rain_font_file.empty())
+      {
+        bench_glyph_loading(embed::s_font.data(), candidates);
+      }
+      else
+      {
+        const mapped_file file(s_config.rain_font_file);
+        if (!file.is_open())
+          terminate_with_error("Could not open font file");
+
+        bench_glyph_loading(file.data(), candidates);
+      }
+
+      glfwDestroyWindow(s_window);
+      glfwTerminate();
+      return;
+    }
+
+    // The replay decides the seed and the layout of the rain
+    if (!s_config.replay_file.empty())
+    {
+      s_replay_reader = std::make_unique<replay_reader>();
+      if (!s_replay_reader->load(s_config.replay_file, s_config))
+        terminate_with_error("Could not read replay file");
+    }
+
+    // Replays have the text itself, so they don't depend on the file anymore
+    if (s_config.intro_text.empty() && !s_config.intro_file.empty())
+    {
+      std::ifstream is(s_config.intro_file, std::ios::binary);
+      if (!is.is_open())
+        terminate_with_error("Could not read intro file");
+      s_config.intro_text.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
+
+    if ((!s_config.intro_text.empty() || !s_config.intro_file.empty()) && !load_terminal_messages(s_config.intro_text))
+      terminate_with_error("The intro file has no messages");
+
+    rng::seed(s_config.seed, s_main_stream_id);
+
+    if (!s_config.metrics_file.empty() || !s_config.control_socket.empty())
+    {
+      s_metrics = std::make_unique<metrics_exporter>(s_config.metrics_file, s_config.control_socket, s_config.metrics_interval, s_gpu_pass_names, s_control_settings);
+      if (!s_metrics->start())
+        terminate_with_error("Could not open the control socket");
+    }
+
     /* Initialize the library */
     if (!glfwInit())
       terminate_with_error("Could not initialize GLFW");
 
-    if (s_config.full_screen)
+    if (s_replay_reader)
+    {
+      // Same window size as the recording, if possible
+      const auto first = s_replay_reader->peek();
+      const bool has_size = first && first->type == replay_event::types::resize;
+      s_window = glfwCreateWindow(has_size ? first->width : 1280, has_size ? first->height : 768, "Ultimate Matrix Rain", nullptr, nullptr);
+    }
+    else if (s_config.full_screen)
     {
       const auto videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
       s_window = glfwCreateWindow(videoMode->width, videoMode->height, "Ultimate Matrix Rain", glfwGetPrimaryMonitor(), nullptr);
@@ -668,48 +3326,55 @@ namespace mr
     if (!s_window)
       terminate_with_error("Could not create window");
 
-    glfwMakeContextCurrent(s_window);
-    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
-
     glfwSetWindowSizeCallback(s_window, &on_window_resize);
+    glfwSetFramebufferSizeCallback(s_window, &on_framebuffer_resize);
     glfwSetCursorPosCallback(s_window, &on_cursor_pos);
     glfwSetKeyCallback(s_window, &on_key);
+    glfwSetWindowIconifyCallback(s_window, &on_window_iconify);
+    glfwSetWindowFocusCallback(s_window, &on_window_focus);
+#ifdef DEBUG
+    glfwSetMouseButtonCallback(s_window, &on_mouse_button);
+    glfwSetScrollCallback(s_window, &on_scroll);
+#endif
 
-    initialize();
-
-    s_start_time = clock_t::now();
-    auto prev_time = clock_t::now();
-    auto current_time = clock_t::now();
-
-    /* Loop until the user closes the window */
-    while (!glfwWindowShouldClose(s_window))
+    if (!s_config.record_file.empty())
     {
-      current_time = clock_t::now();
-      std::chrono::duration<float> delta = current_time - prev_time;
-      prev_time = current_time;
+      s_replay_writer = std::make_unique<replay_writer>(s_config.record_file, s_config);
+      if (!s_replay_writer->is_open())
+        terminate_with_error("Could not create replay file");
+    }
 
-      /* Render here */
-      // render(delta.count());
+    glfwGetWindowSize(s_window, &s_window_width, &s_window_height);
+    glfwGetFramebufferSize(s_window, &s_framebuffer_width, &s_framebuffer_height);
+    s_window_iconified = glfwGetWindowAttrib(s_window, GLFW_ICONIFIED) == GLFW_TRUE;
+    s_window_focused = glfwGetWindowAttrib(s_window, GLFW_FOCUSED) == GLFW_TRUE;
 
-      switch (s_scene)
+    // The render targets never need to grow past the biggest monitor
+    std::int32_t monitor_count = 0;
+    const auto monitors = glfwGetMonitors(&monitor_count);
+    for (std::int32_t i = 0; i < monitor_count; ++i)
+    {
+      if (const auto mode = glfwGetVideoMode(monitors[i]))
       {
-      case scenes::terminal:
-        render_terminal(delta.count());
-        break;
-      case scenes::code:
-        render_code(delta.count());
-        break;
+        s_max_render_width = std::max(s_max_render_width, mode->width);
+        s_max_render_height = std::max(s_max_render_height, mode->height);
       }
+    }
 
-      render_debug_gui();
+    s_start_time = clock_t::now();
+    s_render_thread = std::thread(&run_renderer);
 
-      /* Swap front and back buffers */
-      glfwSwapBuffers(s_window);
+    /* Loop until the user closes the window */
+    while (!glfwWindowShouldClose(s_window))
+      glfwWaitEvents();
 
-      /* Poll for and process events */
-      glfwPollEvents();
-    }
+    s_render_stop = true;
+    s_render_thread.join();
+    s_metrics = nullptr;
+
+    if (!s_render_error.empty())
+      std::cerr << s_render_error << '\n';
 
-    terminate(0);
+    terminate(s_exit_code);
   }
 }
\ No newline at end of file
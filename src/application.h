@@ -1,15 +1,119 @@
 #pragma once
 
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 
 namespace mr
 {
 
+  enum class idle_mode
+  {
+    run,      // Nothing changes
+    throttle, // Keep going at the idle frame rate
+    pause,    // Freeze the rain, and only redraw it at the idle frame rate
+    suspend   // Stop simulating and rendering altogether
+  };
+
   struct launch_config {
     bool full_screen = false;
     bool exit_on_input = false;
+
+    // Font used for the rain (the embedded one if empty), and the inclusive
+    // code point ranges its glyphs are picked from (letters and digits if empty)
+    std::string_view rain_font_file;
+    std::vector<std::pair<std::int32_t, std::int32_t>> rain_code_points;
+
+    // Messages typed in the intro, separated by empty lines (the default ones if empty). The text is read from the
+    // file at startup, or comes from the replay
+    std::string intro_file;
+    std::string intro_text;
+
+    // Measure the glyph rasterisation time and exit
+    bool bench_glyphs = false;
+
+    // Rain layout. Each depth layer has columns / depth columns, and density is the number of
+    // strings per column in every layer, so the string pool and the vertex buffers are sized from these
+    std::int32_t columns = 80;
+    float density = 1.5f;
+    std::vector<float> depth_layers = {0.15f, 0.30f, 0.50f, 1.00f};
+
+    // Place strings in random columns, even if they overlap with other strings (the old behaviour, to compare)
+    bool uniform_columns = false;
+
+    // Seed of every random number in the simulation, the same seed gives the same rain
+    std::uint32_t seed = 0;
+
+    // Record the seed, the rain layout and the timing of every frame to a file, or play back one of
+    // these files (the settings in the file win over the other options). When playing back, every
+    // frame can also be captured to "<capture_prefix><frame>.ppm", to compare runs image by image
+    std::string_view record_file;
+    std::string_view replay_file;
+    std::string_view capture_prefix;
+
+    // If not zero, the pool is sized to exactly this number of strings, the terminal scene is skipped, vsync
+    // is disabled (unless a swap interval is given) and the time spent in each stage is printed periodically
+    std::size_t stress_strings = 0;
+
+    // Fail if the frames keep allocating memory once the rain settled down (mostly for stress runs and replays)
+    bool alloc_check = false;
+
+    // Write the CPU and GPU time of every instrumented zone of these frames (inclusive) to a Chrome trace file. Only
+    // in builds with MR_PROFILE
+    std::string_view trace_file;
+    std::size_t trace_first_frame = 0;
+    std::size_t trace_last_frame = 299;
+
+    // Frame pacing. A negative swap interval leaves the driver default, and max_fps 0 means no cap. The CPU
+    // never gets more than frames_in_flight (1 to 3) frames ahead of the GPU: fewer is less latency, more
+    // is more throughput. frame_stats prints the frame rate and the latency periodically
+    std::int32_t swap_interval = -1;
+    float max_fps = 0.0f;
+    std::int32_t frames_in_flight = 2;
+    bool frame_stats = false;
+
+    // frame_histogram prints the percentiles of the frame times at exit, and every frame_histogram_interval seconds
+    // if not 0. Frames longer than hitch_ms (0 is off) are logged with the time spent in each phase and on each pass
+    bool frame_histogram = false;
+    float frame_histogram_interval = 0.0f;
+    float hitch_ms = 0.0f;
+
+    // Write the metrics in the Prometheus text format to metrics_file every metrics_interval seconds, and take commands
+    // on the control_socket (a Unix domain socket, Linux only)
+    std::string_view metrics_file;
+    float metrics_interval = 5.0f;
+    std::string_view control_socket;
+
+    // Show the performance overlay from the start (F3 toggles it)
+    bool hud = false;
+
+    // Show the overdraw heat map instead of the rain from the start (F4 toggles it)
+    bool overdraw = false;
+
+    // Print the GPU memory allocated by each part of the renderer when it changes (at the start, on resizes and on
+    // quality changes), and the peak at exit
+    bool gpu_memory = false;
+
+    // The render resolution, the bloom and the background layers are scaled down when the GPU time of a frame
+    // doesn't fit the budget of this frame rate, and back up when there's room again. 0 keeps the full quality
+    float target_fps = 60.0f;
+
+    // Quality tier, from 0 (the best). Negative picks one with a short benchmark during the intro, the first time the
+    // program runs on a GPU, and then reads it from a cache. recalibrate runs the benchmark again
+    std::int32_t tier = -1;
+    bool recalibrate = false;
+
+    // What to do while the window is iconified (and while it's not focused, with idle_unfocused). With
+    // catch_up, the rain fast-forwards through the time it was paused or suspended when the window comes back
+    idle_mode idle = idle_mode::throttle;
+    float idle_fps = 5.0f;
+    bool idle_unfocused = false;
+    bool catch_up = false;
   };
 
   void run(const launch_config& config); 
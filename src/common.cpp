@@ -1,24 +1,153 @@
 #include "common.h"
 
-#include <random>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <numeric>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 #include <GLFW/glfw3.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(MR_WINDOWS)
+#define NOMINMAX
+#include <Windows.h>
+#elif defined(MR_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "application.h"
-#include "font.h"
+#include "gpu_memory.h"
 
 namespace mr
 {
 
   namespace rng
   {
-    static std::mt19937 s_rng_engine;
-    static std::uniform_real_distribution<float> s_rng_dist(0.0f, 1.0f);
+#if defined(__SSE2__) || defined(_M_X64)
+    // There's no 32-bit multiplication in SSE2, so it's done with two 32x32->64 ones
+    static inline __m128i mullo_epi32(const __m128i a, const __m128i b)
+    {
+      const __m128i even = _mm_mul_epu32(a, b);
+      const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+      return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    static inline __m128i hash(__m128i x)
+    {
+      x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+      x = mullo_epi32(x, _mm_set1_epi32(0x7feb352d));
+      x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+      x = mullo_epi32(x, _mm_set1_epi32(static_cast<int>(0x846ca68bU)));
+      x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+      return x;
+    }
+
+    void stream::next(float *out, const std::size_t count)
+    {
+      const __m128i key4 = _mm_set1_epi32(static_cast<int>(key));
+      const __m128i golden4 = _mm_set1_epi32(static_cast<int>(0x9e3779b9U));
+      const __m128 scale4 = _mm_set1_ps(1.0f / 16777216.0f);
+
+      std::size_t i = 0;
+      for (; i + 4 <= count; i += 4, counter += 4)
+      {
+        const __m128i counter4 = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(counter)), _mm_setr_epi32(0, 1, 2, 3));
+        const __m128i bits = hash(_mm_add_epi32(key4, mullo_epi32(counter4, golden4)));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(bits, 8)), scale4));
+      }
+
+      for (; i < count; ++i)
+        out[i] = next();
+    }
+#else
+    void stream::next(float *out, const std::size_t count)
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        out[i] = next();
+    }
+#endif
+
+    static thread_local stream s_thread_stream;
+    static thread_local bool s_thread_seeded = false;
+
+    void seed(const std::uint32_t seed, const std::uint32_t id)
+    {
+      s_thread_stream = stream(seed, id);
+      s_thread_seeded = true;
+    }
+
+    float next()
+    {
+      assert(s_thread_seeded && "rng::seed must be called by the thread before rng::next");
+      return s_thread_stream.next();
+    }
+
+  }
+
+  void parallel_for(const std::size_t count, std::size_t threads, const std::function<void(std::size_t)> &f)
+  {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+
+    threads = std::min(threads, count);
 
-    float next() { return s_rng_dist(s_rng_engine); }
+    std::atomic<std::size_t> next = 0;
 
+    const auto worker = [&] {
+      for (auto i = next++; i < count; i = next++)
+        f(i);
+    };
+
+    // The calling thread does its share of the work too
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; ++i)
+      workers.emplace_back(worker);
+
+    worker();
+
+    for (auto &w : workers)
+      w.join();
+  }
+
+  std::u32string decode_utf8(const std::string_view text)
+  {
+    std::u32string result;
+    result.reserve(text.size());
+
+    for (std::size_t i = 0; i < text.size();)
+    {
+      const auto lead = static_cast<unsigned char>(text[i]);
+      const std::size_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+
+      char32_t cp = length == 1 ? lead : length == 2 ? lead & 0x1F : length == 3 ? lead & 0x0F : lead & 0x07;
+      bool valid = length > 0 && i + length <= text.size();
+
+      for (std::size_t j = 1; valid && j < length; ++j)
+      {
+        const auto c = static_cast<unsigned char>(text[i + j]);
+        valid = (c & 0xC0) == 0x80;
+        cp = (cp << 6) | (c & 0x3F);
+      }
+
+      static constexpr std::array<char32_t, 5> s_min_code_point = {0, 0, 0x80, 0x800, 0x10000};
+      if (valid && (cp < s_min_code_point[length] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)))
+        valid = false;
+
+      result.push_back(valid ? cp : U'\uFFFD');
+      i += valid ? length : 1;
+    }
+
+    return result;
   }
 
   static std::string inject_defines_into_source(const std::string_view source, const std::initializer_list<std::string_view> &defines)
@@ -103,6 +232,66 @@ namespace mr
     return program;
   }
 
+  bool render_extent::reserve(const std::int32_t w, const std::int32_t h, const std::int32_t max_w, const std::int32_t max_h)
+  {
+    if (contains(w, h))
+      return false;
+
+    // Next power of two, unless it goes past the limit (but it must fit anyway)
+    const auto grow = [](const std::int32_t capacity, const std::int32_t size, const std::int32_t limit) {
+      if (size <= capacity)
+        return capacity;
+      const auto pot = static_cast<std::int32_t>(std::bit_ceil(static_cast<std::uint32_t>(size)));
+      return limit > 0 ? std::max(size, std::min(pot, limit)) : pot;
+    };
+
+    capacity_width = grow(capacity_width, w, max_w);
+    capacity_height = grow(capacity_height, h, max_h);
+    return true;
+  }
+
+  void render_extent::set_size(const std::int32_t w, const std::int32_t h)
+  {
+    width = std::clamp(w, 1, std::max(capacity_width, 1));
+    height = std::clamp(h, 1, std::max(capacity_height, 1));
+  }
+
+  render_extent render_extent::scaled_down(const std::int32_t divisor) const
+  {
+    return {
+        .width = std::max(width / divisor, 1),
+        .height = std::max(height / divisor, 1),
+        .capacity_width = std::max(capacity_width / divisor, 1),
+        .capacity_height = std::max(capacity_height / divisor, 1),
+    };
+  }
+
+  pixel_rect pixel_rect::scaled(const float sx, const float sy) const
+  {
+    const auto x0 = static_cast<std::int32_t>(std::floor(x * sx)), y0 = static_cast<std::int32_t>(std::floor(y * sy));
+    const auto x1 = static_cast<std::int32_t>(std::ceil((x + width) * sx)), y1 = static_cast<std::int32_t>(std::ceil((y + height) * sy));
+    return {x0, y0, x1 - x0, y1 - y0};
+  }
+
+  pixel_rect pixel_rect::grown(const std::int32_t amount) const
+  {
+    return {x - amount, y - amount, width + amount * 2, height + amount * 2};
+  }
+
+  pixel_rect pixel_rect::merged(const pixel_rect &other) const
+  {
+    const auto x0 = std::min(x, other.x), y0 = std::min(y, other.y);
+    const auto x1 = std::max(x + width, other.x + other.width), y1 = std::max(y + height, other.y + other.height);
+    return {x0, y0, x1 - x0, y1 - y0};
+  }
+
+  pixel_rect pixel_rect::clamped(const std::int32_t max_width, const std::int32_t max_height) const
+  {
+    const auto x0 = std::clamp(x, 0, max_width), y0 = std::clamp(y, 0, max_height);
+    const auto x1 = std::clamp(x + width, 0, max_width), y1 = std::clamp(y + height, 0, max_height);
+    return {x0, y0, x1 - x0, y1 - y0};
+  }
+
   std::tuple<GLuint, GLuint> create_full_screen_quad()
   {
     static constexpr std::array<vec2f, 6> s_full_screen_quad = {
@@ -122,7 +311,7 @@ namespace mr
     glBindVertexArray(va);
     glBindBuffer(GL_ARRAY_BUFFER, vb);
 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec2f) * s_full_screen_quad.size(), s_full_screen_quad.data(), GL_STATIC_DRAW);
+    gpu_memory::buffer_data(gpu_memory::owners::vertex_stream, vb, GL_ARRAY_BUFFER, sizeof(vec2f) * s_full_screen_quad.size(), s_full_screen_quad.data(), GL_STATIC_DRAW);
 
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(vec2f), 0);
@@ -130,51 +319,279 @@ namespace mr
     return {va, vb};
   }
 
-  void character_cell::set(const glyph &g, const vec4f &c, const vec2f &pos, const float size)
-  {
-    // Same color for every vertex, easy
-    for (auto &v : vertices)
-      v.color = c;
-
-    // Uv coming directly from the glyph
-    vertices[0].uv = {g.uv0[0], g.uv1[1]};
-    vertices[1].uv = {g.uv0[0], g.uv0[1]};
-    vertices[2].uv = {g.uv1[0], g.uv1[1]};
-    vertices[3].uv = {g.uv0[0], g.uv0[1]};
-    vertices[4].uv = {g.uv1[0], g.uv0[1]};
-    vertices[5].uv = {g.uv1[0], g.uv1[1]};
-
-    /* This works as follows:
-      - The given position "pos" is supposed to be in view coordinates
-      - The cell is square of size "size", but the glyph is not a square, so this 
-        is where the glyph's properties come useful:
-        - norm_offset is the offset from glyph origin
-        - norm_size is the actual size of the glyph
-        These properties are normalized in [0, 1] so we can easily scale them by the cell size
-    */
-    const float fx = pos[0] + g.norm_offset[0] * size;
-    const float fy = pos[1] + g.norm_offset[1] * size;
-    const float nwidth = g.norm_size[0] * size;
-    const float nheight = g.norm_size[1] * size;
-
-    vertices[0].position = {fx, fy};
-    vertices[1].position = {fx, fy + nheight};
-    vertices[2].position = {fx + nwidth, fy};
-    vertices[3].position = {fx, fy + nheight};
-    vertices[4].position = {fx + nwidth, fy + nheight};
-    vertices[5].position = {fx + nwidth, fy};
+#if defined(MR_WINDOWS)
+  mapped_file::mapped_file(const std::string_view file_name)
+  {
+    m_file = CreateFileA(std::string(file_name).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+      m_file = nullptr;
+      return;
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(m_file, &size);
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+    {
+      m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+      m_size = m_data ? static_cast<std::size_t>(size.QuadPart) : 0;
+    }
+  }
+
+  mapped_file::~mapped_file()
+  {
+    if (m_data)
+      UnmapViewOfFile(m_data);
+    if (m_mapping)
+      CloseHandle(m_mapping);
+    if (m_file)
+      CloseHandle(m_file);
+  }
+#elif defined(MR_LINUX)
+  mapped_file::mapped_file(const std::string_view file_name)
+  {
+    const int fd = open(std::string(file_name).c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        m_data = static_cast<const unsigned char *>(data);
+        m_size = static_cast<std::size_t>(st.st_size);
+      }
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+  }
+
+  mapped_file::~mapped_file()
+  {
+    if (m_data)
+      munmap(const_cast<unsigned char *>(m_data), m_size);
+  }
+#endif
+
+  timing_wheel::timing_wheel(const std::size_t bucket_count, const double tick) : m_buckets(bucket_count), m_tick(tick) {}
+
+  void timing_wheel::schedule(const std::uint32_t id, const double time)
+  {
+    // Things scheduled in the past are due at the next advance
+    const auto tick = std::max(get_tick(time), m_current);
+    m_buckets[tick % m_buckets.size()].push_back({id, time});
+    m_size++;
+  }
+
+  void timing_wheel::advance(const double time, const std::function<void(std::uint32_t, double)> &f)
+  {
+    const auto bucket_count = static_cast<std::int64_t>(m_buckets.size());
+    const auto target = get_tick(time);
+
+    // After a long pause, going around once is enough to see every bucket
+    for (auto tick = std::max(m_current, target - bucket_count + 1); tick <= target; ++tick)
+    {
+      auto &bucket = m_buckets[tick % bucket_count];
+      for (std::size_t i = 0; i < bucket.size();)
+      {
+        if (bucket[i].time > time)
+        {
+          ++i;
+          continue;
+        }
+
+        const auto e = bucket[i];
+        bucket[i] = bucket.back();
+        bucket.pop_back();
+        m_size--;
+
+        f(e.id, e.time);
+      }
+    }
+
+    m_current = std::max(m_current, target);
+  }
+
+  void timing_wheel::clear(const double time)
+  {
+    for (auto &bucket : m_buckets)
+      bucket.clear();
+
+    m_size = 0;
+    m_current = get_tick(time);
+  }
+
+  void timing_wheel::reserve(const std::size_t count)
+  {
+    const auto per_bucket = count / m_buckets.size() * 4 + 16;
+    for (auto &bucket : m_buckets)
+      bucket.reserve(per_bucket);
+  }
+
+  frame_counters &get_frame_counters()
+  {
+    static frame_counters counters;
+    return counters;
+  }
+
+  gpu_timer::gpu_timer(const std::size_t pass_count) : m_times(pass_count, 0.0), m_samples(pass_count, 0) {}
+
+  gpu_timer::~gpu_timer()
+  {
+    for (auto &f : m_frames)
+    {
+      if (f.queries.size() > 0)
+      {
+        glDeleteQueries(f.queries.size(), f.queries.data());
+        glDeleteQueries(f.sample_queries.size(), f.sample_queries.data());
+      }
+    }
+  }
+
+  bool gpu_timer::begin_frame()
+  {
+    m_current = (m_current + 1) % m_frames.size();
+    auto &f = m_frames[m_current];
+
+    if (f.used == 0)
+      return false;
+
+    // Usually done long ago, but without vsync the driver can queue more frames than s_frame_lag. Then the frame is
+    // dropped rather than waited for, and the previous times are kept. Queries finish in order, so checking the last
+    // ones is enough
+    GLuint time_available = GL_FALSE, samples_available = GL_FALSE;
+    glGetQueryObjectuiv(f.queries[f.used - 1], GL_QUERY_RESULT_AVAILABLE, &time_available);
+    glGetQueryObjectuiv(f.sample_queries[f.used - 1], GL_QUERY_RESULT_AVAILABLE, &samples_available);
+
+    if (time_available == GL_FALSE || samples_available == GL_FALSE)
+    {
+      f.used = 0;
+      return false;
+    }
+
+    std::ranges::fill(m_times, 0.0);
+    std::ranges::fill(m_samples, 0);
+    for (std::size_t i = 0; i < f.used; ++i)
+    {
+      GLuint64 ns = 0, samples = 0;
+      glGetQueryObjectui64v(f.queries[i], GL_QUERY_RESULT, &ns);
+      glGetQueryObjectui64v(f.sample_queries[i], GL_QUERY_RESULT, &samples);
+      m_times[f.passes[i]] += ns / 1e6;
+      m_samples[f.passes[i]] += samples;
+    }
+
+    f.used = 0;
+    return true;
+  }
+
+  void gpu_timer::begin(const std::size_t pass)
+  {
+    auto &f = m_frames[m_current];
+
+    // Every frame grows at once, otherwise a frame with more passes than usual could allocate long after the others
+    // reached their size
+    if (f.used == f.queries.size())
+    {
+      for (auto &other : m_frames)
+      {
+        other.queries.push_back(0);
+        other.sample_queries.push_back(0);
+        other.passes.push_back(0);
+        glGenQueries(1, &other.queries.back());
+        glGenQueries(1, &other.sample_queries.back());
+      }
+    }
+
+    f.passes[f.used] = pass;
+    glBeginQuery(GL_TIME_ELAPSED, f.queries[f.used]);
+    glBeginQuery(GL_SAMPLES_PASSED, f.sample_queries[f.used]);
+  }
+
+  void gpu_timer::end()
+  {
+    glEndQuery(GL_SAMPLES_PASSED);
+    glEndQuery(GL_TIME_ELAPSED);
+    m_frames[m_current].used++;
+  }
+
+  double gpu_timer::get_total_time() const
+  {
+    return std::accumulate(m_times.begin(), m_times.end(), 0.0);
+  }
+
+  std::uint64_t gpu_timer::get_total_samples() const
+  {
+    return std::accumulate(m_samples.begin(), m_samples.end(), std::uint64_t(0));
+  }
+
+  std::size_t duration_histogram::get_index(const std::uint64_t value)
+  {
+    // The power of two past the exact range picks the bucket, the next bits the sub-bucket
+    const auto shift = static_cast<std::size_t>(std::max<std::int32_t>(static_cast<std::int32_t>(std::bit_width(value)) - static_cast<std::int32_t>(s_sub_bucket_bits), 0));
+    return (shift << (s_sub_bucket_bits - 1)) + (value >> shift);
+  }
+
+  std::uint64_t duration_histogram::get_highest_value(const std::size_t index)
+  {
+    if (index < 2 * s_half_sub_buckets)
+      return index;
+
+    const auto shift = index / s_half_sub_buckets - 1;
+    const auto sub_bucket = index - shift * s_half_sub_buckets;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+  void duration_histogram::record(const std::chrono::nanoseconds d)
+  {
+    const auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count(), 0));
+    const auto value = std::min<std::uint64_t>(us, (std::uint64_t(1) << s_max_value_bits) - 1);
+
+    m_counts[get_index(value)]++;
+    m_count++;
+    m_total += value;
+    m_max = std::max(m_max, value);
+  }
+
+  double duration_histogram::get_percentile(const double percentile) const
+  {
+    if (m_count == 0)
+      return 0.0;
+
+    const auto target = std::max<std::uint64_t>(static_cast<std::uint64_t>(std::ceil(percentile / 100.0 * m_count)), 1);
+
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < m_counts.size(); ++i)
+    {
+      count += m_counts[i];
+      if (count >= target)
+        return std::min(get_highest_value(i), m_max) / 1e3;
+    }
+
+    return get_max();
   }
 
   enable_scope::enable_scope(const std::initializer_list<GLenum> &bits)
   {
+    // Any bit past the storage would be left changed when the scope ends
+    assert(bits.size() <= s_max_bits && "enable_scope: too many bits, raise s_max_bits");
+
     for (const auto bit : bits)
-      m_bits[bit] = glIsEnabled(bit) == GL_TRUE;
+    {
+      if (m_count == s_max_bits)
+        break;
+      m_bits[m_count++] = {bit, glIsEnabled(bit) == GL_TRUE};
+    }
   }
 
   enable_scope::~enable_scope()
   {
-    for (const auto &[bit, enabled] : m_bits)
-      enabled ? glEnable(bit) : glDisable(bit);
+    for (std::size_t i = 0; i < m_count; ++i)
+      m_bits[i].second ? glEnable(m_bits[i].first) : glDisable(m_bits[i].first);
   }
 
 }
\ No newline at end of file
@@ -3,11 +3,17 @@
 #include <algorithm>
 #include <cmath>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <string>
 #include <string_view>
 #include <concepts>
 #include <array>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
 #include <glad/glad.h>
 
@@ -16,6 +22,55 @@ namespace mr
 
   namespace rng
   {
+    // 32-bit integer hash (lowbias32 by Chris Wellons). It's the building block of the counter based
+    // generator below, and it only needs 32-bit integer math, so it can be evaluated in GLSL as
+    // well (see embed::s_glsl_rng)
+    constexpr std::uint32_t hash(std::uint32_t x)
+    {
+      x ^= x >> 16;
+      x *= 0x7feb352dU;
+      x ^= x >> 15;
+      x *= 0x846ca68bU;
+      x ^= x >> 16;
+      return x;
+    }
+
+    constexpr std::uint32_t hash(const std::uint32_t x, const std::uint32_t y) { return hash(x ^ hash(y)); }
+
+    // Maps 32 random bits to [0, 1)
+    constexpr float to_float(const std::uint32_t x) { return static_cast<float>(x >> 8) * (1.0f / 16777216.0f); }
+
+    // Counter based generator: the n-th number of a stream only depends on the stream key and on n, so
+    // streams don't share any state. They are safe to use from any thread, and they give the same
+    // numbers no matter the order in which they are evaluated
+    struct stream
+    {
+      std::uint32_t key = 0;
+      std::uint32_t counter = 0;
+
+      stream() = default;
+      constexpr stream(const std::uint32_t seed, const std::uint32_t id, const std::uint32_t generation = 0)
+          : key(hash(seed, hash(id, generation))) {}
+
+      // SplitMix-like: the counter is spread with the golden ratio, then hashed with the key
+      constexpr std::uint32_t next_u32() { return hash(key + (counter++) * 0x9e3779b9U); }
+      constexpr float next() { return to_float(next_u32()); }
+
+      template <typename T>
+      requires std::floating_point<T> || std::integral<T>
+      constexpr T next(const T min, const T max)
+      {
+        return min + static_cast<T>((max - min) * next());
+      }
+
+      // Fills "out" with the next "count" numbers in [0, 1), 4 at a time with SIMD when available.
+      // Same results as calling next() "count" times
+      void next(float *out, const std::size_t count);
+    };
+
+    // Global stream, one per thread. A thread seeds its own stream, with an id of its own, before using it,
+    // so the numbers it gets only depend on the seed and on that id, not on which thread started first
+    void seed(const std::uint32_t seed, const std::uint32_t id);
     float next();
 
     template<typename T> 
@@ -27,7 +82,12 @@ namespace mr
 
   }
 
-  struct glyph;
+  // Runs f(i) for every i in [0, count) on the given number of threads (0 means one per core). Indices
+  // are handed out one at a time, so uneven work is balanced between the threads
+  void parallel_for(const std::size_t count, std::size_t threads, const std::function<void(std::size_t)> &f);
+
+  // UTF-8 to code points. Malformed sequences (and overlong ones, and surrogates) become U+FFFD, one per byte
+  std::u32string decode_utf8(const std::string_view text);
 
   // Generic vector type, just testing some C++20 concepts
   template <std::size_t N, typename T>
@@ -95,38 +155,302 @@ namespace mr
   using vec3f = vec<3, float>;
   using vec4f = vec<4, float>;
 
-  struct vertex
+  // A character cell is a single instance of a quad (2 triangles, 6 vertices). The glyph geometry is looked up
+  // in the vertex shader, so the cell itself is just a position in view coordinates, a size, a glyph and a color.
+  // The glyph is either an atlas slot, or an index in the font palette (depending on the program)
+  struct character_cell
   {
     vec2f position;
-    vec2f uv;
+    float size;
+    std::int32_t glyph;
     vec4f color;
   };
 
-  // A character cell is basically a quad(2 triangles, 6 vertices) with a glyph and some helper functions
-  struct character_cell
+  // Size of a set of render targets that only grow. Textures are allocated with a power of two size (but not bigger
+  // than a limit, usually the monitor size), and only the top left corner is rendered to, so resizing the window
+  // almost never reallocates anything. Full screen passes scale their uvs with get_uv_scale() to sample that corner,
+  // and clamp them to get_uv_max() so that linear filtering and filter taps don't pick up what's outside of it
+  struct render_extent
   {
-    std::array<vertex, 6> vertices;
-    vertex &operator[](const size_t i) { return vertices[i]; }
-    const vertex &operator[](const size_t i) const { return vertices[i]; }
+    std::int32_t width = 0, height = 0;                   // Area being rendered to
+    std::int32_t capacity_width = 0, capacity_height = 0; // Allocated size
+
+    // Grows the capacity so that the given size fits. Returns true if it changed, and the textures must be reallocated
+    bool reserve(const std::int32_t w, const std::int32_t h, const std::int32_t max_w, const std::int32_t max_h);
 
-    // Range functions for "for" loops
-    auto begin() { return vertices.begin(); }
-    auto end() { return vertices.end(); }
+    // Sets the area being rendered to, clamped to the capacity
+    void set_size(const std::int32_t w, const std::int32_t h);
 
-    // Updates this character with the given parameters
-    void set(const glyph& g, const vec4f& color, const vec2f& pos, const float size);
+    bool contains(const std::int32_t w, const std::int32_t h) const { return w <= capacity_width && h <= capacity_height; }
+    vec2f get_uv_scale() const { return {float(width) / capacity_width, float(height) / capacity_height}; }
+    vec2f get_uv_max() const { return {(width - 0.5f) / capacity_width, (height - 0.5f) / capacity_height}; }
 
+    // Same extent with both sizes divided by the given amount (for downscaled targets)
+    render_extent scaled_down(const std::int32_t divisor) const;
+  };
+
+  // Area of a render target, in pixels from the bottom left corner
+  struct pixel_rect
+  {
+    std::int32_t x = 0, y = 0, width = 0, height = 0;
+
+    // Scaled and grown rects are rounded outwards, so they still cover the same pixels
+    pixel_rect scaled(const float sx, const float sy) const;
+    pixel_rect grown(const std::int32_t amount) const;
+    pixel_rect merged(const pixel_rect &other) const;
+    pixel_rect clamped(const std::int32_t max_width, const std::int32_t max_height) const;
   };
 
   std::tuple<GLuint, GLuint> create_full_screen_quad();
   GLuint load_program(const std::string_view vs_source, const std::string_view fs_source, const std::initializer_list<std::string_view> &defines = {});
 
+  // Read-only memory mapping of a whole file, so big font files are paged in by the OS on demand
+  // instead of being copied into memory
+  class mapped_file
+  {
+  private:
+    const unsigned char *m_data = nullptr;
+    std::size_t m_size = 0;
+#ifdef MR_WINDOWS
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+  public:
+    mapped_file(const std::string_view file_name);
+    ~mapped_file();
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool is_open() const { return m_data != nullptr; }
+    const unsigned char *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+  };
+
+  // Hashed timing wheel: ids are scheduled at a given time, and handed back once the time has passed. Each bucket
+  // covers a tick, and entries more than a whole turn in the future just stay in their bucket until their turn
+  // comes, so scheduling and expiring are O(1), and nothing is touched until it's due
+  class timing_wheel
+  {
+  private:
+    struct entry
+    {
+      std::uint32_t id;
+      double time;
+    };
+
+    std::vector<std::vector<entry>> m_buckets;
+    double m_tick;
+    std::int64_t m_current = 0;
+    std::size_t m_size = 0;
+
+    std::int64_t get_tick(const double time) const { return static_cast<std::int64_t>(std::floor(time / m_tick)); }
+
+  public:
+    timing_wheel(const std::size_t bucket_count, const double tick);
+
+    void schedule(const std::uint32_t id, const double time);
+
+    // Calls f(id, scheduled_time) for every id scheduled at or before the given time, in no particular order
+    void advance(const double time, const std::function<void(std::uint32_t, double)> &f);
+
+    void clear(const double time);
+    std::size_t size() const { return m_size; }
+
+    // Makes room for the given number of entries, so scheduling doesn't allocate. Entries are not spread evenly over
+    // the buckets, so each one gets a few times its share
+    void reserve(const std::size_t count);
+  };
+
+  // Lock-free handoff of values from one producer thread to one consumer thread. The producer writes to the back
+  // buffer while the consumer reads the front one, and they swap them through the middle buffer with a single
+  // atomic exchange, so neither ever waits for the other on the hot path
+  template <typename T>
+  class triple_buffer
+  {
+  private:
+    static constexpr std::uint32_t s_index_mask = 3;
+    static constexpr std::uint32_t s_fresh = 4; // The middle buffer holds a value the consumer hasn't seen yet
+
+    std::array<T, 3> m_buffers;
+    std::atomic<std::uint32_t> m_middle = 1;
+    std::uint32_t m_back = 0;  // Producer only
+    std::uint32_t m_front = 2; // Consumer only
+
+  public:
+    T &back() { return m_buffers[m_back]; }
+    const T &front() const { return m_buffers[m_front]; }
+
+    // Producer: hands the back buffer to the consumer, and takes the middle one as the new back buffer
+    void publish()
+    {
+      m_back = m_middle.exchange(m_back | s_fresh, std::memory_order_acq_rel) & s_index_mask;
+      m_middle.notify_all();
+    }
+
+    // Consumer: if a new value was published, makes it the front buffer and returns true
+    bool consume()
+    {
+      if (!(m_middle.load(std::memory_order_acquire) & s_fresh))
+        return false;
+
+      m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & s_index_mask;
+      m_middle.notify_all();
+      return true;
+    }
+
+    // Consumer: blocks until a new value is published
+    void wait_published() const
+    {
+      for (auto middle = m_middle.load(std::memory_order_acquire); !(middle & s_fresh); middle = m_middle.load(std::memory_order_acquire))
+        m_middle.wait(middle, std::memory_order_acquire);
+    }
+
+    // Producer: blocks until the last published value is consumed, or until stop becomes true (and
+    // the consumer touches the buffer, for instance with consume()). Returns false if stopped
+    bool wait_consumed(const std::atomic<bool> &stop) const
+    {
+      for (auto middle = m_middle.load(std::memory_order_acquire); middle & s_fresh; middle = m_middle.load(std::memory_order_acquire))
+      {
+        if (stop.load(std::memory_order_acquire))
+          return false;
+        m_middle.wait(middle, std::memory_order_acquire);
+      }
+
+      return !stop.load(std::memory_order_acquire);
+    }
+  };
+
+  // Lock-free queue with a fixed capacity (a power of two), from one producer thread to one consumer thread
+  template <typename T, std::size_t N>
+  requires(N > 0 && (N & (N - 1)) == 0) class spsc_queue
+  {
+  private:
+    std::array<T, N> m_items;
+    alignas(64) std::atomic<std::size_t> m_head = 0; // Next item to pop, only written by the consumer
+    alignas(64) std::atomic<std::size_t> m_tail = 0; // Next item to push, only written by the producer
+
+  public:
+    // Returns false if the queue is full
+    bool push(const T &item)
+    {
+      const auto tail = m_tail.load(std::memory_order_relaxed);
+      if (tail - m_head.load(std::memory_order_acquire) == N)
+        return false;
+
+      m_items[tail % N] = item;
+      m_tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T &item)
+    {
+      const auto head = m_head.load(std::memory_order_relaxed);
+      if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+
+      item = m_items[head % N];
+      m_head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+  };
+
+  // Work the current frame sent to the GPU, shown by the performance overlay. Reset at the start of every frame, and
+  // only touched by the render thread
+  struct frame_counters
+  {
+    std::size_t draw_calls = 0;
+    std::size_t cells = 0;
+    std::size_t upload_bytes = 0;
+  };
+
+  frame_counters &get_frame_counters();
+
+  // Measures the GPU time of the passes of a frame with GL_TIME_ELAPSED queries, and the fragments they shaded with
+  // GL_SAMPLES_PASSED ones. A pass can be measured more than once per frame (the times add up), but passes can't be
+  // nested. The results are read s_frame_lag frames later, when the GPU is usually done with them. Results that aren't
+  // there yet are dropped, reading them never waits
+  class gpu_timer
+  {
+  public:
+    static constexpr std::size_t s_frame_lag = 4;
+
+  private:
+    struct frame_queries
+    {
+      std::vector<GLuint> queries; // Only grows, so after the first frames no query is created anymore
+      std::vector<GLuint> sample_queries;
+      std::vector<std::size_t> passes;
+      std::size_t used = 0;
+    };
+
+    std::array<frame_queries, s_frame_lag> m_frames;
+    std::size_t m_current = 0;
+    std::vector<double> m_times; // Milliseconds
+    std::vector<std::uint64_t> m_samples;
+
+  public:
+    explicit gpu_timer(const std::size_t pass_count);
+    ~gpu_timer();
+
+    gpu_timer(const gpu_timer &) = delete;
+    gpu_timer &operator=(const gpu_timer &) = delete;
+
+    // Starts a new frame, collecting the times of the oldest one. Returns true if there are new times, false if that
+    // frame had no passes or its results weren't ready (the previous times are kept)
+    bool begin_frame();
+
+    void begin(const std::size_t pass);
+    void end();
+
+    // Times of the frame s_frame_lag frames ago
+    double get_time(const std::size_t pass) const { return m_times[pass]; }
+    double get_total_time() const;
+    std::uint64_t get_samples(const std::size_t pass) const { return m_samples[pass]; }
+    std::uint64_t get_total_samples() const;
+  };
+
+  // Histogram of durations with a bounded relative error, the way HdrHistogram does it: values are counted exactly up
+  // to 128 us, and past that in 64 buckets per power of two, so a value is never off by more than 1/64. The buckets
+  // are a fixed array (up to 2^32 us, longer values are clamped), so recording never allocates
+  class duration_histogram
+  {
+  private:
+    static constexpr std::size_t s_sub_bucket_bits = 7;
+    static constexpr std::size_t s_half_sub_buckets = std::size_t(1) << (s_sub_bucket_bits - 1);
+    static constexpr std::size_t s_max_value_bits = 32;
+
+    std::array<std::uint64_t, (s_max_value_bits - s_sub_bucket_bits + 2) * s_half_sub_buckets> m_counts{};
+    std::uint64_t m_count = 0;
+    std::uint64_t m_total = 0; // us
+    std::uint64_t m_max = 0;
+
+    static std::size_t get_index(const std::uint64_t value);
+    static std::uint64_t get_highest_value(const std::size_t index);
+
+  public:
+    void record(const std::chrono::nanoseconds d);
+    void clear() { *this = {}; }
+
+    std::uint64_t get_count() const { return m_count; }
+
+    // Milliseconds. A percentile is the highest value that falls in the same bucket, like in HdrHistogram
+    double get_percentile(const double percentile) const;
+    double get_mean() const { return m_count > 0 ? m_total / 1e3 / m_count : 0.0; }
+    double get_max() const { return m_max / 1e3; }
+  };
+
   // Helper class for stacking OpenGL enable bits. Things like glPush** are not in core anymore, so
   // this is kind of useful when there are a lot of render passes
   class enable_scope
   {
   private:
-    std::unordered_map<GLenum, bool> m_bits; // TODO: Could be a vector/array of pairs
+    // Fixed storage, since scopes are opened every frame and must not allocate. Asking for more bits asserts
+    static constexpr std::size_t s_max_bits = 4;
+    std::array<std::pair<GLenum, bool>, s_max_bits> m_bits;
+    std::size_t m_count = 0;
+
   public:
     enable_scope(const std::initializer_list<GLenum> &bits);
     ~enable_scope();
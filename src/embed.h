@@ -9,11 +9,52 @@
 namespace mr::embed
 {
 
+  // GLSL version of the counter based generator in rng (common.h), it gives exactly the same numbers
+  // as rng::stream. Meant to be pasted in front of the shaders that need it, after the #version line
+  constexpr std::string_view s_glsl_rng = R"(
+    uint rngHash(uint x) {
+      x ^= x >> 16u;
+      x *= 0x7feb352du;
+      x ^= x >> 15u;
+      x *= 0x846ca68bu;
+      x ^= x >> 16u;
+      return x;
+    }
+
+    uint rngHash(uint x, uint y) { return rngHash(x ^ rngHash(y)); }
+
+    uint rngKey(uint seed, uint id, uint generation) { return rngHash(seed, rngHash(id, generation)); }
+
+    uint rngNextU32(uint key, uint counter) { return rngHash(key + counter * 0x9e3779b9u); }
+
+    float rngNext(uint key, uint counter) {
+      return float(rngNextU32(key, counter) >> 8u) * (1.0 / 16777216.0);
+    }
+  )";
+
+  // Writes the numbers of a stream, one per pixel of a row, to check s_glsl_rng against rng::stream
+  constexpr std::string_view s_fs_rng_check = R"(
+    #version 330
+
+    uniform uint uSeed;
+    uniform uint uId;
+    uniform uint uGeneration;
+
+    out uvec4 oValue;
+
+    void main() {
+      uint key = rngKey(uSeed, uId, uGeneration);
+      uint counter = uint(gl_FragCoord.x);
+      oValue = uvec4(rngNextU32(key, counter), floatBitsToUint(rngNext(key, counter)), 0u, 0u);
+    }
+  )";
+
   constexpr std::string_view s_fs_blur = R"(
     #version 330
 
     uniform sampler2D uTexture;
     uniform float uStrength;
+    uniform vec2 uUvMax;
 
     smooth in vec2 fUv;
 
@@ -29,15 +70,15 @@ namespace mr::embed
 
       for(int i = 0; i < 3; ++i) {
         #if defined(HORIZONTAL)
-          color += texture(uTexture, fUv + vec2(i - 1, 0.0) * step).rgb * KERNEL[i]; 
+          color += texture(uTexture, min(fUv + vec2(i - 1, 0.0) * step, uUvMax)).rgb * KERNEL[i]; 
         #elif defined(VERTICAL)
-          color += texture(uTexture, fUv + vec2(0.0, i - 1) * step).rgb * KERNEL[i]; 
+          color += texture(uTexture, min(fUv + vec2(0.0, i - 1) * step, uUvMax)).rgb * KERNEL[i]; 
         #else 
           #error "You bad person"
         #endif
       }
 
-      vec3 weigthedColor = mix(texture(uTexture, fUv).rgb, color, uStrength);
+      vec3 weigthedColor = mix(texture(uTexture, min(fUv, uUvMax)).rgb, color, uStrength);
 
       oColor = vec4(weigthedColor, 1.0);
 
@@ -50,13 +91,14 @@ namespace mr::embed
     uniform sampler2D uSource;
     uniform float uThreshold;
     uniform float uKnee;
+    uniform vec2 uUvMax;
 
     in vec2 fUv;
 
     out vec4 oColor;
 
     void main() {
-        vec3 color = texture(uSource, fUv).rgb;
+        vec3 color = texture(uSource, min(fUv, uUvMax)).rgb;
         float luma = dot(vec3(0.299, 0.587, 0.114), color);
         oColor = vec4(smoothstep(uThreshold - uKnee, uThreshold + uKnee, luma) * color,  1.0);
     }
@@ -66,6 +108,7 @@ namespace mr::embed
     #version 330 core
 
     uniform sampler2D uSource;
+    uniform vec2 uUvMax;
 
     in vec2 fUv;
 
@@ -74,10 +117,10 @@ namespace mr::embed
     void main() {
         vec2 s = 1.0 / vec2(textureSize(uSource, 0));
 
-        vec3 tl = texture(uSource, fUv + vec2(-s.x, +s.y)).rgb;
-        vec3 tr = texture(uSource, fUv + vec2(+s.x, +s.y)).rgb;
-        vec3 bl = texture(uSource, fUv + vec2(-s.x, -s.y)).rgb;
-        vec3 br = texture(uSource, fUv + vec2(+s.x, -s.y)).rgb;
+        vec3 tl = texture(uSource, min(fUv + vec2(-s.x, +s.y), uUvMax)).rgb;
+        vec3 tr = texture(uSource, min(fUv + vec2(+s.x, +s.y), uUvMax)).rgb;
+        vec3 bl = texture(uSource, min(fUv + vec2(-s.x, -s.y), uUvMax)).rgb;
+        vec3 br = texture(uSource, min(fUv + vec2(+s.x, -s.y), uUvMax)).rgb;
 
         oColor = vec4((tl + tr + bl + br) / 4.0,  1.0);
     }
@@ -88,6 +131,8 @@ namespace mr::embed
 
     uniform sampler2D uPrevious;
     uniform sampler2D uDownsample;
+    uniform vec2 uUvMax;
+    uniform vec2 uPreviousUvMax;
 
     in vec2 fUv;
 
@@ -98,17 +143,17 @@ namespace mr::embed
 
         vec3 upsampleColor = vec3(0.0);
 
-        upsampleColor += 1.0 * texture(uDownsample, fUv + vec2(-s.x, +s.y)).rgb;
-        upsampleColor += 2.0 * texture(uDownsample, fUv + vec2(+0.0, +s.y)).rgb;
-        upsampleColor += 1.0 * texture(uDownsample, fUv + vec2(+s.x, +s.y)).rgb;
-        upsampleColor += 2.0 * texture(uDownsample, fUv + vec2(-s.x, +0.0)).rgb;
-        upsampleColor += 4.0 * texture(uDownsample, fUv + vec2(+0.0, +0.0)).rgb;
-        upsampleColor += 2.0 * texture(uDownsample, fUv + vec2(+s.x, +0.0)).rgb;
-        upsampleColor += 1.0 * texture(uDownsample, fUv + vec2(-s.x, -s.y)).rgb;
-        upsampleColor += 2.0 * texture(uDownsample, fUv + vec2(+0.0, -s.y)).rgb;
-        upsampleColor += 1.0 * texture(uDownsample, fUv + vec2(+s.x, -s.y)).rgb;
+        upsampleColor += 1.0 * texture(uDownsample, min(fUv + vec2(-s.x, +s.y), uUvMax)).rgb;
+        upsampleColor += 2.0 * texture(uDownsample, min(fUv + vec2(+0.0, +s.y), uUvMax)).rgb;
+        upsampleColor += 1.0 * texture(uDownsample, min(fUv + vec2(+s.x, +s.y), uUvMax)).rgb;
+        upsampleColor += 2.0 * texture(uDownsample, min(fUv + vec2(-s.x, +0.0), uUvMax)).rgb;
+        upsampleColor += 4.0 * texture(uDownsample, min(fUv + vec2(+0.0, +0.0), uUvMax)).rgb;
+        upsampleColor += 2.0 * texture(uDownsample, min(fUv + vec2(+s.x, +0.0), uUvMax)).rgb;
+        upsampleColor += 1.0 * texture(uDownsample, min(fUv + vec2(-s.x, -s.y), uUvMax)).rgb;
+        upsampleColor += 2.0 * texture(uDownsample, min(fUv + vec2(+0.0, -s.y), uUvMax)).rgb;
+        upsampleColor += 1.0 * texture(uDownsample, min(fUv + vec2(+s.x, -s.y), uUvMax)).rgb;
         
-        oColor = vec4(upsampleColor / 16.0 + texture(uPrevious, fUv).rgb, 1.0);
+        oColor = vec4(upsampleColor / 16.0 + texture(uPrevious, min(fUv, uPreviousUvMax)).rgb, 1.0);
 
     }
   )";
@@ -116,13 +161,19 @@ namespace mr::embed
   constexpr std::string_view s_vs_fullscreen = R"(
     #version 330
 
+    // Render targets can be bigger than the area being rendered (see render_extent), the uvs
+    // are scaled so that only that area of the source textures is sampled. The fragment shaders
+    // clamp them to uUvMax, the last texel of that area, since their taps and the linear
+    // filtering would reach past it
+    uniform vec2 uUvScale;
+
     layout(location = 0) in vec2 aUv;
 
     smooth out vec2 fUv;
 
     void main() {
       gl_Position = vec4(aUv * 2.0 - 1.0, 0.0, 1.0);
-      fUv = aUv;
+      fUv = aUv * uUvScale;
     }
   )";
 
@@ -130,13 +181,14 @@ namespace mr::embed
     #version 330
 
     uniform sampler2D uTexture;
+    uniform vec2 uUvMax;
 
     smooth in vec2 fUv;
 
     out vec4 oColor;
 
     void main() {
-      oColor = texture(uTexture, fUv);
+      oColor = texture(uTexture, min(fUv, uUvMax));
     }  
   )";
 
@@ -146,38 +198,101 @@ namespace mr::embed
     uniform sampler2D uTexture;
     uniform sampler2D uBloom;
     uniform float uExposure;
+    uniform vec2 uUvMax;
 
     smooth in vec2 fUv;
 
     out vec4 oColor;
 
     void main() {
-      vec3 hdrColor = texture(uTexture, fUv).rgb  + texture(uBloom, fUv).rgb; 
+      #if defined(NO_BLOOM)
+        vec3 hdrColor = texture(uTexture, min(fUv, uUvMax)).rgb;
+      #else
+        vec3 hdrColor = texture(uTexture, min(fUv, uUvMax)).rgb  + texture(uBloom, min(fUv, uUvMax)).rgb; 
+      #endif
       vec3 color = vec3(1.0) - exp(-hdrColor * uExposure);
       oColor = vec4(color, 1.0);
     }  
   )";
 
+  constexpr std::string_view s_fs_overdraw = R"(
+    #version 330
+
+    // Fragments shaded per pixel
+    uniform sampler2D uTexture;
+    uniform float uMaxCount;
+    uniform vec2 uUvMax;
+
+    smooth in vec2 fUv;
+
+    out vec4 oColor;
+
+    // From nothing (black) to uMaxCount and more (red)
+    const vec3 RAMP[5] = vec3[] (
+      vec3(0.0, 0.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0)
+    );
+
+    void main() {
+      float x = clamp(texture(uTexture, min(fUv, uUvMax)).r / uMaxCount, 0.0, 1.0) * 4.0;
+      int i = min(int(x), 3);
+      oColor = vec4(mix(RAMP[i], RAMP[i + 1], x - float(i)), 1.0);
+    }
+  )";
+
   constexpr std::string_view s_vs_strings = R"(
     #version 330
 
     uniform float uScreenWidth;
     uniform float uScreenHeight;
 
+    // Two texels for each atlas slot: uv0 and uv1, then the normalized offset and size
+    uniform sampler2D uGlyphs;
+
+    #if defined(PALETTE)
+      // Palette index -> atlas slot
+      uniform isampler2D uPalette;
+    #endif
+
+    // One instance per cell
     layout(location = 0) in vec2 aPosition;
-    layout(location = 1) in vec2 aUv;
-    layout(location = 2) in vec4 aColor;
+    layout(location = 1) in float aSize;
+    layout(location = 2) in int aGlyph;
+    layout(location = 3) in vec4 aColor;
 
     smooth out vec2 fUv;
     flat out vec4 fColor;
 
+    const vec2 CORNERS[6] = vec2[] (
+      vec2(0.0, 0.0), vec2(0.0, 1.0), vec2(1.0, 0.0),
+      vec2(0.0, 1.0), vec2(1.0, 1.0), vec2(1.0, 0.0)
+    );
+
     void main() {
+      #if defined(PALETTE)
+        int slot = texelFetch(uPalette, ivec2(aGlyph, 0), 0).r;
+      #else
+        int slot = aGlyph;
+      #endif
+
+      // Glyph not available, skip the quad
+      if(slot < 0) {
+        gl_Position = vec4(0.0);
+        return;
+      }
+
+      vec4 uvRect = texelFetch(uGlyphs, ivec2(slot * 2, 0), 0);
+      vec4 rect = texelFetch(uGlyphs, ivec2(slot * 2 + 1, 0), 0);
+
+      // The view y-axis points down, while the uv y-axis points up
+      vec2 corner = CORNERS[gl_VertexID];
+      vec2 position = aPosition + (rect.xy + rect.zw * corner) * aSize;
+
       vec2 ndcPos;
-      ndcPos.x = (aPosition.x / uScreenWidth) * 2.0 - 1.0;
-      ndcPos.y = (aPosition.y / uScreenHeight) * -2.0 + 1.0;
+      ndcPos.x = (position.x / uScreenWidth) * 2.0 - 1.0;
+      ndcPos.y = (position.y / uScreenHeight) * -2.0 + 1.0;
 
       gl_Position = vec4(ndcPos, 0.0, 1.0);
-      fUv = aUv;
+      fUv = vec2(mix(uvRect.x, uvRect.z, corner.x), mix(uvRect.w, uvRect.y, corner.y));
       fColor = aColor;
     }
   )";
@@ -186,6 +301,12 @@ namespace mr::embed
     #version 330
 
     uniform sampler2D uFont;
+    uniform bool uDistanceField;
+
+    #if defined(TONEMAP)
+      // Drawn straight to the screen, without the HDR pass
+      uniform float uExposure;
+    #endif
 
     smooth in vec2 fUv;
     flat in vec4 fColor;
@@ -193,8 +314,26 @@ namespace mr::embed
     out vec4 oColor;
 
     void main() {
+      #if defined(OVERDRAW)
+        // Every fragment counts, whether the glyph covers it or not. Added up with additive blending
+        oColor = vec4(1.0);
+        return;
+      #endif
+
       float mask = texture(uFont, fUv).r;
-      oColor = vec4(fColor.rgb, fColor.a * mask);
+
+      if(uDistanceField) {
+        // The edge is at 0.5, and the smoothing width is about one screen pixel, so
+        // the glyph stays sharp no matter how much it is scaled
+        float width = clamp(fwidth(mask) * 0.75, 0.001, 0.5);
+        mask = smoothstep(0.5 - width, 0.5 + width, mask);
+      }
+
+      #if defined(TONEMAP)
+        oColor = vec4(vec3(1.0) - exp(-fColor.rgb * uExposure), fColor.a * mask);
+      #else
+        oColor = vec4(fColor.rgb, fColor.a * mask);
+      #endif
     }
   )";
 
@@ -7,6 +7,8 @@
 
 #include "common.h"
 #include "embed.h"
+#include "trace.h"
+#include "gpu_memory.h"
 
 namespace mr
 {
@@ -30,21 +32,28 @@ namespace mr
   blur_filter::~blur_filter()
   {
     glDeleteFramebuffers(1, &m_framebuffer);
-    glDeleteTextures(1, &m_ping_pong);
+    gpu_memory::delete_textures(1, &m_ping_pong);
     glDeleteVertexArrays(1, &m_quad_va);
-    glDeleteBuffers(1, &m_quad_vb);
+    gpu_memory::delete_buffers(1, &m_quad_vb);
     glDeleteProgram(m_prg_hblur);
     glDeleteProgram(m_prg_vblur);
   }
 
-  void blur_filter::resize(const std::int32_t width, const std::int32_t height)
+  void blur_filter::resize(const render_extent &extent)
   {
+    const bool grow = extent.capacity_width != m_extent.capacity_width || extent.capacity_height != m_extent.capacity_height;
+    m_extent = extent;
+
+    if (!grow)
+      return;
+
     glBindTexture(GL_TEXTURE_2D, m_ping_pong);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+    gpu_memory::tex_image_2d(gpu_memory::owners::blur, m_ping_pong, GL_TEXTURE_2D, GL_RGBA16F, extent.capacity_width, extent.capacity_height, GL_RGBA, GL_HALF_FLOAT, nullptr);
   }
 
   void blur_filter::apply(const GLuint target, const float strength, const std::size_t iterations)
   {
+    MR_TRACE_GPU_ZONE("blur");
 
     std::array passes = {
         std::make_tuple(m_ping_pong, target, m_prg_hblur),
@@ -53,6 +62,10 @@ namespace mr
     enable_scope scope{GL_BLEND};
     glDisable(GL_BLEND);
 
+    glViewport(0, 0, m_extent.width, m_extent.height);
+    const auto uv_scale = m_extent.get_uv_scale();
+    const auto uv_max = m_extent.get_uv_max();
+
     for (std::size_t it = 0; it < iterations; ++it)
     {
       for (const auto &[dst, src, program] : passes)
@@ -65,6 +78,8 @@ namespace mr
 
         glUseProgram(program);
         glUniform1f(glGetUniformLocation(program, "uStrength"), strength);
+        glUniform2f(glGetUniformLocation(program, "uUvScale"), uv_scale[0], uv_scale[1]);
+        glUniform2f(glGetUniformLocation(program, "uUvMax"), uv_max[0], uv_max[1]);
         glUniform1i(glGetUniformLocation(program, "uTexture"), 0);
 
         glActiveTexture(GL_TEXTURE0);
@@ -72,6 +87,7 @@ namespace mr
 
         glBindVertexArray(m_quad_va);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        get_frame_counters().draw_calls++;
       }
     }
   }
@@ -94,56 +110,84 @@ namespace mr
 
     glDeleteFramebuffers(1, &m_fb_render_target);
 
-    glDeleteBuffers(1, &m_quad_vb);
+    gpu_memory::delete_buffers(1, &m_quad_vb);
     glDeleteVertexArrays(1, &m_quad_va);
 
     if (m_tx_downsample.size() > 0)
-      glDeleteTextures(m_tx_downsample.size(), m_tx_downsample.data());
+      gpu_memory::delete_textures(m_tx_downsample.size(), m_tx_downsample.data());
 
     if (m_tx_upsample.size() > 0)
-      glDeleteTextures(m_tx_upsample.size(), m_tx_upsample.data());
+      gpu_memory::delete_textures(m_tx_upsample.size(), m_tx_upsample.data());
   }
 
-  void bloom::resize(int32_t width, int32_t height)
+  vec2f bloom::get_uv_scale(const std::size_t level) const
   {
-    m_width = width;
-    m_height = height;
+    const auto [w, h] = m_sizes[level];
+    const auto [cw, ch] = m_capacities[level];
+    return {float(w) / cw, float(h) / ch};
+  }
 
-    m_sizes.clear();
+  vec2f bloom::get_uv_max(const std::size_t level) const
+  {
+    const auto [w, h] = m_sizes[level];
+    const auto [cw, ch] = m_capacities[level];
+    return {(w - 0.5f) / cw, (h - 0.5f) / ch};
+  }
 
-    while (width >= 1 && height >= 1)
-    {
+  std::size_t bloom::get_level_count() const
+  {
+    return m_max_levels > 0 ? std::min(m_max_levels, m_sizes.size()) : m_sizes.size();
+  }
+
+  // Each level spreads the glow by about a texel of that level on the way down, and as much on the way up
+  std::int32_t bloom::get_radius() const
+  {
+    return 2 << get_level_count();
+  }
+
+  void bloom::resize(const render_extent &extent)
+  {
+    const bool grow = extent.capacity_width != m_extent.capacity_width || extent.capacity_height != m_extent.capacity_height;
+    m_extent = extent;
+
+    // The vectors keep their memory, so this doesn't allocate unless the chain grows
+    m_sizes.clear();
+    for (auto width = extent.width, height = extent.height; width >= 1 && height >= 1; width /= 2, height /= 2)
       m_sizes.push_back({width, height});
-      width /= 2;
-      height /= 2;
-    }
+
+    if (!grow)
+      return;
+
+    m_capacities.clear();
+    for (auto width = extent.capacity_width, height = extent.capacity_height; width >= 1 && height >= 1; width /= 2, height /= 2)
+      m_capacities.push_back({width, height});
 
     if (m_tx_downsample.size() > 0)
-      glDeleteTextures(m_tx_downsample.size(), m_tx_downsample.data());
+      gpu_memory::delete_textures(m_tx_downsample.size(), m_tx_downsample.data());
 
     if (m_tx_upsample.size() > 0)
-      glDeleteTextures(m_tx_upsample.size(), m_tx_upsample.data());
+      gpu_memory::delete_textures(m_tx_upsample.size(), m_tx_upsample.data());
 
-    m_tx_downsample.resize(m_sizes.size());
-    m_tx_upsample.resize(m_sizes.size());
+    m_tx_downsample.resize(m_capacities.size());
+    m_tx_upsample.resize(m_capacities.size());
 
-    glGenTextures(m_sizes.size(), m_tx_downsample.data());
-    glGenTextures(m_sizes.size(), m_tx_upsample.data());
+    glGenTextures(m_capacities.size(), m_tx_downsample.data());
+    glGenTextures(m_capacities.size(), m_tx_upsample.data());
 
-    for (size_t i = 0; i < m_sizes.size(); ++i)
+    for (size_t i = 0; i < m_capacities.size(); ++i)
     {
-      const auto [w, h] = m_sizes[i];
+      const auto [w, h] = m_capacities[i];
       glBindTexture(GL_TEXTURE_2D, m_tx_downsample[i]);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, w, h, 0, GL_RGB, GL_HALF_FLOAT, nullptr);
+      gpu_memory::tex_image_2d(gpu_memory::owners::bloom_chain, m_tx_downsample[i], GL_TEXTURE_2D, GL_RGB16F, w, h, GL_RGB, GL_HALF_FLOAT, nullptr);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
       glBindTexture(GL_TEXTURE_2D, m_tx_upsample[i]);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, w, h, 0, GL_RGB, GL_HALF_FLOAT, nullptr);
+      gpu_memory::tex_image_2d(gpu_memory::owners::bloom_chain, m_tx_upsample[i], GL_TEXTURE_2D, GL_RGB16F, w, h, GL_RGB, GL_HALF_FLOAT, nullptr);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     };
@@ -151,39 +195,66 @@ namespace mr
 
   GLuint bloom::compute(const GLuint source, const float threshold, const float knee)
   {
-    enable_scope scope({GL_BLEND});
+    return compute(source, threshold, knee, {0, 0, m_extent.width, m_extent.height});
+  }
+
+  GLuint bloom::compute(const GLuint source, const float threshold, const float knee, const pixel_rect &region)
+  {
+    MR_TRACE_GPU_ZONE("bloom");
+    enable_scope scope({GL_BLEND, GL_SCISSOR_TEST});
     glDisable(GL_BLEND);
+    glEnable(GL_SCISSOR_TEST);
+
+    assert(m_sizes.size() > 0);
 
-    assert(m_width > 0 && m_height > 0);
+    const auto level_count = get_level_count();
+
+    // The region at each level, plus a texel for the filters footprint
+    const auto scissor = [&](const std::size_t level) {
+      const auto [w, h] = m_sizes[level];
+      const float scale = 1.0f / (1 << level);
+      const auto r = region.scaled(scale, scale).grown(1).clamped(w, h);
+      glScissor(r.x, r.y, r.width, r.height);
+    };
 
     // Prefilter
-    glBindFramebuffer(GL_FRAMEBUFFER, m_fb_render_target);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_downsample[0], 0);
+    {
+      MR_TRACE_GPU_ZONE("bloom prefilter");
+
+      glBindFramebuffer(GL_FRAMEBUFFER, m_fb_render_target);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_downsample[0], 0);
 
-    glViewport(0, 0, m_width, m_height);
+      glViewport(0, 0, m_extent.width, m_extent.height);
+      scissor(0);
 
-    glClearColor(0, 0, 0, 1);
-    glClear(GL_COLOR_BUFFER_BIT);
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
 
-    glUseProgram(m_prg_prefilter);
-    glUniform1f(glGetUniformLocation(m_prg_prefilter, "uThreshold"), threshold);
-    glUniform1f(glGetUniformLocation(m_prg_prefilter, "uKnee"), knee);
-    glUniform1i(glGetUniformLocation(m_prg_prefilter, "uSource"), 0);
+      glUseProgram(m_prg_prefilter);
+      glUniform1f(glGetUniformLocation(m_prg_prefilter, "uThreshold"), threshold);
+      glUniform1f(glGetUniformLocation(m_prg_prefilter, "uKnee"), knee);
+      glUniform1i(glGetUniformLocation(m_prg_prefilter, "uSource"), 0);
+      glUniform2f(glGetUniformLocation(m_prg_prefilter, "uUvScale"), get_uv_scale(0)[0], get_uv_scale(0)[1]);
+      glUniform2f(glGetUniformLocation(m_prg_prefilter, "uUvMax"), get_uv_max(0)[0], get_uv_max(0)[1]);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, source);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, source);
 
-    glBindVertexArray(m_quad_va);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+      glBindVertexArray(m_quad_va);
+      glDrawArrays(GL_TRIANGLES, 0, 6);
+      get_frame_counters().draw_calls++;
+    }
 
     // Downsample
     {
+      MR_TRACE_GPU_ZONE("bloom downsample");
       glUseProgram(m_prg_downsample);
-      for (size_t i = 1; i < m_tx_downsample.size(); ++i)
+      for (size_t i = 1; i < level_count; ++i)
       {
         const auto &[w, h] = m_sizes[i];
 
         glViewport(0, 0, w, h);
+        scissor(i);
 
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_downsample[i], 0);
         glClear(GL_COLOR_BUFFER_BIT);
@@ -192,23 +263,30 @@ namespace mr
         glBindTexture(GL_TEXTURE_2D, m_tx_downsample[i - 1]);
 
         glUniform1i(glGetUniformLocation(m_prg_downsample, "uSource"), 0);
+        glUniform2f(glGetUniformLocation(m_prg_downsample, "uUvScale"), get_uv_scale(i - 1)[0], get_uv_scale(i - 1)[1]);
+        glUniform2f(glGetUniformLocation(m_prg_downsample, "uUvMax"), get_uv_max(i - 1)[0], get_uv_max(i - 1)[1]);
 
         glBindVertexArray(m_quad_va);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        get_frame_counters().draw_calls++;
       }
     }
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_upsample.back(), 0);
-    glClear(GL_COLOR_BUFFER_BIT);
-
     // Upsample
     {
+      MR_TRACE_GPU_ZONE("bloom upsample");
+
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_upsample[level_count - 1], 0);
+      scissor(level_count - 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+
       glUseProgram(m_prg_upsample);
-      for (int32_t i = m_tx_upsample.size() - 2; i >= 0; --i)
+      for (int32_t i = level_count - 2; i >= 0; --i)
       {
         const auto &[w, h] = m_sizes[i];
 
         glViewport(0, 0, w, h);
+        scissor(i);
 
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tx_upsample[i], 0);
         glClear(GL_COLOR_BUFFER_BIT);
@@ -221,9 +299,13 @@ namespace mr
 
         glUniform1i(glGetUniformLocation(m_prg_upsample, "uPrevious"), 0);
         glUniform1i(glGetUniformLocation(m_prg_upsample, "uDownsample"), 1);
+        glUniform2f(glGetUniformLocation(m_prg_upsample, "uUvScale"), get_uv_scale(i)[0], get_uv_scale(i)[1]);
+        glUniform2f(glGetUniformLocation(m_prg_upsample, "uUvMax"), get_uv_max(i)[0], get_uv_max(i)[1]);
+        glUniform2f(glGetUniformLocation(m_prg_upsample, "uPreviousUvMax"), get_uv_max(i + 1)[0], get_uv_max(i + 1)[1]);
 
         glBindVertexArray(m_quad_va);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        get_frame_counters().draw_calls++;
       }
     }
     return m_tx_upsample.front();
@@ -6,6 +6,8 @@
 #include <vector>
 #include <tuple>
 
+#include "common.h"
+
 namespace mr
 {
   class blur_filter
@@ -17,12 +19,13 @@ namespace mr
     GLuint m_quad_vb = 0;
     GLuint m_framebuffer = 0;
     GLuint m_ping_pong = 0;
-    int32_t m_width = 0; 
-    int32_t m_height = 0; 
+    render_extent m_extent;
   public:
     blur_filter();
     ~blur_filter();
-    void resize(const std::int32_t width, const std::int32_t height);
+
+    // Only reallocates when the capacity changes, the targets passed to apply must have the same extent
+    void resize(const render_extent &extent);
     void apply(const GLuint target, const float strength, const std::size_t iterations);
   };
 
@@ -33,15 +36,34 @@ namespace mr
     GLuint m_fb_render_target = 0;
     GLuint m_quad_va = 0, m_quad_vb = 0;
     GLuint m_prg_prefilter = 0, m_prg_downsample = 0, m_prg_upsample = 0;
-    int32_t m_width = 0, m_height = 0;
-    std::vector<std::tuple<int32_t, int32_t>> m_sizes;
+    render_extent m_extent;
+    std::vector<std::tuple<int32_t, int32_t>> m_sizes;      // Rendered area of each level
+    std::vector<std::tuple<int32_t, int32_t>> m_capacities; // Allocated size of each level
     std::vector<GLuint> m_tx_downsample;
     std::vector<GLuint> m_tx_upsample;
+    std::size_t m_max_levels = 0;
+
+    vec2f get_uv_scale(const std::size_t level) const;
+    vec2f get_uv_max(const std::size_t level) const;
+    std::size_t get_level_count() const;
   public:
     bloom();
     ~bloom();
-    void resize(int32_t width, int32_t height);
+
+    // Only reallocates the mip chain when the capacity changes, the source passed to compute must have the same extent
+    void resize(const render_extent &extent);
+
+    // Fewer levels is less passes, but a tighter glow. 0 means down to a single pixel
+    void set_max_levels(const std::size_t levels) { m_max_levels = levels; }
+
+    // How far the glow goes from a bright pixel, with the current number of levels
+    std::int32_t get_radius() const;
+
     GLuint compute(const GLuint source, const float threshold, const float knee);
+
+    // Only updates the region of the chain under the given area, the rest keeps the result of the previous calls. The
+    // area must include the glow radius of whatever changed in the source
+    GLuint compute(const GLuint source, const float threshold, const float knee, const pixel_rect &region);
   };
 
 
@@ -1,153 +1,571 @@
 #include "font.h"
 
 #include <algorithm>
-#include <fstream>
+#include <chrono>
 #include <iostream>
+#include <iterator>
+#include <thread>
+#include <unordered_set>
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include <stb_truetype.h>
 
 #include "application.h"
+#include "gpu_memory.h"
 
 namespace mr
 {
 
   static constexpr float s_font_size = 64.0f;
-  static constexpr std::int32_t s_bitmap_width = 1024;
-  static constexpr std::int32_t s_bitmap_height = 1024;
+  static constexpr std::int32_t s_bitmap_size = 1024;
 
+  // Distance field settings. Since the glyph edges are reconstructed in the shader, a much smaller
+  // size is enough to get sharp glyphs at any scale. The distance is encoded so that a glyph edge is
+  // at s_sdf_on_edge, and each pixel away from it changes the value by s_sdf_pixel_dist_scale
+  static constexpr float s_sdf_font_size = 32.0f;
+  static constexpr std::int32_t s_sdf_bitmap_size = 512;
+  static constexpr std::int32_t s_sdf_padding = 4;
+  static constexpr unsigned char s_sdf_on_edge = 128;
+  static constexpr float s_sdf_pixel_dist_scale = float(s_sdf_on_edge) / s_sdf_padding;
+
+  // Maximum number of glyphs the rain is drawn from at any given time
+  static constexpr std::size_t s_palette_size = 128;
+
+  // Default palette candidates
   static constexpr std::string_view s_characters =
       "abcdefghijklmnopqrstuvwxyz"
       "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
       "0123456789"
       "., ";
 
-  // I can make this function consteval in gcc, while MSVC is complaining that 
-  // a "call to immediate function is not a constant expression".
-  // From what I understand consteval just means that this is an immediate function
-  // and I should be able to call it even from a non-constexpr context
-  static /* consteval */ auto get_code_points()
+  // The atlas grows a page at a time, when every glyph in it is in use in the frame
+  static constexpr std::int32_t s_max_atlas_pages = 8;
+
+  // Drawn when a glyph doesn't fit in the atlas anymore. It has the first slot, which is never evicted. Fonts without it
+  // have their "missing glyph" instead, usually a box
+  static constexpr std::int32_t s_fallback_code_point = 0xFFFD;
+  static constexpr std::int32_t s_fallback_slot = 0;
+
+  // Content of the slots that don't have a glyph yet, and of invalid code points. It has no size, so it's simply not
+  // visible
+  static const glyph s_empty_glyph = {.code_point = -1, .slot = -1, .uv0 = {}, .uv1 = {}, .norm_advance = 0.0f, .norm_offset = {}, .norm_size = {}};
+
+  font::font() = default;
+
+  std::int32_t &font::lookup(const std::int32_t code_point)
   {
-    std::array<std::int32_t, s_characters.size()> ret = {0};
-    std::ranges::transform(s_characters, ret.begin(), [](const char c) { return static_cast<std::int32_t>(c); });
-    return ret;
-  };
+    auto &block = m_lookup[code_point / s_block_size];
 
-  const glyph& font::find_glyph(const int32_t code_point)
+    if (!block)
+    {
+      block = std::make_unique<lookup_block>();
+      block->fill(-1);
+    }
+
+    return (*block)[code_point % s_block_size];
+  }
+
+  std::size_t font::get_slot_count(const std::int32_t atlas_height) const
   {
-    const auto it = std::ranges::find_if(m_glyphs, [code_point](const glyph& g) { return g.code_point == code_point; });
-    assert(it != m_glyphs.end());
-    return *it;
+    return static_cast<std::size_t>(m_slots_per_row) * (atlas_height / m_slot_size);
   }
 
+  static std::array<vec4f, 2> get_table_entry(const glyph &g)
+  {
+    // Two texels for each slot in the glyph table: the uv rectangle, then the normalized offset and size
+    return {
+        vec4f{g.uv0[0], g.uv0[1], g.uv1[0], g.uv1[1]},
+        vec4f{g.norm_offset[0], g.norm_offset[1], g.norm_size[0], g.norm_size[1]}};
+  }
 
-  void font::load(const unsigned char *font_data, [[maybe_unused]] const size_t length)
+  bool font::add_page()
   {
+    if (m_atlas_height / m_atlas_size >= m_max_pages)
+      return false;
 
-    std::vector<unsigned char> pixels;
-    pixels.resize(s_bitmap_width * s_bitmap_height);
+    const auto old_height = m_atlas_height;
+    const auto old_count = m_glyphs.size();
 
-    stbtt_pack_context pack_context;
+    m_atlas_height += m_atlas_size;
+    const auto slot_count = get_slot_count(m_atlas_height);
 
-    stbtt_PackBegin(&pack_context, pixels.data(), s_bitmap_width, s_bitmap_height,
-                    0, 2, nullptr);
+    m_pixels.resize(static_cast<std::size_t>(m_atlas_size) * m_atlas_height, 0);
 
-    auto code_points = get_code_points();
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gpu_memory::tex_image_2d(gpu_memory::owners::font_atlas, m_texture, GL_TEXTURE_2D, GL_R8, m_atlas_size, m_atlas_height, GL_RED, GL_UNSIGNED_BYTE, m_pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-    std::vector<stbtt_pack_range> pack_ranges;
-    pack_ranges.push_back({.font_size = s_font_size,
-                           .first_unicode_codepoint_in_range = 0,
-                           .array_of_unicode_codepoints = code_points.data(),
-                           .num_chars = code_points.size(),
-                           .chardata_for_range = new stbtt_packedchar[code_points.size()]});
+    // The slots keep their place, only their v coordinates change
+    const float v_scale = float(old_height) / m_atlas_height;
+    for (auto &g : m_glyphs)
+    {
+      g.uv0[1] *= v_scale;
+      g.uv1[1] *= v_scale;
+    }
 
-    stbtt_PackFontRanges(&pack_context, font_data, 0, pack_ranges.data(), pack_ranges.size());
+    // The new slots are the first ones to be used
+    m_glyphs.resize(slot_count, s_empty_glyph);
+    m_slots.resize(slot_count);
+    for (auto i = old_count; i < slot_count; ++i)
+      m_slots[i].lru_it = m_lru.insert(m_lru.begin(), static_cast<std::int32_t>(i));
 
-    stbtt_PackEnd(&pack_context);
+    std::vector<std::array<vec4f, 2>> table(slot_count);
+    std::ranges::transform(m_glyphs, table.begin(), get_table_entry);
+
+    glBindTexture(GL_TEXTURE_2D, m_tx_glyphs);
+    gpu_memory::tex_image_2d(gpu_memory::owners::font_atlas, m_tx_glyphs, GL_TEXTURE_2D, GL_RGBA32F, slot_count * 2, 1, GL_RGBA, GL_FLOAT, table.data());
+
+    return true;
+  }
+
+  std::int32_t font::acquire_slot()
+  {
+    auto slot = m_lru.front();
+
+    // The least recently used glyph is still in use in this frame, so the atlas is full
+    if (m_slots[slot].last_used == m_frame)
+    {
+      if (!add_page())
+        return -1;
+
+      slot = m_lru.front();
+    }
+
+    // Evict the previous glyph
+    if (const auto code_point = m_glyphs[slot].code_point; code_point >= 0)
+      lookup(code_point) = -1;
+
+    return slot;
+  }
+
+  void font::touch(const std::int32_t slot)
+  {
+    // Not in the LRU list, it's never evicted
+    if (slot == s_fallback_slot)
+      return;
+
+    auto &state = m_slots[slot];
+    if (state.last_used != m_frame)
+    {
+      state.last_used = m_frame;
+      m_lru.splice(m_lru.end(), m_lru, state.lru_it);
+    }
+  }
+
+  // A single glyph rasterised on the CPU, waiting to be copied into the atlas
+  struct glyph_bitmap
+  {
+    std::int32_t code_point = 0;
+    std::int32_t advance = 0;
+    std::int32_t width = 0, height = 0;
+    std::int32_t xoff = 0, yoff = 0;
+    std::vector<unsigned char> pixels{};
+  };
+
+  // The font info is only read here, so this can be called from multiple threads at once
+  static glyph_bitmap rasterise_glyph(const stbtt_fontinfo &info, const font_mode mode, const float scale, const std::int32_t code_point)
+  {
+    glyph_bitmap result{.code_point = code_point};
+
+    std::int32_t lsb;
+    stbtt_GetCodepointHMetrics(&info, code_point, &result.advance, &lsb);
+
+    std::int32_t w = 0, h = 0;
+    unsigned char *bitmap = mode == font_mode::sdf
+                                ? stbtt_GetCodepointSDF(&info, scale, code_point, s_sdf_padding, s_sdf_on_edge,
+                                                        s_sdf_pixel_dist_scale, &w, &h, &result.xoff, &result.yoff)
+                                : stbtt_GetCodepointBitmap(&info, 0, scale, code_point, &w, &h, &result.xoff, &result.yoff);
+
+    // Blank glyphs (like the space) don't have a bitmap at all
+    if (bitmap)
+    {
+      result.width = w;
+      result.height = h;
+      result.pixels.assign(bitmap, bitmap + w * h);
+      mode == font_mode::sdf ? stbtt_FreeSDF(bitmap, nullptr) : stbtt_FreeBitmap(bitmap, nullptr);
+    }
+
+    return result;
+  }
+
+  glyph_bitmap font::rasterise(const std::int32_t code_point) const
+  {
+    return rasterise_glyph(*m_info, m_mode, m_scale, code_point);
+  }
+
+  void font::blit(const glyph_bitmap &bitmap, const std::int32_t slot)
+  {
+    // The slot is cleared entirely, since it might contain an evicted glyph. There's a texel of
+    // spacing around each glyph to avoid bleeding with linear filtering. Glyphs that are bigger
+    // than a slot (very unlikely) are clipped
+    const std::int32_t cw = std::min(bitmap.width, m_slot_size - 2);
+    const std::int32_t ch = std::min(bitmap.height, m_slot_size - 2);
+
+    const std::int32_t x0 = (slot % m_slots_per_row) * m_slot_size;
+    const std::int32_t y0 = (slot / m_slots_per_row) * m_slot_size;
+    unsigned char *const origin = m_pixels.data() + static_cast<std::size_t>(y0) * m_atlas_size + x0;
+
+    for (std::int32_t y = 0; y < m_slot_size; ++y)
+      std::fill_n(origin + y * m_atlas_size, m_slot_size, 0);
+
+    for (std::int32_t y = 0; y < ch; ++y)
+      std::copy_n(bitmap.pixels.data() + y * bitmap.width, cw, origin + (y + 1) * m_atlas_size + 1);
 
-    // The font is packed into a 8-bit bitmap (basically grayscale). I'll store it as RED 8
-    glGenTextures(1, &m_texture);
     glBindTexture(GL_TEXTURE_2D, m_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, s_bitmap_width, s_bitmap_height, 0, GL_RED, GL_UNSIGNED_BYTE, pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, m_atlas_size);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, m_slot_size, m_slot_size, GL_RED, GL_UNSIGNED_BYTE, origin);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    const float atlas_width = static_cast<float>(m_atlas_size);
+    const float atlas_height = static_cast<float>(m_atlas_height);
+
+    // It is a classic bitmap, so the origin (0, 0) is at the top left corner, and each glyph coordinates are given
+    // in pixel space. So I need to invert the y-axis and normalize to get OpenGL uv coordinates.
+    // In distance field mode the quad also covers the padding, which is needed by the shader to reconstruct the edges
+    auto &g = m_glyphs[slot];
+
+    g = {
+      .code_point = bitmap.code_point,
+      .slot = slot,
+      .uv0 = {
+        float(x0 + 1) / atlas_width,
+        float(y0 + 1 + ch) / atlas_height,
+      },
+      .uv1 = {
+        float(x0 + 1 + cw) / atlas_width,
+        float(y0 + 1) / atlas_height,
+      },
+      .norm_advance = bitmap.advance * m_scale / m_font_size,
+      .norm_offset = {
+        float(bitmap.xoff) / m_font_size,
+        float(bitmap.yoff) / m_font_size
+      },
+      .norm_size = {
+        float(cw) / m_font_size,
+        float(ch) / m_font_size
+      }
+    };
 
-    // For this program, linear filtering works much better than mipmaps
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    const auto entry = get_table_entry(g);
+
+    glBindTexture(GL_TEXTURE_2D, m_tx_glyphs);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, slot * 2, 0, 2, 1, GL_RGBA, GL_FLOAT, entry.data());
+  }
+
+  void font::preload(const std::vector<std::int32_t> &code_points, const std::size_t threads)
+  {
+    // Only glyphs that are not in the atlas yet, and no more than the atlas can fit
+    const auto max_count = get_capacity();
+    std::vector<std::int32_t> missing;
+    std::unordered_set<std::int32_t> seen;
+    seen.reserve(std::min(code_points.size(), max_count));
+    for (const auto cp : code_points)
+    {
+      if (missing.size() == max_count)
+        break;
 
-    for (const auto &range : pack_ranges)
+      if (cp >= 0 && cp <= s_max_code_point && lookup(cp) < 0 && seen.insert(cp).second)
+        missing.push_back(cp);
+    }
+
+    // Rasterisation is the expensive part, and each glyph is independent from the others
+    std::vector<glyph_bitmap> bitmaps(missing.size());
+    parallel_for(missing.size(), threads, [&](const std::size_t i) { bitmaps[i] = rasterise(missing[i]); });
+
+    // Slots are assigned in the given order, no matter which thread finished first, so the
+    // atlas layout is always the same
+    for (const auto &bitmap : bitmaps)
     {
-      for (std::int32_t i = 0; i < range.num_chars; ++i)
+      const auto slot = acquire_slot();
+      if (slot < 0)
+        break;
+
+      blit(bitmap, slot);
+      lookup(bitmap.code_point) = slot;
+      touch(slot);
+    }
+  }
+
+  const glyph& font::find_glyph(const int32_t code_point)
+  {
+    if (code_point < 0 || code_point > s_max_code_point)
+      return s_empty_glyph;
+
+    auto &slot = lookup(code_point);
+
+    if (slot < 0)
+    {
+      const auto new_slot = acquire_slot();
+      if (new_slot < 0)
       {
-        const auto &ginfo = range.chardata_for_range[i];
-
-        // It is a classic bitmap, so the origin (0, 0) is at the top left corner, and each glyph coordinates are given
-        // in pixel space. So I need to invert the y-axis and normalize to get OpenGL uv coordinates
-        m_glyphs.push_back({
-          .code_point = range.array_of_unicode_codepoints[i],
-          .uv0 = {
-            float(ginfo.x0) / s_bitmap_width,
-            float(ginfo.y1) / s_bitmap_height,
-          },
-          .uv1 = {
-            float(ginfo.x1) / s_bitmap_width,
-            float(ginfo.y0) / s_bitmap_height,
-          },
-          .norm_advance = ginfo.xadvance / s_font_size,
-          .norm_offset = {
-            float(ginfo.xoff) / s_font_size,
-            float(ginfo.yoff) / s_font_size
-          },
-          .norm_size = {
-            float(ginfo.x1 - ginfo.x0) / s_font_size,
-            float(ginfo.y1 - ginfo.y0) / s_font_size
-          }
-        });
+        if (!m_reported_full)
+        {
+          std::cerr << "The glyph atlas is full, the glyphs that don't fit are drawn as U+FFFD\n";
+          m_reported_full = true;
+        }
+
+        return m_glyphs[s_fallback_slot];
       }
 
-      // Delete font ranges
-      delete[] range.chardata_for_range;
+      blit(rasterise(code_point), new_slot);
+      slot = new_slot;
     }
 
+    touch(slot);
+    return m_glyphs[slot];
+  }
+
+  bool font::has_glyph(const int32_t code_point) const
+  {
+    return stbtt_FindGlyphIndex(m_info.get(), code_point) != 0;
+  }
+
+  std::size_t font::get_capacity() const
+  {
+    return get_slot_count(m_max_pages * m_atlas_size) - 1;
   }
 
-  void font::load(const std::string_view file_name)
+  void font::set_palette(const std::vector<std::int32_t> &candidates, rng::stream random)
   {
-    std::ifstream is;
+    m_candidates.clear();
+    std::ranges::copy_if(candidates, std::back_inserter(m_candidates), [this](const std::int32_t cp) { return has_glyph(cp); });
 
-    is.open(file_name.data(), std::ios_base::binary);
+    // Overlapping ranges would give some glyphs more chances than others
+    std::ranges::sort(m_candidates);
+    m_candidates.erase(std::unique(m_candidates.begin(), m_candidates.end()), m_candidates.end());
 
-    if (!is.is_open())
+    if (m_candidates.empty())
+      terminate_with_error("None of the requested glyphs is in the font");
+
+    if (m_candidates.size() <= s_palette_size)
     {
-      terminate_with_error("Could not open font file");
+      m_palette = m_candidates;
+    }
+    else
+    {
+      // Partial Fisher-Yates shuffle, the palette has no glyph twice
+      for (std::size_t i = 0; i < s_palette_size; ++i)
+        std::swap(m_candidates[i], m_candidates[random.next(i, m_candidates.size())]);
+
+      m_palette.assign(m_candidates.begin(), m_candidates.begin() + s_palette_size);
     }
 
-    std::vector<unsigned char> font_data;
+    // Every entry is uploaded again by the next begin_frame()
+    m_palette_slots.assign(m_palette.size(), -1);
+  }
+
+  void font::begin_frame()
+  {
+    ++m_frame;
+
+    // The cells only reference the palette, so every glyph in it is in use in every frame
+    std::size_t first = m_palette.size(), last = 0;
+
+    for (std::size_t i = 0; i < m_palette.size(); ++i)
+    {
+      const auto slot = find_glyph(m_palette[i]).slot;
+      if (slot != m_palette_slots[i])
+      {
+        m_palette_slots[i] = slot;
+        first = std::min(first, i);
+        last = std::max(last, i);
+      }
+    }
+
+    // Usually just one or two entries
+    if (first <= last)
+    {
+      glBindTexture(GL_TEXTURE_2D, m_tx_palette);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, first, 0, last - first + 1, 1, GL_RED_INTEGER, GL_INT, m_palette_slots.data() + first);
+    }
+  }
+
+  void font::load(const unsigned char *font_data, [[maybe_unused]] const size_t length, const font_mode mode)
+  {
+    m_mode = mode;
+    m_info = std::make_unique<stbtt_fontinfo>();
+
+    if (!stbtt_InitFont(m_info.get(), font_data, stbtt_GetFontOffsetForIndex(font_data, 0)))
+      terminate_with_error("Invalid font data");
+
+    const std::int32_t padding = mode == font_mode::sdf ? s_sdf_padding : 0;
+
+    m_font_size = mode == font_mode::sdf ? s_sdf_font_size : s_font_size;
+    m_atlas_size = mode == font_mode::sdf ? s_sdf_bitmap_size : s_bitmap_size;
+    m_scale = stbtt_ScaleForPixelHeight(m_info.get(), m_font_size);
+
+    // Each slot fits a glyph of the font size, plus the distance field padding and the spacing
+    m_slot_size = static_cast<std::int32_t>(std::ceil(m_font_size)) + 2 * padding + 2;
+    m_slots_per_row = m_atlas_size / m_slot_size;
+    m_atlas_height = m_atlas_size;
+
+    // Both the atlas and the glyph table (two texels per slot) must fit in a texture
+    GLint max_texture_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    m_max_pages = s_max_atlas_pages;
+    while (m_max_pages > 1 && (m_max_pages * m_atlas_size > max_texture_size || get_slot_count(m_max_pages * m_atlas_size) * 2 > static_cast<std::size_t>(max_texture_size)))
+      --m_max_pages;
+
+    const std::size_t slot_count = get_slot_count(m_atlas_height);
+
+    m_glyphs.assign(slot_count, s_empty_glyph);
+    m_slots.assign(slot_count, {});
+    m_lru.clear();
+    for (std::size_t i = 0; i < slot_count; ++i)
+      m_slots[i].lru_it = m_lru.insert(m_lru.end(), static_cast<std::int32_t>(i));
 
-    std::copy(
-        std::istreambuf_iterator<char>(is),
-        std::istreambuf_iterator<char>(),
-        std::back_inserter(font_data));
+    m_lookup.clear();
+    m_lookup.resize(s_max_code_point / s_block_size + 1);
+    m_pixels.assign(static_cast<std::size_t>(m_atlas_size) * m_atlas_height, 0);
+    m_reported_full = false;
 
-    is.close();
+    // The font is rasterised into a 8-bit texture (basically grayscale). I'll store it as RED 8.
+    // Same goes for the distance field, which is stored as unsigned normalized values
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    gpu_memory::tex_image_2d(gpu_memory::owners::font_atlas, m_texture, GL_TEXTURE_2D, GL_R8, m_atlas_size, m_atlas_size, GL_RED, GL_UNSIGNED_BYTE, nullptr);
 
-    load(font_data.data(), font_data.size());
+    // For this program, linear filtering works much better than mipmaps
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Glyph table and palette are only accessed with texelFetch
+    glGenTextures(1, &m_tx_glyphs);
+    glBindTexture(GL_TEXTURE_2D, m_tx_glyphs);
+    gpu_memory::tex_image_2d(gpu_memory::owners::font_atlas, m_tx_glyphs, GL_TEXTURE_2D, GL_RGBA32F, slot_count * 2, 1, GL_RGBA, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &m_tx_palette);
+    glBindTexture(GL_TEXTURE_2D, m_tx_palette);
+    gpu_memory::tex_image_2d(gpu_memory::owners::font_atlas, m_tx_palette, GL_TEXTURE_2D, GL_R32I, s_palette_size, 1, GL_RED_INTEGER, GL_INT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // The fallback glyph stays out of the LRU list, so it's never evicted
+    m_lru.erase(m_slots[s_fallback_slot].lru_it);
+    blit(rasterise(s_fallback_code_point), s_fallback_slot);
+    lookup(s_fallback_code_point) = s_fallback_slot;
+
+    std::vector<std::int32_t> code_points(s_characters.size());
+    std::ranges::transform(s_characters, code_points.begin(), [](const char c) { return static_cast<std::int32_t>(c); });
+    set_palette(code_points, {}); // They all fit in the palette, nothing is picked at random
   }
 
-  void font::swap_glyphs(const std::size_t count)
+  void font::load(const std::string_view file_name, const font_mode mode)
   {
-    for(std::size_t i = 0; i < count; ++i)
+    // The file is mapped rather than read, the OS will only page in the parts of the
+    // font that are actually used by the rasterizer
+    m_file = std::make_unique<mapped_file>(file_name);
+
+    if (!m_file->is_open())
     {
-      const std::size_t idx0 = rng::next(std::size_t{0}, m_glyphs.size());
-      const std::size_t idx1 = rng::next(std::size_t{0}, m_glyphs.size());
-      std::swap(m_glyphs[idx0], m_glyphs[idx1]);
+      terminate_with_error("Could not open font file");
+    }
+
+    load(m_file->data(), m_file->size(), mode);
+  }
+
+  void font::swap_glyphs(const std::span<const glyph_swap> swaps)
+  {
+    for (const auto &swap : swaps)
+    {
+      // The candidates past the palette are the ones that aren't in it, so the glyph that leaves the palette just
+      // trades places with the one that comes in
+      const auto other = m_candidates.size() > m_palette.size() ? m_palette.size() + swap.other : swap.other;
+
+      std::swap(m_candidates[swap.index], m_candidates[other]);
+      if (other < m_palette.size())
+        std::swap(m_palette[swap.index], m_palette[other]);
+      else
+        m_palette[swap.index] = m_candidates[swap.index];
     }
   }
   
 
   font::~font()
   {
-    if (m_texture)
-      glDeleteTextures(1, &m_texture);
+    for (const auto tx : {m_texture, m_tx_glyphs, m_tx_palette})
+      if (tx)
+        gpu_memory::delete_textures(1, &tx);
+  }
+
+  void bench_glyph_loading(const unsigned char *data, const std::vector<std::int32_t> &candidates)
+  {
+    stbtt_fontinfo info;
+    if (!stbtt_InitFont(&info, data, stbtt_GetFontOffsetForIndex(data, 0)))
+      terminate_with_error("Invalid font data");
+
+    // Code points the font doesn't have are cheap to "rasterise", they would make the numbers look better than they are
+    std::vector<std::int32_t> code_points;
+    std::ranges::copy_if(candidates, std::back_inserter(code_points), [&](const std::int32_t cp) { return stbtt_FindGlyphIndex(&info, cp) != 0; });
+
+    std::ranges::sort(code_points);
+    code_points.erase(std::unique(code_points.begin(), code_points.end()), code_points.end());
+
+    if (code_points.empty())
+      terminate_with_error("None of the requested glyphs is in the font");
+
+    // No more than the atlas can hold, preload would stop there
+    {
+      font f;
+      f.load(data, 0, font_mode::sdf);
+      code_points.resize(std::min(code_points.size(), f.get_capacity()));
+    }
+
+    // Powers of two up to the core count, and the core count itself. At least 4 threads, so there's always some
+    // scaling to look at (past the core count it should flatten out)
+    const std::size_t max_threads = std::max<std::size_t>(4, std::thread::hardware_concurrency());
+    std::vector<std::size_t> thread_counts;
+    for (std::size_t threads = 1; threads < max_threads; threads *= 2)
+      thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+
+    const float scale = stbtt_ScaleForPixelHeight(&info, s_sdf_font_size);
+
+    // The load time is the whole of preload: rasterisation, slot assignment, atlas blits and uploads, until the GPU is
+    // done with them. The rasterisation alone is measured on its own, the rest doesn't scale with the threads
+    std::cout << "glyphs\tthreads\trasterise ms\tload ms\tglyphs/s\tspeedup\n";
+
+    for (std::size_t count = 64; ; count *= 4)
+    {
+      count = std::min(count, code_points.size());
+      const std::vector<std::int32_t> subset(code_points.begin(), code_points.begin() + count);
+      double single_thread_ms = 0.0;
+
+      for (const auto threads : thread_counts)
+      {
+        std::vector<glyph_bitmap> bitmaps(count);
+
+        auto start = std::chrono::steady_clock::now();
+        parallel_for(count, threads, [&](const std::size_t i) { bitmaps[i] = rasterise_glyph(info, font_mode::sdf, scale, subset[i]); });
+        const std::chrono::duration<double, std::milli> rasterise = std::chrono::steady_clock::now() - start;
+
+        // A new font every time, so every glyph is missing from the atlas
+        font f;
+        f.load(data, 0, font_mode::sdf);
+        glFinish();
+
+        start = std::chrono::steady_clock::now();
+        f.preload(subset, threads);
+        glFinish();
+        const std::chrono::duration<double, std::milli> load = std::chrono::steady_clock::now() - start;
+
+        if (threads == 1)
+          single_thread_ms = load.count();
+
+        std::cout << count << '\t' << threads << '\t' << rasterise.count() << '\t' << load.count() << '\t' << count / (load.count() / 1000.0) << '\t'
+                  << single_thread_ms / load.count() << '\n';
+      }
+
+      if (count == code_points.size())
+        break;
+    }
   }
 
-}
\ No newline at end of file
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <array>
+#include <list>
+#include <memory>
+#include <span>
 #include <vector>
 #include <string_view>
 
@@ -7,12 +11,23 @@
 
 #include "common.h"
 
+struct stbtt_fontinfo;
+
 namespace mr
 {
 
+  struct glyph_bitmap;
+
+  enum class font_mode
+  {
+    bitmap, // Coverage bitmap rasterised at a fixed size, scaled linearly
+    sdf     // Signed distance field, coverage is reconstructed in the shader
+  };
+
   struct glyph
   {
     int32_t code_point;
+    int32_t slot; // Atlas slot, which is also the index in the GPU glyph table
 
     vec2f uv0, uv1;
 
@@ -22,26 +37,115 @@ namespace mr
     vec2f norm_size; 
   };
 
+  // A change of the palette, picked by the simulation so that it only depends on the seed. The glyph at "index" is
+  // replaced by the "other"-th candidate that isn't in the palette, or when all of them are, swapped with the glyph at
+  // "other"
+  struct glyph_swap
+  {
+    std::uint32_t index = 0;
+    std::uint32_t other = 0;
+  };
+
+  // Glyphs are rasterised lazily, the first time they are looked up, into fixed size slots of the
+  // atlas texture. When the atlas is full, the least recently used glyph is evicted, so the font
+  // can have thousands of glyphs while only paying for the ones that are actually on screen. If every
+  // glyph is in use in the frame, the atlas grows by a page (up to a limit), and past that the glyphs
+  // that don't fit are drawn as U+FFFD, which has a slot of its own.
   struct font
   {
   private:
+    // Code points are mapped to atlas slots with a two level table: the first level
+    // is indexed by the unicode block (256 code points), and blocks are allocated on first use
+    static constexpr std::int32_t s_block_size = 256;
+    static constexpr std::int32_t s_max_code_point = 0x10FFFF;
+    using lookup_block = std::array<std::int32_t, s_block_size>;
+
+    struct slot_state
+    {
+      std::uint64_t last_used = 0;
+      std::list<std::int32_t>::iterator lru_it;
+    };
+
     GLuint m_texture = 0;
-    std::vector<glyph> m_glyphs;
+    GLuint m_tx_glyphs = 0;
+    GLuint m_tx_palette = 0;
+    font_mode m_mode = font_mode::bitmap;
+    std::unique_ptr<mapped_file> m_file;
+    std::unique_ptr<stbtt_fontinfo> m_info;
+    float m_font_size = 0.0f;
+    float m_scale = 0.0f;
+
+    std::int32_t m_atlas_size = 0;   // Width, and height of a page. Pages are stacked vertically
+    std::int32_t m_atlas_height = 0;
+    std::int32_t m_max_pages = 0;
+    std::int32_t m_slot_size = 0;
+    std::int32_t m_slots_per_row = 0;
+    std::uint64_t m_frame = 1;
+    bool m_reported_full = false;
+
+    std::vector<glyph> m_glyphs; // One for each atlas slot
+    std::vector<slot_state> m_slots;
+    std::list<std::int32_t> m_lru; // Front is the least recently used slot
+    std::vector<std::unique_ptr<lookup_block>> m_lookup;
+    std::vector<unsigned char> m_pixels; // Copy of the atlas, uploaded again when a page is added
+
+    // The glyph palette is the small set of glyphs the rain is drawn from. It is picked from
+    // a (possibly much larger) set of candidates, and only the palette needs to be in the atlas.
+    // The palette also lives on the GPU as a palette index -> atlas slot table, so the cells only
+    // store a palette index, and changing a glyph is just a matter of updating a single entry.
+    // The candidates start with the palette, in the same order, and then the ones that aren't in it
+    std::vector<std::int32_t> m_candidates;
+    std::vector<std::int32_t> m_palette;
+    std::vector<std::int32_t> m_palette_slots;
+
+    std::int32_t &lookup(const std::int32_t code_point);
+    std::size_t get_slot_count(const std::int32_t atlas_height) const;
+    bool add_page();
+    std::int32_t acquire_slot();
+    glyph_bitmap rasterise(const std::int32_t code_point) const;
+    void blit(const glyph_bitmap &bitmap, const std::int32_t slot);
+    void touch(const std::int32_t slot);
 
   public:
-    font() = default;
+    font();
     ~font();
 
-    // Some characters change from time to time in the original matrix rain, so
-    // this is an helper function that swaps randomly the given amount of glyphs
-    void swap_glyphs(const std::size_t count);
-    
-    void load(const unsigned char* data, const size_t length);
-    void load(const std::string_view file_name);
+    // Some characters change from time to time in the original matrix rain, the changes
+    // are picked by the caller (see glyph_swap)
+    void swap_glyphs(const std::span<const glyph_swap> swaps);
+
+    // The data must outlive the font, since glyphs are rasterised on demand
+    void load(const unsigned char* data, const size_t length, const font_mode mode = font_mode::bitmap);
+    void load(const std::string_view file_name, const font_mode mode = font_mode::bitmap);
+
+    // Rasterises the given glyphs up front, spreading the work across the given number of
+    // threads (0 means one per core). Glyphs are placed in the atlas in the given order
+    void preload(const std::vector<std::int32_t> &code_points, const std::size_t threads = 0);
+
+    // Glyphs used in the current frame are never evicted, so this must be called once per frame. It also
+    // makes sure that the whole palette is in the atlas, and uploads the palette entries that changed
+    void begin_frame();
+
+    bool has_glyph(const int32_t code_point) const;
+
+    // Most glyphs the atlas can hold, with all its pages (the fallback glyph aside)
+    std::size_t get_capacity() const;
+    // Picks the palette among the candidates (those in the font) with the given stream
+    void set_palette(const std::vector<std::int32_t> &candidates, rng::stream random);
+
     GLuint get_texture() const { return m_texture; }
-    const std::vector<glyph> &get_glyphs() const { return m_glyphs; }
+    GLuint get_glyph_table() const { return m_tx_glyphs; }
+    GLuint get_palette_texture() const { return m_tx_palette; }
+    font_mode get_mode() const { return m_mode; }
+    std::size_t get_palette_size() const { return m_palette.size(); }
+    std::size_t get_candidate_count() const { return m_candidates.size(); }
     const glyph& find_glyph(const int32_t code_point);
+    const std::vector<std::int32_t> &get_palette() const { return m_palette; }
 
   };
 
-}
\ No newline at end of file
+  // Measures how long it takes to load the given glyphs (those in the font) with font::preload, with an increasing
+  // number of threads, and how much of it is the rasterisation. Prints the results. Needs an OpenGL context
+  void bench_glyph_loading(const unsigned char *data, const std::vector<std::int32_t> &candidates);
+
+}
@@ -0,0 +1,185 @@
+#include "gpu_memory.h"
+
+#include <algorithm>
+#include <vector>
+
+// Both report kilobytes
+#ifndef GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
+
+#ifndef GL_TEXTURE_FREE_MEMORY_ATI
+#define GL_TEXTURE_FREE_MEMORY_ATI 0x87FC
+#endif
+
+namespace mr
+{
+  namespace gpu_memory
+  {
+    using namespace std::literals::string_view_literals;
+
+    struct allocation
+    {
+      GLuint id = 0;
+      bool buffer = false; // Textures and buffers have their own names
+      owners owner = owners::count;
+      std::size_t bytes = 0;
+    };
+
+    enum class driver_info
+    {
+      none,
+      nvx,
+      ati
+    };
+
+    static constexpr std::array s_owner_names = {"font atlas"sv, "final render"sv, "blur"sv, "bloom chain"sv, "vertex stream"sv};
+
+    // A few dozen objects, a linear search is as good as anything
+    static std::vector<allocation> s_allocations;
+    static usage s_usage;
+
+    static driver_info s_driver_info = driver_info::none;
+    static std::int64_t s_driver_start_available = 0;
+
+    static std::size_t get_pixel_size(const GLint internal_format)
+    {
+      switch (internal_format)
+      {
+      case GL_R8:
+        return 1;
+      case GL_R32I:
+      case GL_R32F:
+      case GL_RGBA8:
+      case GL_SRGB8_ALPHA8:
+        return 4;
+      case GL_RGB16F:
+        return 6;
+      case GL_RGBA16F:
+        return 8;
+      case GL_RGBA32F:
+        return 16;
+      default:
+        return 4;
+      }
+    }
+
+    static bool has_extension(const std::string_view name)
+    {
+      GLint count = 0;
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+
+      for (GLint i = 0; i < count; ++i)
+      {
+        const auto extension = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+        if (extension && name == extension)
+          return true;
+      }
+
+      return false;
+    }
+
+    static std::int64_t get_driver_available()
+    {
+      // ATI returns the free memory of the pool first, then the largest block and the same for the shared memory
+      std::array<GLint, 4> kb{};
+
+      switch (s_driver_info)
+      {
+      case driver_info::nvx:
+        glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, kb.data());
+        break;
+      case driver_info::ati:
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, kb.data());
+        break;
+      case driver_info::none:
+        return -1;
+      }
+
+      return static_cast<std::int64_t>(kb[0]) * 1024;
+    }
+
+    static void set_size(const GLuint id, const bool buffer, const owners owner, const std::size_t bytes)
+    {
+      auto it = std::ranges::find_if(s_allocations, [&](const allocation &a) { return a.id == id && a.buffer == buffer; });
+      if (it == s_allocations.end())
+        it = s_allocations.insert(s_allocations.end(), {id, buffer, owner, 0});
+
+      auto &owner_bytes = s_usage.bytes[static_cast<std::size_t>(it->owner)];
+      owner_bytes -= it->bytes;
+      s_usage.total -= it->bytes;
+
+      it->owner = owner;
+      it->bytes = bytes;
+
+      s_usage.bytes[static_cast<std::size_t>(owner)] += bytes;
+      s_usage.total += bytes;
+      s_usage.peak = std::max(s_usage.peak, s_usage.total);
+    }
+
+    static void remove(const GLuint id, const bool buffer)
+    {
+      const auto it = std::ranges::find_if(s_allocations, [&](const allocation &a) { return a.id == id && a.buffer == buffer; });
+      if (it == s_allocations.end())
+        return;
+
+      s_usage.bytes[static_cast<std::size_t>(it->owner)] -= it->bytes;
+      s_usage.total -= it->bytes;
+      s_allocations.erase(it);
+    }
+
+    void start()
+    {
+      if (has_extension("GL_NVX_gpu_memory_info"))
+        s_driver_info = driver_info::nvx;
+      else if (has_extension("GL_ATI_meminfo"))
+        s_driver_info = driver_info::ati;
+
+      s_driver_start_available = get_driver_available();
+      s_allocations.reserve(64);
+    }
+
+    void tex_image_2d(const owners owner, const GLuint texture, const GLenum target, const GLint internal_format, const GLsizei width, const GLsizei height,
+                      const GLenum format, const GLenum type, const void *data)
+    {
+      glTexImage2D(target, 0, internal_format, width, height, 0, format, type, data);
+      set_size(texture, false, owner, static_cast<std::size_t>(width) * height * get_pixel_size(internal_format));
+    }
+
+    void buffer_data(const owners owner, const GLuint buffer, const GLenum target, const GLsizeiptr size, const void *data, const GLenum usage)
+    {
+      glBufferData(target, size, data, usage);
+      set_size(buffer, true, owner, static_cast<std::size_t>(size));
+    }
+
+    void delete_textures(const GLsizei count, const GLuint *textures)
+    {
+      for (GLsizei i = 0; i < count; ++i)
+        remove(textures[i], false);
+      glDeleteTextures(count, textures);
+    }
+
+    void delete_buffers(const GLsizei count, const GLuint *buffers)
+    {
+      for (GLsizei i = 0; i < count; ++i)
+        remove(buffers[i], true);
+      glDeleteBuffers(count, buffers);
+    }
+
+    const usage &get_usage()
+    {
+      return s_usage;
+    }
+
+    std::string_view get_owner_name(const owners owner)
+    {
+      return s_owner_names[static_cast<std::size_t>(owner)];
+    }
+
+    std::int64_t get_driver_used()
+    {
+      const auto available = get_driver_available();
+      return available < 0 ? -1 : s_driver_start_available - available;
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include <glad/glad.h>
+
+// Accounting of the GPU memory, by owner. Every texture and buffer storage is allocated through the wrappers below
+// instead of glTexImage2D and glBufferData, and freed through the ones of glDeleteTextures and glDeleteBuffers. Sizes
+// are worked out from the formats, the driver adds its own padding and alignment on top (RGB16F is usually stored
+// as RGBA16F, for instance). Render thread only, like any other GL call
+namespace mr
+{
+  namespace gpu_memory
+  {
+    enum class owners
+    {
+      font_atlas,    // Atlases, glyph tables and palettes of both fonts
+      final_render,  // HDR target of the top layer (and the terminal text)
+      blur,          // Background layer targets and the ping-pong one of the blur
+      bloom_chain,   // Down and up sample levels
+      vertex_stream, // Instance buffers and full screen quads
+      count
+    };
+
+    struct usage
+    {
+      std::array<std::size_t, static_cast<std::size_t>(owners::count)> bytes{};
+      std::size_t total = 0;
+      std::size_t peak = 0;
+    };
+
+    // Reads what the driver has available before anything is allocated, for get_driver_used. Called once, with the
+    // context current
+    void start();
+
+    // The texture or buffer must be bound to the target. Specifying an object again replaces its previous size, so
+    // orphaning a buffer every frame changes nothing
+    void tex_image_2d(const owners owner, const GLuint texture, const GLenum target, const GLint internal_format, const GLsizei width, const GLsizei height,
+                      const GLenum format, const GLenum type, const void *data);
+    void buffer_data(const owners owner, const GLuint buffer, const GLenum target, const GLsizeiptr size, const void *data, const GLenum usage);
+
+    void delete_textures(const GLsizei count, const GLuint *textures);
+    void delete_buffers(const GLsizei count, const GLuint *buffers);
+
+    const usage &get_usage();
+    std::string_view get_owner_name(const owners owner);
+
+    // How much less memory the driver has available than when start was called, in bytes, with GL_NVX_gpu_memory_info
+    // or GL_ATI_meminfo. It includes whatever other processes allocated since, and the driver's own overhead. -1 if
+    // neither extension is supported
+    std::int64_t get_driver_used();
+  }
+}
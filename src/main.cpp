@@ -44,9 +44,327 @@ int main(int argc, char** argv)
   return -1;
 }
 #else
-int main([[maybe_unused]] int argc, [[maybe_unused]] char** argv)
+#include <charconv>
+#include <iostream>
+
+// Parses a comma separated list of hexadecimal code point ranges, like "30a0-30ff,ff66-ff9d"
+static bool parse_code_point_ranges(std::string_view str, std::vector<std::pair<std::int32_t, std::int32_t>>& ranges)
 {
-  mr::run({});
+  while (!str.empty())
+  {
+    const auto comma = str.find(',');
+    const auto range = str.substr(0, comma);
+    str = comma == std::string_view::npos ? std::string_view{} : str.substr(comma + 1);
+
+    const auto dash = range.find('-');
+    const auto first_str = range.substr(0, dash);
+    const auto last_str = dash == std::string_view::npos ? first_str : range.substr(dash + 1);
+
+    std::int32_t first = 0, last = 0;
+    const auto [p0, e0] = std::from_chars(first_str.data(), first_str.data() + first_str.size(), first, 16);
+    const auto [p1, e1] = std::from_chars(last_str.data(), last_str.data() + last_str.size(), last, 16);
+
+    // Unicode ends at 10FFFF
+    if (e0 != std::errc{} || e1 != std::errc{} || p0 != first_str.data() + first_str.size() || p1 != last_str.data() + last_str.size())
+      return false;
+    if (first < 0 || last > 0x10FFFF || first > last)
+      return false;
+
+    ranges.push_back({first, last});
+  }
+
+  return !ranges.empty();
+}
+
+template<typename T>
+static bool parse_number(const std::string_view str, T& value)
+{
+  const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  return ec == std::errc{} && ptr == str.data() + str.size();
+}
+
+// Parses an inclusive range of frames, like "600-719"
+static bool parse_frame_range(const std::string_view str, std::size_t& first, std::size_t& last)
+{
+  const auto dash = str.find('-');
+  return dash != std::string_view::npos && parse_number(str.substr(0, dash), first) && parse_number(str.substr(dash + 1), last) && first <= last;
+}
+
+// Parses a comma separated list of depths, like "0.25,0.5,1"
+static bool parse_depth_layers(std::string_view str, std::vector<float>& layers)
+{
+  layers.clear();
+
+  while (!str.empty())
+  {
+    const auto comma = str.find(',');
+    float depth = 0.0f;
+
+    if (!parse_number(str.substr(0, comma), depth) || depth <= 0.0f || depth > 1.0f)
+      return false;
+
+    layers.push_back(depth);
+    str = comma == std::string_view::npos ? std::string_view{} : str.substr(comma + 1);
+  }
+
+  return !layers.empty();
+}
+
+int main(int argc, char** argv)
+{
+  static constexpr std::size_t max_stress_strings = 1'000'000;
+
+  mr::launch_config config;
+
+  for (std::int32_t i = 1; i < argc; ++i)
+  {
+    const std::string_view arg{ argv[i] };
+    if (arg.starts_with("--font="))
+    {
+      config.rain_font_file = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("--glyphs="))
+    {
+      if (!parse_code_point_ranges(arg.substr(arg.find('=') + 1), config.rain_code_points))
+      {
+        std::cerr << "Invalid code point ranges: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg == "--bench-glyphs")
+    {
+      config.bench_glyphs = true;
+    }
+    else if (arg.starts_with("--columns="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.columns) || config.columns <= 0)
+      {
+        std::cerr << "Invalid number of columns: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--density="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.density) || config.density <= 0.0f)
+      {
+        std::cerr << "Invalid density: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--layers="))
+    {
+      if (!parse_depth_layers(arg.substr(arg.find('=') + 1), config.depth_layers))
+      {
+        std::cerr << "Invalid depth layers: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--seed="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.seed))
+      {
+        std::cerr << "Invalid seed: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--record="))
+    {
+      config.record_file = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("--intro="))
+    {
+      config.intro_file = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("--replay="))
+    {
+      config.replay_file = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("--capture="))
+    {
+      config.capture_prefix = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg == "--uniform-columns")
+    {
+      config.uniform_columns = true;
+    }
+    else if (arg.starts_with("--stress="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.stress_strings) || config.stress_strings == 0 || config.stress_strings > max_stress_strings)
+      {
+        std::cerr << "Invalid number of stress strings (1 to " << max_stress_strings << "): " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--swap-interval="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.swap_interval) || config.swap_interval < 0)
+      {
+        std::cerr << "Invalid swap interval: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--fps="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.max_fps) || config.max_fps <= 0.0f)
+      {
+        std::cerr << "Invalid frame rate: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--frames-in-flight="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.frames_in_flight) || config.frames_in_flight < 1 || config.frames_in_flight > 3)
+      {
+        std::cerr << "Invalid number of frames in flight (1 to 3): " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--target-fps="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.target_fps) || config.target_fps < 0.0f)
+      {
+        std::cerr << "Invalid target frame rate: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--tier="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.tier) || config.tier < 0)
+      {
+        std::cerr << "Invalid quality tier: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg == "--recalibrate")
+    {
+      config.recalibrate = true;
+    }
+    else if (arg == "--alloc-check")
+    {
+      config.alloc_check = true;
+    }
+    else if (arg.starts_with("--trace="))
+    {
+#ifdef MR_PROFILE
+      config.trace_file = arg.substr(arg.find('=') + 1);
+#else
+      std::cerr << "Tracing is not compiled in, use the Debug or Profile configuration\n";
+      return -1;
+#endif
+    }
+    else if (arg.starts_with("--trace-frames="))
+    {
+      if (!parse_frame_range(arg.substr(arg.find('=') + 1), config.trace_first_frame, config.trace_last_frame))
+      {
+        std::cerr << "Invalid frame range: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg == "--frame-stats")
+    {
+      config.frame_stats = true;
+    }
+    else if (arg == "--frame-histogram")
+    {
+      config.frame_histogram = true;
+    }
+    else if (arg.starts_with("--frame-histogram="))
+    {
+      config.frame_histogram = true;
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.frame_histogram_interval) || config.frame_histogram_interval <= 0.0f)
+      {
+        std::cerr << "Invalid frame histogram interval: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--hitch-ms="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.hitch_ms) || config.hitch_ms <= 0.0f)
+      {
+        std::cerr << "Invalid hitch budget: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--metrics="))
+    {
+      config.metrics_file = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("--metrics-interval="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.metrics_interval) || config.metrics_interval <= 0.0f)
+      {
+        std::cerr << "Invalid metrics interval: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--control-socket="))
+    {
+#ifdef MR_LINUX
+      config.control_socket = arg.substr(arg.find('=') + 1);
+#else
+      std::cerr << "The control socket is only supported on Linux\n";
+      return -1;
+#endif
+    }
+    else if (arg == "--hud")
+    {
+      config.hud = true;
+    }
+    else if (arg == "--overdraw")
+    {
+      config.overdraw = true;
+    }
+    else if (arg == "--gpu-memory")
+    {
+      config.gpu_memory = true;
+    }
+    else if (arg.starts_with("--idle="))
+    {
+      const auto mode = arg.substr(arg.find('=') + 1);
+      if (mode == "run")
+        config.idle = mr::idle_mode::run;
+      else if (mode == "throttle")
+        config.idle = mr::idle_mode::throttle;
+      else if (mode == "pause")
+        config.idle = mr::idle_mode::pause;
+      else if (mode == "suspend")
+        config.idle = mr::idle_mode::suspend;
+      else
+      {
+        std::cerr << "Invalid idle mode (run, throttle, pause or suspend): " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg.starts_with("--idle-fps="))
+    {
+      if (!parse_number(arg.substr(arg.find('=') + 1), config.idle_fps) || config.idle_fps <= 0.0f)
+      {
+        std::cerr << "Invalid idle frame rate: " << arg << '\n';
+        return -1;
+      }
+    }
+    else if (arg == "--idle-unfocused")
+    {
+      config.idle_unfocused = true;
+    }
+    else if (arg == "--catch-up")
+    {
+      config.catch_up = true;
+    }
+    else
+    {
+      std::cerr << "Unknown option: " << arg << '\n';
+      return -1;
+    }
+  }
+
+  if (!config.capture_prefix.empty() && config.replay_file.empty())
+  {
+    std::cerr << "--capture only works with --replay\n";
+    return -1;
+  }
+
+  mr::run(config);
   return 0;
 }
 #endif
@@ -0,0 +1,439 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#if defined(MR_WINDOWS)
+#define NOMINMAX
+#include <Windows.h>
+#include <psapi.h>
+#elif defined(MR_LINUX)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace mr
+{
+
+  // Samples are collected at least this often, the queue is sized for it
+  static constexpr auto s_collect_interval = std::chrono::milliseconds(50);
+
+  static constexpr std::array s_quantiles = {0.5, 0.9, 0.99, 0.999};
+
+  static std::uint64_t get_resident_memory()
+  {
+#if defined(MR_WINDOWS)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return counters.WorkingSetSize;
+    return 0;
+#elif defined(MR_LINUX)
+    // Total and resident pages
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+      return resident * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    return 0;
+#else
+    return 0;
+#endif
+  }
+
+  metrics_exporter::metrics_exporter(const std::string_view file_name, const std::string_view socket_path, const float interval,
+                                     std::span<const std::string_view> pass_names, std::span<const control_setting> settings)
+      : m_file_name(file_name), m_socket_path(socket_path), m_interval(interval),
+        m_pass_names(pass_names.first(std::min(pass_names.size(), metrics_sample::s_max_passes))), m_settings(settings)
+  {
+  }
+
+  metrics_exporter::~metrics_exporter()
+  {
+    m_stop = true;
+    if (m_thread.joinable())
+      m_thread.join();
+
+    close_socket();
+  }
+
+  bool metrics_exporter::start()
+  {
+    if (!m_socket_path.empty() && !open_socket())
+      return false;
+
+    m_thread = std::thread(&metrics_exporter::run, this);
+    return true;
+  }
+
+  void metrics_exporter::push(const metrics_sample &sample)
+  {
+    if (!m_samples.push(sample))
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void metrics_exporter::run()
+  {
+    auto next_export = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_interval);
+
+    while (!m_stop)
+    {
+      poll_socket(s_collect_interval);
+      collect_samples();
+
+      if (std::chrono::steady_clock::now() >= next_export)
+      {
+        finish_interval();
+        write_file();
+        next_export += std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_interval);
+      }
+    }
+  }
+
+  void metrics_exporter::collect_samples()
+  {
+    for (metrics_sample s; m_samples.pop(s);)
+    {
+      m_frame_times.record(s.frame_time);
+      m_frames++;
+      m_cells += s.cells;
+      m_upload_bytes += s.upload_bytes;
+      m_draw_calls += s.draw_calls;
+      for (std::size_t i = 0; i < m_gpu_times.size(); ++i)
+      {
+        m_gpu_times[i] += s.gpu_times[i];
+        m_gpu_fragments[i] += s.gpu_fragments[i];
+      }
+      m_fragments_per_pixel += s.fragments_per_pixel;
+
+      m_total_frames++;
+      m_total_upload_bytes += s.upload_bytes;
+      m_total_frame_time += std::chrono::duration<double>(s.frame_time).count();
+      m_last_sample = s;
+    }
+  }
+
+  // Formats the metrics of the interval that just ended, and starts a new one
+  void metrics_exporter::finish_interval()
+  {
+    const double frames = std::max<double>(m_frames, 1.0);
+    std::ostringstream out;
+
+    out << "# HELP matrix_rain_frame_time_seconds Time from the start of a frame to the start of the next one, the quantiles are over the last interval\n"
+        << "# TYPE matrix_rain_frame_time_seconds summary\n";
+    for (const auto q : s_quantiles)
+      out << "matrix_rain_frame_time_seconds{quantile=\"" << q << "\"} " << m_frame_times.get_percentile(q * 100.0) / 1e3 << '\n';
+    out << "matrix_rain_frame_time_seconds_sum " << m_total_frame_time << '\n'
+        << "matrix_rain_frame_time_seconds_count " << m_total_frames << '\n';
+
+    out << "# HELP matrix_rain_frame_time_max_seconds Longest frame of the last interval\n"
+        << "# TYPE matrix_rain_frame_time_max_seconds gauge\n"
+        << "matrix_rain_frame_time_max_seconds " << m_frame_times.get_max() / 1e3 << '\n';
+
+    out << "# HELP matrix_rain_cells_per_frame Character cells drawn per frame, over the last interval\n"
+        << "# TYPE matrix_rain_cells_per_frame gauge\n"
+        << "matrix_rain_cells_per_frame " << m_cells / frames << '\n';
+
+    out << "# HELP matrix_rain_draw_calls_per_frame Draw calls per frame, over the last interval\n"
+        << "# TYPE matrix_rain_draw_calls_per_frame gauge\n"
+        << "matrix_rain_draw_calls_per_frame " << m_draw_calls / frames << '\n';
+
+    out << "# HELP matrix_rain_upload_bytes_per_frame Bytes uploaded to the GPU per frame, over the last interval\n"
+        << "# TYPE matrix_rain_upload_bytes_per_frame gauge\n"
+        << "matrix_rain_upload_bytes_per_frame " << m_upload_bytes / frames << '\n';
+
+    out << "# HELP matrix_rain_upload_bytes_total Bytes uploaded to the GPU\n"
+        << "# TYPE matrix_rain_upload_bytes_total counter\n"
+        << "matrix_rain_upload_bytes_total " << m_total_upload_bytes << '\n';
+
+    out << "# HELP matrix_rain_gpu_pass_seconds GPU time per frame of each pass, over the last interval\n"
+        << "# TYPE matrix_rain_gpu_pass_seconds gauge\n";
+    for (std::size_t i = 0; i < m_pass_names.size(); ++i)
+      out << "matrix_rain_gpu_pass_seconds{pass=\"" << m_pass_names[i] << "\"} " << m_gpu_times[i] / frames / 1e3 << '\n';
+
+    out << "# HELP matrix_rain_gpu_pass_fragments Fragments shaded per frame by each pass, over the last interval\n"
+        << "# TYPE matrix_rain_gpu_pass_fragments gauge\n";
+    for (std::size_t i = 0; i < m_pass_names.size(); ++i)
+      out << "matrix_rain_gpu_pass_fragments{pass=\"" << m_pass_names[i] << "\"} " << m_gpu_fragments[i] / frames << '\n';
+
+    out << "# HELP matrix_rain_fragments_per_pixel Fragments shaded per frame by all the passes, per pixel of the window, over the last interval\n"
+        << "# TYPE matrix_rain_fragments_per_pixel gauge\n"
+        << "matrix_rain_fragments_per_pixel " << m_fragments_per_pixel / frames << '\n';
+
+    out << "# HELP matrix_rain_quality_tier Quality tier, 0 is the best\n"
+        << "# TYPE matrix_rain_quality_tier gauge\n"
+        << "matrix_rain_quality_tier " << m_last_sample.tier << '\n';
+
+    out << "# HELP matrix_rain_quality_level Dynamic quality level, 0 is the best\n"
+        << "# TYPE matrix_rain_quality_level gauge\n"
+        << "matrix_rain_quality_level " << m_last_sample.quality_level << '\n';
+
+    out << "# HELP matrix_rain_gpu_memory_bytes Textures and buffers allocated, from their formats\n"
+        << "# TYPE matrix_rain_gpu_memory_bytes gauge\n"
+        << "matrix_rain_gpu_memory_bytes " << m_last_sample.gpu_memory << '\n';
+
+    out << "# HELP matrix_rain_gpu_memory_peak_bytes Most textures and buffers allocated at once since the start\n"
+        << "# TYPE matrix_rain_gpu_memory_peak_bytes gauge\n"
+        << "matrix_rain_gpu_memory_peak_bytes " << m_last_sample.gpu_memory_peak << '\n';
+
+    out << "# HELP matrix_rain_overlaps_avoided_total Strings the column scheduler moved or delayed so they don't overlap\n"
+        << "# TYPE matrix_rain_overlaps_avoided_total counter\n"
+        << "matrix_rain_overlaps_avoided_total " << m_last_sample.avoided_overlaps << '\n';
+
+    out << "# HELP matrix_rain_samples_dropped_total Frames left out of the metrics because the exporter fell behind\n"
+        << "# TYPE matrix_rain_samples_dropped_total counter\n"
+        << "matrix_rain_samples_dropped_total " << m_dropped.load(std::memory_order_relaxed) << '\n';
+
+    out << "# HELP process_resident_memory_bytes Resident memory size in bytes\n"
+        << "# TYPE process_resident_memory_bytes gauge\n"
+        << "process_resident_memory_bytes " << get_resident_memory() << '\n';
+
+    m_text = out.str();
+
+    m_frame_times.clear();
+    m_frames = m_cells = m_upload_bytes = m_draw_calls = 0;
+    m_gpu_times = {};
+    m_gpu_fragments = {};
+    m_fragments_per_pixel = 0.0;
+  }
+
+  // Written next to the file and renamed over it, a rename within a file system replaces the file atomically
+  void metrics_exporter::write_file() const
+  {
+    if (m_file_name.empty())
+      return;
+
+    const auto temp_name = m_file_name + ".tmp";
+    {
+      std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+      if (!(file << m_text))
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_name, m_file_name, ec);
+  }
+
+  void metrics_exporter::handle_command(client &c, const std::string_view line)
+  {
+    std::string reply;
+
+    if (line == "get stats")
+    {
+      // Before the first interval is over there's nothing to show yet. A comment, so it's still valid Prometheus text
+      reply = m_text.empty() ? "# no data yet, the first interval isn't over\n" : m_text;
+    }
+    else if (line.starts_with("set "))
+    {
+      const auto args = line.substr(4);
+      const auto name = args.substr(0, args.find(' '));
+      const auto value_text = name.size() < args.size() ? args.substr(name.size() + 1) : std::string_view{};
+
+      const auto setting = std::ranges::find(m_settings, name, &control_setting::name);
+      const auto value_end = value_text.data() + value_text.size();
+      float value = 0.0f;
+      bool valid = false;
+
+      if (setting != m_settings.end() && setting->integer)
+      {
+        std::int32_t integer = 0;
+        const auto [end, ec] = std::from_chars(value_text.data(), value_end, integer);
+        valid = ec == std::errc{} && end == value_end;
+        value = static_cast<float>(integer);
+      }
+      else
+      {
+        const auto [end, ec] = std::from_chars(value_text.data(), value_end, value);
+        valid = ec == std::errc{} && end == value_end;
+      }
+
+      if (setting == m_settings.end())
+        reply = "error: unknown setting\n";
+      else if (!valid || value < setting->min || value > setting->max)
+      {
+        std::ostringstream out;
+        out << "error: the value must be " << (setting->integer ? "an integer " : "") << "between " << setting->min << " and " << setting->max << '\n';
+        reply = out.str();
+      }
+      else if (!m_commands.push({static_cast<std::size_t>(setting - m_settings.begin()), value}))
+        reply = "error: busy, try again\n";
+      else
+        reply = "ok\n";
+    }
+    else
+    {
+      reply = "error: unknown command, use \"get stats\" or \"set <setting> <value>\"\n";
+    }
+
+#if defined(MR_LINUX)
+    // The socket has a send timeout, a client that doesn't read can't hold up the exporter for long
+    for (std::size_t sent = 0; sent < reply.size();)
+    {
+      const auto result = send(c.socket, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+      if (result <= 0)
+      {
+        close_client(c);
+        return;
+      }
+      sent += static_cast<std::size_t>(result);
+    }
+#else
+    (void)c;
+#endif
+  }
+
+#if defined(MR_LINUX)
+
+  bool metrics_exporter::open_socket()
+  {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (m_socket_path.size() >= sizeof(address.sun_path))
+      return false;
+
+    std::memcpy(address.sun_path, m_socket_path.data(), m_socket_path.size());
+
+    m_listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_socket < 0)
+      return false;
+
+    // A socket left behind by an instance that didn't exit cleanly would make bind fail. Anything else at that path
+    // is most likely a typo, and is left alone
+    struct stat status;
+    if (lstat(m_socket_path.c_str(), &status) == 0)
+    {
+      if (!S_ISSOCK(status.st_mode))
+      {
+        std::cerr << "Not a socket, won't replace it: " << m_socket_path << '\n';
+        close(m_listen_socket);
+        m_listen_socket = -1;
+        return false;
+      }
+
+      unlink(m_socket_path.c_str());
+    }
+
+    if (bind(m_listen_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || listen(m_listen_socket, s_max_clients) != 0)
+    {
+      close(m_listen_socket);
+      m_listen_socket = -1;
+      return false;
+    }
+
+    return true;
+  }
+
+  void metrics_exporter::close_socket()
+  {
+    if (m_listen_socket < 0)
+      return;
+
+    for (auto &c : m_clients)
+      close_client(c);
+
+    close(m_listen_socket);
+    m_listen_socket = -1;
+    unlink(m_socket_path.c_str());
+  }
+
+  void metrics_exporter::close_client(client &c)
+  {
+    if (c.socket >= 0)
+      close(c.socket);
+    c = {};
+  }
+
+  // Waits for the sockets up to the timeout, accepting clients and running their complete lines
+  void metrics_exporter::poll_socket(const std::chrono::milliseconds timeout)
+  {
+    if (m_listen_socket < 0)
+    {
+      std::this_thread::sleep_for(timeout);
+      return;
+    }
+
+    std::array<pollfd, s_max_clients + 1> fds{};
+    fds[0] = {.fd = m_listen_socket, .events = POLLIN, .revents = 0};
+    for (std::size_t i = 0; i < s_max_clients; ++i)
+      fds[i + 1] = {.fd = m_clients[i].socket, .events = POLLIN, .revents = 0}; // Negative ones are ignored
+
+    if (poll(fds.data(), fds.size(), static_cast<int>(timeout.count())) <= 0)
+      return;
+
+    for (std::size_t i = 0; i < s_max_clients; ++i)
+    {
+      auto &c = m_clients[i];
+      if (c.socket < 0 || fds[i + 1].revents == 0)
+        continue;
+
+      std::array<char, s_max_line> buffer;
+      const auto result = recv(c.socket, buffer.data(), buffer.size(), 0);
+      if (result <= 0)
+      {
+        close_client(c);
+        continue;
+      }
+
+      for (std::size_t j = 0; j < static_cast<std::size_t>(result) && c.socket >= 0; ++j)
+      {
+        if (buffer[j] == '\n')
+        {
+          auto line = std::string_view(c.line.data(), c.length);
+          if (line.ends_with('\r'))
+            line.remove_suffix(1);
+
+          c.length = 0;
+          handle_command(c, line);
+        }
+        else if (c.length < c.line.size())
+        {
+          c.line[c.length++] = buffer[j];
+        }
+        else
+        {
+          close_client(c); // Not a command anyway
+        }
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      const auto socket = accept4(m_listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+      if (socket < 0)
+        return;
+
+      const auto free = std::ranges::find(m_clients, -1, &client::socket);
+      if (free == m_clients.end())
+      {
+        close(socket);
+        return;
+      }
+
+      const timeval send_timeout{.tv_sec = 0, .tv_usec = 100000};
+      setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+      free->socket = socket;
+    }
+  }
+
+#else
+
+  // No Unix domain sockets, only the file
+  bool metrics_exporter::open_socket() { return false; }
+  void metrics_exporter::close_socket() {}
+  void metrics_exporter::close_client(client &) {}
+
+  void metrics_exporter::poll_socket(const std::chrono::milliseconds timeout)
+  {
+    std::this_thread::sleep_for(timeout);
+  }
+
+#endif
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "common.h"
+
+namespace mr
+{
+
+  // A rendered frame, as the render thread hands it to the exporter
+  struct metrics_sample
+  {
+    static constexpr std::size_t s_max_passes = 8;
+
+    std::chrono::nanoseconds frame_time{};
+    std::array<float, s_max_passes> gpu_times{}; // ms, of a frame a few frames older
+    std::array<float, s_max_passes> gpu_fragments{}; // Fragments shaded, same frame
+    float fragments_per_pixel = 0.0f;
+    std::uint32_t cells = 0;
+    std::uint32_t upload_bytes = 0;
+    std::uint32_t draw_calls = 0;
+    std::uint32_t tier = 0;
+    std::uint32_t quality_level = 0;
+    std::uint64_t gpu_memory = 0; // Bytes, as accounted by gpu_memory
+    std::uint64_t gpu_memory_peak = 0;
+    std::uint64_t avoided_overlaps = 0; // Since the start
+  };
+
+  // A setting that can be changed through the control socket, with its range. Integer settings reject fractions
+  struct control_setting
+  {
+    std::string_view name;
+    float min, max;
+    bool integer = false;
+  };
+
+  // A checked "set" command, for the render thread to apply. The setting is an index in the list given to the exporter
+  struct control_command
+  {
+    std::size_t setting = 0;
+    float value = 0.0f;
+  };
+
+  // Collects the frame samples on a thread of its own, and every interval writes them to a file in the Prometheus text
+  // format: frame time quantiles (over the interval), cells, uploads and draw calls per frame, GPU time and fragments
+  // per pass, fragments per pixel, the overlaps avoided, the GPU memory and the resident memory. The file is replaced with a rename, so it's
+  // never read half written.
+  //
+  // It also listens on a Unix domain socket (Linux only) for one command per line: "get stats" answers with the
+  // metrics of the last interval, "set <setting> <value>" queues a command for the render thread and answers "ok".
+  //
+  // The render thread only ever pushes to and pops from lock-free queues. If the sample queue is full the sample is
+  // dropped (and counted), the frame never waits
+  class metrics_exporter
+  {
+  private:
+    static constexpr std::size_t s_max_clients = 4;
+    static constexpr std::size_t s_max_line = 256;
+
+    struct client
+    {
+      std::int32_t socket = -1;
+      std::size_t length = 0;
+      std::array<char, s_max_line> line{};
+    };
+
+    std::string m_file_name;
+    std::string m_socket_path;
+    std::chrono::duration<float> m_interval;
+    std::span<const std::string_view> m_pass_names;
+    std::span<const control_setting> m_settings;
+
+    spsc_queue<metrics_sample, 1024> m_samples;
+    spsc_queue<control_command, 64> m_commands;
+    std::atomic<std::uint64_t> m_dropped = 0;
+
+    std::thread m_thread;
+    std::atomic<bool> m_stop = false;
+    std::int32_t m_listen_socket = -1;
+    std::array<client, s_max_clients> m_clients;
+
+    // Over the current interval, and since the start
+    duration_histogram m_frame_times;
+    std::uint64_t m_frames = 0;
+    std::uint64_t m_cells = 0, m_upload_bytes = 0, m_draw_calls = 0;
+    std::array<double, metrics_sample::s_max_passes> m_gpu_times{};
+    std::array<double, metrics_sample::s_max_passes> m_gpu_fragments{};
+    double m_fragments_per_pixel = 0.0;
+    std::uint64_t m_total_frames = 0, m_total_upload_bytes = 0;
+    double m_total_frame_time = 0.0; // Seconds
+    metrics_sample m_last_sample;
+
+    std::string m_text; // Metrics of the last interval
+
+    void run();
+    void collect_samples();
+    void finish_interval();
+    void write_file() const;
+
+    bool open_socket();
+    void close_socket();
+    void poll_socket(const std::chrono::milliseconds timeout);
+    void handle_command(client &c, const std::string_view line);
+    void close_client(client &c);
+
+  public:
+    metrics_exporter(const std::string_view file_name, const std::string_view socket_path, const float interval,
+                     std::span<const std::string_view> pass_names, std::span<const control_setting> settings);
+    ~metrics_exporter();
+
+    metrics_exporter(const metrics_exporter &) = delete;
+    metrics_exporter &operator=(const metrics_exporter &) = delete;
+
+    // Opens the socket, if any, and starts the thread. Returns false if the socket can't be opened
+    bool start();
+
+    // Render thread only
+    void push(const metrics_sample &sample);
+    bool pop_command(control_command &command) { return m_commands.pop(command); }
+  };
+
+}
@@ -0,0 +1,169 @@
+#include "replay.h"
+
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include <glad/glad.h>
+
+namespace mr
+{
+
+  static constexpr std::string_view s_replay_header = "mr-replay 1";
+
+  // The intro text goes on a single line
+  static std::string escape_line(const std::string_view text)
+  {
+    std::string result;
+    for (const char c : text)
+    {
+      if (c == '\\')
+        result += "\\\\";
+      else if (c == '\n')
+        result += "\\n";
+      else if (c == '\r')
+        result += "\\r";
+      else
+        result += c;
+    }
+    return result;
+  }
+
+  static std::string unescape_line(const std::string_view line)
+  {
+    std::string result;
+    for (std::size_t i = 0; i < line.size(); ++i)
+    {
+      if (line[i] != '\\' || i + 1 == line.size())
+      {
+        result += line[i];
+        continue;
+      }
+
+      const char c = line[++i];
+      result += c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+    }
+    return result;
+  }
+
+  replay_writer::replay_writer(const std::string_view file_name, const launch_config &config) : m_file(std::string(file_name))
+  {
+    if (!m_file.is_open())
+      return;
+
+    // Enough digits to read back exactly the same floats
+    m_file << std::setprecision(std::numeric_limits<float>::max_digits10);
+
+    m_file << s_replay_header << '\n';
+    m_file << "seed " << config.seed << '\n';
+    m_file << "columns " << config.columns << '\n';
+    m_file << "density " << config.density << '\n';
+
+    m_file << "layers";
+    for (const auto depth : config.depth_layers)
+      m_file << ' ' << depth;
+    m_file << '\n';
+
+    m_file << "uniform-columns " << config.uniform_columns << '\n';
+    m_file << "stress " << config.stress_strings << '\n';
+
+    if (!config.intro_text.empty())
+      m_file << "intro-text " << escape_line(config.intro_text) << '\n';
+  }
+
+  void replay_writer::write(const replay_event &e)
+  {
+    switch (e.type)
+    {
+    case replay_event::types::frame:
+      m_file << "frame " << e.steps << ' ' << e.alpha << '\n';
+      break;
+    case replay_event::types::resize:
+      m_file << "resize " << e.width << ' ' << e.height << '\n';
+      break;
+    }
+  }
+
+  bool replay_reader::load(const std::string_view file_name, launch_config &config)
+  {
+    std::ifstream file{std::string(file_name)};
+    if (!file.is_open())
+      return false;
+
+    std::string line;
+    if (!std::getline(file, line) || line != s_replay_header)
+      return false;
+
+    m_events.clear();
+    m_next = 0;
+
+    while (std::getline(file, line))
+    {
+      std::istringstream ss(line);
+      std::string key;
+      ss >> key;
+
+      if (key == "frame")
+      {
+        replay_event e{.type = replay_event::types::frame};
+        ss >> e.steps >> e.alpha;
+        m_events.push_back(e);
+      }
+      else if (key == "resize")
+      {
+        replay_event e{.type = replay_event::types::resize};
+        ss >> e.width >> e.height;
+        m_events.push_back(e);
+      }
+      else if (key == "seed")
+        ss >> config.seed;
+      else if (key == "columns")
+        ss >> config.columns;
+      else if (key == "density")
+        ss >> config.density;
+      else if (key == "uniform-columns")
+        ss >> config.uniform_columns;
+      else if (key == "stress")
+        ss >> config.stress_strings;
+      else if (key == "intro-text")
+      {
+        // Only the separator is skipped, the text can start with spaces
+        ss.get();
+        std::string text;
+        std::getline(ss, text);
+        config.intro_text = unescape_line(text);
+      }
+      else if (key == "layers")
+      {
+        config.depth_layers.clear();
+        for (float depth; ss >> depth;)
+          config.depth_layers.push_back(depth);
+      }
+      else
+        return false;
+
+      if (ss.fail() && key != "layers" && key != "intro-text")
+        return false;
+    }
+
+    return !config.depth_layers.empty();
+  }
+
+  void capture_frame(const std::string_view file_name, const std::int32_t width, const std::int32_t height)
+  {
+    std::vector<unsigned char> pixels(static_cast<std::size_t>(width) * height * 3);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    std::ofstream file(std::string(file_name), std::ios::binary);
+    file << "P6\n" << width << ' ' << height << "\n255\n";
+
+    // OpenGL rows go bottom to top
+    for (std::int32_t y = height - 1; y >= 0; --y)
+      file.write(reinterpret_cast<const char *>(pixels.data()) + static_cast<std::size_t>(y) * width * 3, width * 3);
+  }
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string_view>
+#include <vector>
+
+#include "application.h"
+
+namespace mr
+{
+
+  // A replay is a text file with the launch settings that affect the simulation (seed, rain layout, intro), followed
+  // by what happened in each frame: how many fixed steps were simulated, the interpolation factor used to render
+  // it, and the window resizes in between. With the same fonts, a replay renders exactly the same frames
+  struct replay_event
+  {
+    enum class types
+    {
+      frame,
+      resize
+    };
+
+    types type = types::frame;
+    std::int32_t steps = 0;
+    float alpha = 0.0f;
+    std::int32_t width = 0, height = 0;
+  };
+
+  class replay_writer
+  {
+  private:
+    std::ofstream m_file;
+
+  public:
+    replay_writer(const std::string_view file_name, const launch_config &config);
+
+    bool is_open() const { return m_file.is_open(); }
+    void write(const replay_event &e);
+  };
+
+  class replay_reader
+  {
+  private:
+    std::vector<replay_event> m_events;
+    std::size_t m_next = 0;
+
+  public:
+    // Reads the whole file, and replaces the simulation settings in config with the recorded ones
+    bool load(const std::string_view file_name, launch_config &config);
+
+    // Both return nullptr at the end of the replay
+    const replay_event *peek() const { return m_next < m_events.size() ? &m_events[m_next] : nullptr; }
+    const replay_event *next() { return m_next < m_events.size() ? &m_events[m_next++] : nullptr; }
+  };
+
+  // Writes the content of the default framebuffer to a binary PPM file
+  void capture_frame(const std::string_view file_name, const std::int32_t width, const std::int32_t height);
+
+}
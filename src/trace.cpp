@@ -0,0 +1,232 @@
+#include "trace.h"
+
+#ifdef MR_PROFILE
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+
+namespace mr
+{
+  namespace trace
+  {
+    struct event
+    {
+      const char *name;
+      std::int64_t start; // ns, on the CPU clock
+      std::int64_t duration;
+      std::uint32_t thread;
+      std::uint32_t frame;
+    };
+
+    struct gpu_zone
+    {
+      const char *name;
+      std::uint32_t frame;
+    };
+
+    // Events are written to a buffer that is allocated up front, anything past it is dropped. GPU zones wait in a
+    // ring until their queries are ready, each one with a pair of timestamp queries
+    static constexpr std::size_t s_max_events = 1 << 18;
+    static constexpr std::size_t s_max_gpu_zones = 4096;
+    static constexpr std::size_t s_max_threads = 8;
+    static constexpr std::uint32_t s_gpu_thread = 0; // The GPU shows up as a thread of its own
+
+    static std::ofstream s_file;
+    static std::chrono::steady_clock::time_point s_origin;
+
+    static std::vector<event> s_events;
+    static std::atomic<std::size_t> s_event_count = 0;
+    static std::atomic<std::size_t> s_dropped = 0;
+    static std::atomic<bool> s_recording = false;
+    static std::atomic<std::uint32_t> s_open_zones = 0; // Recording zones, close waits for them to be written
+    static std::atomic<std::uint32_t> s_frame = 0;
+
+    static std::array<const char *, s_max_threads> s_thread_names = {"GPU"};
+    static std::atomic<std::uint32_t> s_thread_count = 1;
+    static thread_local std::uint32_t t_thread = 0;
+
+    // Render thread only
+    static std::vector<GLuint> s_queries;
+    static std::array<gpu_zone, s_max_gpu_zones> s_gpu_zones;
+    static std::size_t s_gpu_first = 0, s_gpu_end = 0; // Zones in flight, as running counts
+    static std::int64_t s_gpu_offset = 0;              // From the GPU clock to the CPU one, ns
+
+    static std::int64_t get_time()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_origin).count();
+    }
+
+    static std::uint32_t get_thread()
+    {
+      if (t_thread == 0)
+        t_thread = std::min<std::uint32_t>(s_thread_count++, s_max_threads - 1);
+      return t_thread;
+    }
+
+    static void add_event(const event &e)
+    {
+      const auto index = s_event_count.fetch_add(1, std::memory_order_relaxed);
+      if (index < s_events.size())
+        s_events[index] = e;
+      else
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The timestamps are mapped to the CPU clock with the offset measured when the recording started
+    static void collect_gpu_zones(const bool wait)
+    {
+      for (; s_gpu_first < s_gpu_end; ++s_gpu_first)
+      {
+        const auto index = s_gpu_first % s_max_gpu_zones;
+        const auto q_begin = s_queries[index * 2], q_end = s_queries[index * 2 + 1];
+
+        if (!wait)
+        {
+          GLint available = GL_FALSE;
+          glGetQueryObjectiv(q_end, GL_QUERY_RESULT_AVAILABLE, &available);
+          if (available != GL_TRUE)
+            return;
+        }
+
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(q_begin, GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(q_end, GL_QUERY_RESULT, &end);
+
+        const auto &z = s_gpu_zones[index];
+        add_event({z.name, static_cast<std::int64_t>(begin) + s_gpu_offset, static_cast<std::int64_t>(end - begin), s_gpu_thread, z.frame});
+      }
+    }
+
+    bool open(const std::string_view file_name)
+    {
+      s_file.open(std::string(file_name));
+      if (!s_file)
+        return false;
+
+      s_origin = std::chrono::steady_clock::now();
+      s_events.resize(s_max_events);
+      s_queries.resize(s_max_gpu_zones * 2);
+      glGenQueries(s_queries.size(), s_queries.data());
+      return true;
+    }
+
+    bool begin_frame(const std::size_t frame, const std::size_t first, const std::size_t last)
+    {
+      const bool record = frame >= first && frame <= last;
+
+      if (record && !s_recording)
+      {
+        GLint64 gpu_time = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpu_time);
+        s_gpu_offset = get_time() - gpu_time;
+      }
+
+      s_frame = static_cast<std::uint32_t>(frame);
+      s_recording = record;
+
+      collect_gpu_zones(false);
+      return frame > last && s_gpu_first == s_gpu_end;
+    }
+
+    void close()
+    {
+      if (!s_file.is_open())
+        return;
+
+      // No zone opens after this, and the ones that are open are short (none of them waits for another thread), so
+      // they're simply waited for
+      s_recording = false;
+      while (s_open_zones.load(std::memory_order_acquire) > 0)
+        std::this_thread::yield();
+
+      collect_gpu_zones(true);
+
+      const auto count = std::min(s_event_count.load(), s_events.size());
+      const auto thread_count = std::min<std::size_t>(s_thread_count, s_max_threads);
+
+      // Chrome trace event format, timestamps in microseconds
+      s_file << std::fixed << std::setprecision(3);
+      s_file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+      for (std::size_t i = 0; i < thread_count; ++i)
+      {
+        s_file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << i << ",\"args\":{\"name\":\""
+               << (s_thread_names[i] ? s_thread_names[i] : "thread") << "\"}},\n";
+      }
+
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        const auto &e = s_events[i];
+        s_file << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.thread
+               << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << e.duration / 1000.0
+               << ",\"args\":{\"frame\":" << e.frame << "}}" << (i + 1 < count ? ",\n" : "\n");
+      }
+
+      s_file << "]}\n";
+      s_file.close();
+
+      if (s_dropped > 0)
+        std::cerr << "The trace is missing " << s_dropped << " events, record fewer frames\n";
+
+      glDeleteQueries(s_queries.size(), s_queries.data());
+      s_queries = {};
+    }
+
+    void set_thread_name(const char *name)
+    {
+      s_thread_names[get_thread()] = name;
+    }
+
+    zone::zone(const char *name, const bool gpu) : m_name(name)
+    {
+      if (!s_recording.load(std::memory_order_relaxed))
+        return;
+
+      // Counted before checking again, so close either sees the zone or the zone sees that recording stopped
+      s_open_zones.fetch_add(1);
+      if (!s_recording)
+      {
+        s_open_zones.fetch_sub(1, std::memory_order_release);
+        return;
+      }
+
+      m_start = get_time();
+
+      if (gpu && s_gpu_end - s_gpu_first < s_max_gpu_zones)
+      {
+        const auto index = s_gpu_end++ % s_max_gpu_zones;
+        s_gpu_zones[index] = {name, s_frame.load(std::memory_order_relaxed)};
+        glQueryCounter(s_queries[index * 2], GL_TIMESTAMP);
+        m_gpu_query = static_cast<std::int32_t>(index);
+      }
+      else if (gpu)
+      {
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    zone::~zone()
+    {
+      if (m_start < 0)
+        return;
+
+      if (m_gpu_query >= 0)
+        glQueryCounter(s_queries[m_gpu_query * 2 + 1], GL_TIMESTAMP);
+
+      add_event({m_name, m_start, get_time() - m_start, get_thread(), s_frame.load(std::memory_order_relaxed)});
+      s_open_zones.fetch_sub(1, std::memory_order_release);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Instrumentation zones, for --trace. They are only compiled with MR_PROFILE (the Debug and Profile configurations),
+// in Release they expand to nothing. A zone times its scope on the CPU, and a GPU zone also on the GPU, with
+// timestamp queries that are read back a few frames later, so the GPU is never waited for. Names must be literals,
+// and GPU zones can only be opened on the render thread
+#ifdef MR_PROFILE
+#define MR_TRACE_CONCAT_IMPL(a, b) a##b
+#define MR_TRACE_CONCAT(a, b) MR_TRACE_CONCAT_IMPL(a, b)
+#define MR_TRACE_ZONE(name) const ::mr::trace::zone MR_TRACE_CONCAT(mr_trace_zone_, __LINE__)(name, false)
+#define MR_TRACE_GPU_ZONE(name) const ::mr::trace::zone MR_TRACE_CONCAT(mr_trace_zone_, __LINE__)(name, true)
+#else
+#define MR_TRACE_ZONE(name)
+#define MR_TRACE_GPU_ZONE(name)
+#endif
+
+#ifdef MR_PROFILE
+namespace mr
+{
+  namespace trace
+  {
+    // Opens the output file and makes room for the events, so recording doesn't allocate. Needs the OpenGL context,
+    // like every other function but zones on the CPU only
+    bool open(const std::string_view file_name);
+
+    // Called by the render thread at the start of every frame: records the zones while the frame is in the given
+    // range (inclusive), and collects the GPU times that are ready. Returns true when the range is over and all the
+    // times came back, then the trace can be written
+    bool begin_frame(const std::size_t frame, const std::size_t first, const std::size_t last);
+
+    // Writes the trace, waiting for the GPU times still missing, and closes the file
+    void close();
+
+    // Names the calling thread in the trace
+    void set_thread_name(const char *name);
+
+    class zone
+    {
+    private:
+      const char *m_name;
+      std::int64_t m_start = -1; // ns, -1 if not recording
+      std::int32_t m_gpu_query = -1;
+
+    public:
+      zone(const char *name, const bool gpu);
+      ~zone();
+
+      zone(const zone &) = delete;
+      zone &operator=(const zone &) = delete;
+    };
+  }
+}
+#endif